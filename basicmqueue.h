@@ -0,0 +1,363 @@
+#ifndef BASICMQUEUE_H
+#define BASICMQUEUE_H
+
+#include "mqueue.h"
+#include <functional>
+#include <utility>
+#include <vector>
+
+//
+// Structure policies
+//
+// Each policy merges two heap-ordered trees of Nodes and removes a root.
+// Both keep m_parent pointing at the node whose m_left or m_right links to a
+// node, and return a root whose m_parent is nullptr. Compare is applied to
+// the cached node keys: Compare(a, b) is true when a must sit above b, so
+// std::less<int> gives a MINHEAP and std::greater<int> a MAXHEAP. MQueue
+// dispatches to these once per merge; BasicMQueue binds them at compile time.
+//
+struct SkewPolicy {
+    static const STRUCTURE structure = SKEW;
+
+    // Top-down skew merge: walks the right paths of both heaps once, hanging
+    // the winner of each step on the left and moving its old left child to
+    // the right, which is exactly the recursive merge-then-swap without
+    // recursion
+    template <class Compare>
+    static Node* merge(Node* node1, Node* node2, const Compare& compare) {
+        Node* root = nullptr;
+        Node** link = &root;
+        Node* owner = nullptr;
+        while (node1 && node2) {
+            if (compare(node2->m_key, node1->m_key)) std::swap(node1, node2);
+            node1->m_count += node2->m_count;
+            *link = node1;
+            node1->m_parent = owner;
+            Node* right = node1->m_right;
+            node1->m_right = node1->m_left;
+            link = &node1->m_left;
+            owner = node1;
+            node1 = right;
+        }
+        *link = node1 ? node1 : node2;
+        if (*link) (*link)->m_parent = owner;
+        return root;
+    }
+    template <class Compare>
+    static Node* removeRoot(Node* root, const Compare& compare) {
+        if (root->m_left && root->m_right) return merge(root->m_left, root->m_right, compare);
+        Node* child = root->m_left ? root->m_left : root->m_right;
+        if (child) child->m_parent = nullptr;
+        return child;
+    }
+};
+
+struct LeftistPolicy {
+    static const STRUCTURE structure = LEFTIST;
+
+    // Leftist merge in two passes: the way down merges the right spines and
+    // temporarily reverses each m_right link to point at the parent, the way
+    // back restores the links while swapping children and updating NPLs
+    template <class Compare>
+    static Node* merge(Node* node1, Node* node2, const Compare& compare) {
+        Node* parent = nullptr;
+        while (node1 && node2) {
+            if (compare(node2->m_key, node1->m_key)) std::swap(node1, node2);
+            node1->m_count += node2->m_count;
+            Node* right = node1->m_right;
+            node1->m_right = parent;
+            parent = node1;
+            node1 = right;
+        }
+        Node* child = node1 ? node1 : node2;
+        while (parent) {
+            Node* up = parent->m_right;
+            parent->m_right = child;
+            child->m_parent = parent;
+            if (!parent->m_left || parent->m_left->m_npl < parent->m_right->m_npl) {
+                std::swap(parent->m_left, parent->m_right);
+            }
+            parent->m_npl = parent->m_right ? parent->m_right->m_npl + 1 : 0;
+            child = parent;
+            parent = up;
+        }
+        child->m_parent = nullptr;
+        return child;
+    }
+    template <class Compare>
+    static Node* removeRoot(Node* root, const Compare& compare) {
+        if (root->m_left && root->m_right) return merge(root->m_left, root->m_right, compare);
+        Node* child = root->m_left ? root->m_left : root->m_right;
+        if (child) child->m_parent = nullptr;
+        return child;
+    }
+};
+
+// Pairing heap in left-child/right-sibling form: m_left is a node's first
+// child and m_right its next sibling; a root has no sibling. Meld is O(1),
+// the loser simply becomes the first child of the winner. Removing the
+// root melds its children with the two-pass pairing rule.
+struct PairingPolicy {
+    static const STRUCTURE structure = PAIRING;
+
+    template <class Compare>
+    static Node* merge(Node* node1, Node* node2, const Compare& compare) {
+        if (compare(node2->m_key, node1->m_key)) std::swap(node1, node2);
+        node1->m_count += node2->m_count;
+        node2->m_right = node1->m_left;
+        if (node2->m_right) node2->m_right->m_parent = node2;
+        node1->m_left = node2;
+        node2->m_parent = node1;
+        node1->m_right = nullptr;
+        node1->m_parent = nullptr;
+        return node1;
+    }
+    template <class Compare>
+    static Node* removeRoot(Node* root, const Compare& compare) {
+        return mergePairs(root->m_left, compare);
+    }
+    // First pass melds siblings in pairs from left to right and stacks the
+    // results; the second pass melds the stack from right to left
+    template <class Compare>
+    static Node* mergePairs(Node* first, const Compare& compare) {
+        Node* pairs = nullptr;
+        while (first) {
+            Node* node1 = first;
+            Node* node2 = node1->m_right;
+            if (!node2) {
+                node1->m_right = pairs;
+                pairs = node1;
+                break;
+            }
+            first = node2->m_right;
+            Node* melded = merge(node1, node2, compare);
+            melded->m_right = pairs;
+            pairs = melded;
+        }
+        Node* root = nullptr;
+        while (pairs) {
+            Node* next = pairs->m_right;
+            pairs->m_right = nullptr;
+            root = root ? merge(root, pairs, compare) : pairs;
+            pairs = next;
+        }
+        if (root) root->m_parent = nullptr;
+        return root;
+    }
+};
+
+// Implicit d-ary heap over a DaryEntry array. A 4-ary heap is half as deep
+// as a binary one, and the four children of a slot are adjacent in memory,
+// so a sift-down scans one cache line per level instead of chasing
+// pointers.
+struct DaryPolicy {
+    static const STRUCTURE structure = DARY;
+    static const size_t ARITY = DARYARITY;
+
+    template <class Compare>
+    static void siftUp(DaryEntry* heap, size_t pos, const Compare& compare) {
+        DaryEntry entry = heap[pos];
+        while (pos > 0) {
+            size_t parent = (pos - 1) / ARITY;
+            if (!compare(entry.key, heap[parent].key)) break;
+            heap[pos] = heap[parent];
+            pos = parent;
+        }
+        heap[pos] = entry;
+    }
+    template <class Compare>
+    static void siftDown(DaryEntry* heap, size_t size, size_t pos, const Compare& compare) {
+        DaryEntry entry = heap[pos];
+        for (;;) {
+            size_t first = pos * ARITY + 1;
+            if (first >= size) break;
+            size_t last = first + ARITY < size ? first + ARITY : size;
+            size_t best = first;
+            for (size_t child = first + 1; child < last; ++child) {
+                if (compare(heap[child].key, heap[best].key)) best = child;
+            }
+            if (!compare(heap[best].key, entry.key)) break;
+            heap[pos] = heap[best];
+            pos = best;
+        }
+        heap[pos] = entry;
+    }
+    // Bottom-up (Floyd) construction, O(n)
+    template <class Compare>
+    static void heapify(DaryEntry* heap, size_t size, const Compare& compare) {
+        if (size < 2) return;
+        for (size_t pos = (size - 2) / ARITY + 1; pos-- > 0;) {
+            siftDown(heap, size, pos, compare);
+        }
+    }
+};
+
+// Key extractor that forwards to a priority function pointer; it lets a
+// BasicMQueue reproduce MQueue's behaviour exactly
+struct FunctionKey {
+    FunctionKey(prifn_t fn = nullptr) : m_fn(fn) {}
+    int operator()(const Order& order) const {return m_fn(order);}
+    prifn_t m_fn;
+};
+
+//
+// BasicMQueue class
+//
+// The compile-time counterpart of MQueue. Key is a functor returning the
+// priority of an Order, Compare orders two keys and Structure is SkewPolicy,
+// LeftistPolicy or PairingPolicy. The key extractor and comparator are inlined and there
+// is no branch on heap type or structure in the merge loop. Orders with a
+// negative key are rejected, as in MQueue.
+//
+template <class Key, class Compare = std::less<int>, class Structure = LeftistPolicy>
+class BasicMQueue {
+public:
+    explicit BasicMQueue(const Key& key = Key(), const Compare& compare = Compare())
+        : m_heap(nullptr), m_size(0), m_key(key), m_compare(compare) {}
+    template <class InputIt>
+    BasicMQueue(InputIt first, InputIt last, const Key& key = Key(),
+                const Compare& compare = Compare())
+        : m_heap(nullptr), m_size(0), m_key(key), m_compare(compare) {
+        insertOrders(first, last);
+    }
+    BasicMQueue(const BasicMQueue& rhs)
+        : m_heap(copyNodes(rhs.m_heap)), m_size(rhs.m_size),
+          m_key(rhs.m_key), m_compare(rhs.m_compare) {}
+    BasicMQueue& operator=(const BasicMQueue& rhs) {
+        if (this != &rhs) {
+            clear();
+            m_key = rhs.m_key;
+            m_compare = rhs.m_compare;
+            m_heap = copyNodes(rhs.m_heap);
+            m_size = rhs.m_size;
+        }
+        return *this;
+    }
+    BasicMQueue(BasicMQueue&& rhs) noexcept
+        : m_heap(rhs.m_heap), m_size(rhs.m_size), m_key(rhs.m_key), m_compare(rhs.m_compare) {
+        rhs.m_heap = nullptr;
+        rhs.m_size = 0;
+    }
+    BasicMQueue& operator=(BasicMQueue&& rhs) noexcept {
+        if (this != &rhs) {
+            clear();
+            m_key = rhs.m_key;
+            m_compare = rhs.m_compare;
+            m_heap = rhs.m_heap;
+            m_size = rhs.m_size;
+            rhs.m_heap = nullptr;
+            rhs.m_size = 0;
+        }
+        return *this;
+    }
+    ~BasicMQueue() {clear();}
+
+    bool insertOrder(Order input) {
+        int key = m_key(input);
+        if (key < 0) return false;
+        m_heap = merge(m_heap, new Node(std::move(input), key));
+        ++m_size;
+        return true;
+    }
+    // Linear-time bulk insert; returns how many orders were accepted
+    template <class InputIt>
+    int insertOrders(InputIt first, InputIt last) {
+        std::vector<Node*> nodes;
+        for (; first != last; ++first) {
+            int key = m_key(*first);
+            if (key >= 0) nodes.push_back(new Node(*first, key));
+        }
+        int count = (int)nodes.size();
+        m_heap = merge(m_heap, heapify(nodes));
+        m_size += count;
+        return count;
+    }
+    Order getNextOrder() {
+        if (!m_heap) throw std::out_of_range("Queue is empty");
+        Order nextOrder = std::move(m_heap->m_order);
+        Node* oldRoot = m_heap;
+        m_heap = Structure::removeRoot(m_heap, m_compare);
+        delete oldRoot;
+        --m_size;
+        return nextOrder;
+    }
+    void mergeWithQueue(BasicMQueue& rhs) {
+        if (this == &rhs) throw std::domain_error("Cannot merge queue with itself.");
+        m_heap = merge(m_heap, rhs.m_heap);
+        m_size += rhs.m_size;
+        rhs.m_heap = nullptr;
+        rhs.m_size = 0;
+    }
+    void clear() {
+        // Rotate left children up and free the resulting right chain
+        Node* node = m_heap;
+        while (node) {
+            if (node->m_left) {
+                Node* left = node->m_left;
+                node->m_left = left->m_right;
+                left->m_right = node;
+                node = left;
+            } else {
+                Node* next = node->m_right;
+                delete node;
+                node = next;
+            }
+        }
+        m_heap = nullptr;
+        m_size = 0;
+    }
+    int numOrders() const {return m_size;}
+    STRUCTURE getStructure() const {return Structure::structure;}
+
+private:
+    Node* m_heap;       // root of the heap
+    int m_size;         // number of orders
+    Key m_key;          // priority of an order
+    Compare m_compare;  // true when the first key has the higher priority
+
+    Node* merge(Node* node1, Node* node2) {
+        if (!node1) return node2;
+        if (!node2) return node1;
+        return Structure::merge(node1, node2, m_compare);
+    }
+    // Pairwise merging rounds, O(n) in total
+    Node* heapify(std::vector<Node*>& nodes) {
+        size_t count = nodes.size();
+        if (count == 0) return nullptr;
+        while (count > 1) {
+            size_t out = 0;
+            for (size_t i = 0; i + 1 < count; i += 2) {
+                nodes[out++] = merge(nodes[i], nodes[i + 1]);
+            }
+            if (count % 2 == 1) nodes[out++] = nodes[count - 1];
+            count = out;
+        }
+        return nodes[0];
+    }
+    static Node* copyNodes(const Node* node) {
+        if (!node) return nullptr;
+        Node* root = new Node(node->m_order, node->m_key);
+        std::vector<std::pair<const Node*, Node*> > stack;
+        stack.push_back(std::make_pair(node, root));
+        while (!stack.empty()) {
+            const Node* source = stack.back().first;
+            Node* copy = stack.back().second;
+            stack.pop_back();
+            copy->m_npl = source->m_npl;
+            copy->m_count = source->m_count;
+            if (source->m_right) {
+                copy->m_right = new Node(source->m_right->m_order, source->m_right->m_key);
+                copy->m_right->m_parent = copy;
+                stack.push_back(std::make_pair(source->m_right, copy->m_right));
+            }
+            if (source->m_left) {
+                copy->m_left = new Node(source->m_left->m_order, source->m_left->m_key);
+                copy->m_left->m_parent = copy;
+                stack.push_back(std::make_pair(source->m_left, copy->m_left));
+            }
+        }
+        return root;
+    }
+};
+
+#endif
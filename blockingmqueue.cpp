@@ -0,0 +1,171 @@
+#include "blockingmqueue.h"
+#include <stdexcept>
+
+BlockingMQueue::BlockingMQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure,
+                               int capacity, ALLOCATION allocation)
+    : m_queue(priFn, heapType, structure, allocation), m_capacity(capacity), m_closed(false) {
+    if (capacity < 0) throw std::out_of_range("Capacity cannot be negative.");
+}
+
+bool BlockingMQueue::insertOrder(const Order& order) {
+    std::vector<Waiter> ready;
+    bool inserted;
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_notFull.wait(guard, [this] {return m_closed || !full();});
+        inserted = !m_closed && push(order, ready);
+    }
+    resume(ready);
+    return inserted;
+}
+
+bool BlockingMQueue::insertOrder(const Order& order, std::chrono::milliseconds timeout) {
+    std::vector<Waiter> ready;
+    bool inserted;
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_notFull.wait_for(guard, timeout, [this] {return m_closed || !full();});
+        inserted = !m_closed && !full() && push(order, ready);
+    }
+    resume(ready);
+    return inserted;
+}
+
+bool BlockingMQueue::tryGetNextOrder(Order& order) {
+    std::vector<Waiter> ready;
+    bool popped;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        popped = pop(order, ready);
+    }
+    resume(ready);
+    return popped;
+}
+
+Order BlockingMQueue::waitNextOrder() {
+    std::vector<Waiter> ready;
+    Order order;
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_notEmpty.wait(guard, [this] {return m_closed || m_queue.numOrders() > 0;});
+        if (!pop(order, ready)) throw std::out_of_range("Queue is closed");
+    }
+    resume(ready);
+    return order;
+}
+
+bool BlockingMQueue::waitNextOrder(Order& order, std::chrono::milliseconds timeout) {
+    std::vector<Waiter> ready;
+    bool popped;
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_notEmpty.wait_for(guard, timeout, [this] {return m_closed || m_queue.numOrders() > 0;});
+        popped = pop(order, ready);
+    }
+    resume(ready);
+    return popped;
+}
+
+// Suspended coroutines are failed and resumed; threads wake and see
+// m_closed
+void BlockingMQueue::close() {
+    std::vector<Waiter> ready;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_closed = true;
+        for (const Waiter& waiter : m_consumers) ready.push_back(waiter);
+        for (const Waiter& waiter : m_producers) ready.push_back(waiter);
+        m_consumers.clear();
+        m_producers.clear();
+    }
+    m_notEmpty.notify_all();
+    m_notFull.notify_all();
+    for (const Waiter& waiter : ready) *waiter.result = false;
+    resume(ready);
+}
+
+bool BlockingMQueue::isClosed() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_closed;
+}
+
+int BlockingMQueue::numOrders() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_queue.numOrders();
+}
+
+int BlockingMQueue::getCapacity() const {
+    return m_capacity;
+}
+
+bool BlockingMQueue::full() const {
+    return m_capacity > 0 && m_queue.numOrders() >= m_capacity;
+}
+
+// Hands the order to the longest-waiting coroutine, or inserts it and
+// wakes one thread. The queue is empty while coroutines wait, so the order
+// is the best one either way. Called with the lock held; the coroutines in
+// ready are resumed by the caller once the lock is released.
+bool BlockingMQueue::push(const Order& order, std::vector<Waiter>& ready) {
+    if (!m_consumers.empty()) {
+        if (m_queue.getPriorityFn()(order) < 0) return false;
+        Waiter waiter = m_consumers.front();
+        m_consumers.pop_front();
+        *waiter.order = order;
+        *waiter.result = true;
+        ready.push_back(waiter);
+        return true;
+    }
+    if (!m_queue.insertOrder(order)) return false;
+    m_notEmpty.notify_one();
+    return true;
+}
+
+// Pops an order and gives the room it frees to waiting producers,
+// coroutines first. Called with the lock held, like push().
+bool BlockingMQueue::pop(Order& order, std::vector<Waiter>& ready) {
+    if (m_queue.numOrders() == 0) return false;
+    order = m_queue.getNextOrder();
+    while (!m_producers.empty() && !full()) {
+        Waiter waiter = m_producers.front();
+        m_producers.pop_front();
+        *waiter.result = m_queue.insertOrder(*waiter.order);
+        ready.push_back(waiter);
+    }
+    if (m_capacity > 0 && !full()) m_notFull.notify_one();
+    return true;
+}
+
+// Returns true if the coroutine was queued, false if it was served at once
+// and carries on without suspending
+bool BlockingMQueue::suspendConsumer(const Waiter& waiter) {
+    std::vector<Waiter> ready;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_queue.numOrders() == 0 && !m_closed) {
+            m_consumers.push_back(waiter);
+            return true;
+        }
+        *waiter.result = pop(*waiter.order, ready);
+    }
+    resume(ready);
+    return false;
+}
+
+bool BlockingMQueue::suspendProducer(const Waiter& waiter) {
+    std::vector<Waiter> ready;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (full() && !m_closed) {
+            m_producers.push_back(waiter);
+            return true;
+        }
+        *waiter.result = !m_closed && push(*waiter.order, ready);
+    }
+    resume(ready);
+    return false;
+}
+
+void BlockingMQueue::resume(std::vector<Waiter>& ready) {
+    for (const Waiter& waiter : ready) waiter.resume(waiter.frame);
+}
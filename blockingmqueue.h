@@ -0,0 +1,147 @@
+#ifndef BLOCKINGMQUEUE_H
+#define BLOCKINGMQUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "mqueue.h"
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define BLOCKINGMQUEUE_COROUTINES
+#endif
+
+//
+// blocking queue class
+//
+// A thread-safe MQueue for consumers that would otherwise poll. A consumer
+// thread sleeps in waitNextOrder until an order arrives. A coroutine,
+// compiled as C++20, suspends in co_await next() instead. With a capacity,
+// producers block in insertOrder, or suspend in co_await insert(order),
+// while the queue is full.
+//
+// A suspended coroutine is resumed inside the insertOrder or pop call that
+// served it, on that caller's thread. An order inserted while coroutines
+// wait goes straight to the one that waited longest. close() wakes every
+// waiter for shutdown.
+//
+class BlockingMQueue {
+  public:
+    friend class Tester; // for testing purposes
+    // A capacity of 0 leaves the queue unbounded
+    BlockingMQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure,
+                   int capacity = 0, ALLOCATION allocation = GLOBALALLOC);
+    BlockingMQueue(const BlockingMQueue&) = delete;
+    BlockingMQueue& operator=(const BlockingMQueue&) = delete;
+    // Waits while the queue is full. Returns false if the priority function
+    // rejects the order or the queue is closed.
+    bool insertOrder(const Order& order);
+    // Same, but also returns false if there is still no room after timeout
+    bool insertOrder(const Order& order, std::chrono::milliseconds timeout);
+    // Pops without waiting; returns false if the queue is empty
+    bool tryGetNextOrder(Order& order);
+    // Waits for an order; throws out_of_range once the queue is closed and
+    // empty
+    Order waitNextOrder();
+    // Waits at most timeout; returns false if no order came or the queue
+    // is closed and empty
+    bool waitNextOrder(Order& order, std::chrono::milliseconds timeout);
+    // Refuses further inserts and wakes every waiter. Consumers still get
+    // the orders left in the queue, then fail as described above; waiting
+    // producers get false. No coroutine may still be suspended on the queue
+    // when it is destroyed, so close it first.
+    void close();
+    bool isClosed() const;
+    int numOrders() const;
+    int getCapacity() const;
+
+#ifdef BLOCKINGMQUEUE_COROUTINES
+    class NextAwaiter;
+    class InsertAwaiter;
+    // co_await next() yields the next order, suspending while the queue is
+    // empty; throws out_of_range once the queue is closed and empty
+    NextAwaiter next();
+    // co_await insert(order) yields insertOrder's result, suspending while
+    // the queue is full
+    InsertAwaiter insert(const Order& order);
+#endif
+
+  private:
+    // A suspended coroutine. Its handle is kept as a resume function and a
+    // frame address, so the class is the same in C++17 and C++20 code.
+    struct Waiter {
+        void (*resume)(void* frame);
+        void* frame;
+        Order* order;   // where a consumer receives its order, or the order a producer inserts
+        bool* result;   // whether a consumer got an order, or a producer's insert succeeded
+    };
+
+    mutable std::mutex m_lock;      // guards everything below
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    MQueue m_queue;
+    int m_capacity;
+    bool m_closed;
+    std::deque<Waiter> m_consumers; // suspended in next(); the queue is empty meanwhile
+    std::deque<Waiter> m_producers; // suspended in insert(); the queue is full meanwhile
+
+    bool full() const;
+    bool push(const Order& order, std::vector<Waiter>& ready);
+    bool pop(Order& order, std::vector<Waiter>& ready);
+    bool suspendConsumer(const Waiter& waiter);
+    bool suspendProducer(const Waiter& waiter);
+    static void resume(std::vector<Waiter>& ready);
+#ifdef BLOCKINGMQUEUE_COROUTINES
+    static void resumeFrame(void* frame) {std::coroutine_handle<>::from_address(frame).resume();}
+#endif
+};
+
+#ifdef BLOCKINGMQUEUE_COROUTINES
+// The awaiters suspend unless the queue can serve them at once. They
+// touch nothing after handing themselves to the queue, since another
+// thread may resume and destroy them right away.
+class BlockingMQueue::NextAwaiter {
+  public:
+    bool await_ready() const noexcept {return false;}
+    bool await_suspend(std::coroutine_handle<> handle) {
+        return m_queue.suspendConsumer({&BlockingMQueue::resumeFrame, handle.address(), &m_order, &m_delivered});
+    }
+    Order await_resume() {
+        if (!m_delivered) throw std::out_of_range("Queue is closed");
+        return std::move(m_order);
+    }
+  private:
+    friend class BlockingMQueue;
+    explicit NextAwaiter(BlockingMQueue& queue) : m_queue(queue), m_delivered(false) {}
+    BlockingMQueue& m_queue;
+    Order m_order;
+    bool m_delivered;
+};
+
+class BlockingMQueue::InsertAwaiter {
+  public:
+    bool await_ready() const noexcept {return false;}
+    bool await_suspend(std::coroutine_handle<> handle) {
+        return m_queue.suspendProducer({&BlockingMQueue::resumeFrame, handle.address(), &m_order, &m_inserted});
+    }
+    bool await_resume() const {return m_inserted;}
+  private:
+    friend class BlockingMQueue;
+    InsertAwaiter(BlockingMQueue& queue, const Order& order)
+        : m_queue(queue), m_order(order), m_inserted(false) {}
+    BlockingMQueue& m_queue;
+    Order m_order;
+    bool m_inserted;
+};
+
+inline BlockingMQueue::NextAwaiter BlockingMQueue::next() {
+    return NextAwaiter(*this);
+}
+
+inline BlockingMQueue::InsertAwaiter BlockingMQueue::insert(const Order& order) {
+    return InsertAwaiter(*this, order);
+}
+#endif
+
+#endif
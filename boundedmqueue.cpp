@@ -0,0 +1,165 @@
+#include "boundedmqueue.h"
+#include <stdexcept>
+#include <utility>
+
+BoundedMQueue::BoundedMQueue(prifn_t priFn, HEAPTYPE heapType, int capacity, FULLPOLICY policy)
+    : m_priorFunc(priFn), m_heapType(heapType), m_capacity(capacity), m_policy(policy) {
+    if (capacity < 1) throw std::out_of_range("Capacity must be at least 1.");
+    m_slots.reserve(capacity);
+}
+
+// A full queue makes room by evicting the worst order only for a better one
+INSERTRESULT BoundedMQueue::insertOrder(const Order& order, Order* evicted) {
+    int key = m_priorFunc(order);
+    if (key < 0) return REJECTED;
+    if ((int)m_slots.size() < m_capacity) {
+        push({key, order});
+        return INSERTED;
+    }
+    if (m_policy == REJECTNEW || !better(key, m_slots[worstSlot()].key)) return REJECTED;
+    Order worst = evictWorstOrder();
+    if (evicted) *evicted = std::move(worst);
+    push({key, order});
+    return EVICTEDWORST;
+}
+
+Order BoundedMQueue::getNextOrder() {
+    if (m_slots.empty()) throw std::out_of_range("Queue is empty");
+    return m_heapType == MINHEAP ? popLow() : popHigh();
+}
+
+Order BoundedMQueue::evictWorstOrder() {
+    if (m_slots.empty()) throw std::out_of_range("Queue is empty");
+    return m_heapType == MINHEAP ? popHigh() : popLow();
+}
+
+const Order& BoundedMQueue::peekNextOrder() const {
+    if (m_slots.empty()) throw std::out_of_range("Queue is empty");
+    return m_slots[bestSlot()].order;
+}
+
+const Order& BoundedMQueue::peekWorstOrder() const {
+    if (m_slots.empty()) throw std::out_of_range("Queue is empty");
+    return m_slots[worstSlot()].order;
+}
+
+void BoundedMQueue::clear() {
+    m_slots.clear();
+}
+
+int BoundedMQueue::numOrders() const {
+    return (int)m_slots.size();
+}
+
+int BoundedMQueue::getCapacity() const {
+    return m_capacity;
+}
+
+FULLPOLICY BoundedMQueue::getPolicy() const {
+    return m_policy;
+}
+
+prifn_t BoundedMQueue::getPriorityFn() const {
+    return m_priorFunc;
+}
+
+HEAPTYPE BoundedMQueue::getHeapType() const {
+    return m_heapType;
+}
+
+bool BoundedMQueue::better(int key1, int key2) const {
+    return m_heapType == MINHEAP ? key1 < key2 : key1 > key2;
+}
+
+// The lowest key sits in slot 0 and the highest in slot 1, or in slot 0
+// when the queue holds a single order
+size_t BoundedMQueue::bestSlot() const {
+    return m_heapType == MINHEAP || m_slots.size() == 1 ? 0 : 1;
+}
+
+size_t BoundedMQueue::worstSlot() const {
+    return m_heapType == MAXHEAP || m_slots.size() == 1 ? 0 : 1;
+}
+
+// Appends the entry to the last pair, orders that pair, and sifts the
+// entry up whichever of the two heaps it now violates
+void BoundedMQueue::push(Entry entry) {
+    m_slots.push_back(std::move(entry));
+    size_t slot = m_slots.size() - 1;
+    if (slot % 2 == 1) {
+        if (m_slots[slot].key < m_slots[slot - 1].key) {
+            std::swap(m_slots[slot], m_slots[slot - 1]);
+            siftUp(slot - 1, true);
+        } else {
+            siftUp(slot, false);
+        }
+    } else if (slot > 0) {
+        size_t parentLow = 2 * ((slot / 2 - 1) / 2);
+        siftUp(slot, m_slots[slot].key < m_slots[parentLow].key);
+    }
+}
+
+// Moves the entry in slot up the lower keys (low) or the upper keys of
+// its ancestor pairs
+void BoundedMQueue::siftUp(size_t slot, bool low) {
+    while (slot > 1) {
+        size_t parent = 2 * ((slot / 2 - 1) / 2) + (low ? 0 : 1);
+        if (low ? m_slots[slot].key >= m_slots[parent].key : m_slots[slot].key <= m_slots[parent].key) break;
+        std::swap(m_slots[slot], m_slots[parent]);
+        slot = parent;
+    }
+}
+
+// Removes the lowest key. The last entry is carried down from the root
+// along the lower slots, always towards the child pair with the lower key;
+// whenever it is above the upper key of the pair it passes, it swaps
+// places with that key, so every pair stays ordered.
+Order BoundedMQueue::popLow() {
+    Order order = std::move(m_slots[0].order);
+    Entry last = std::move(m_slots.back());
+    m_slots.pop_back();
+    size_t size = m_slots.size();
+    if (size == 0) return order;
+    size_t hole = 0;
+    while (true) {
+        if (hole + 1 < size && last.key > m_slots[hole + 1].key) std::swap(last, m_slots[hole + 1]);
+        size_t child = 2 * hole + 2;    // lower slot of the first child pair
+        if (child >= size) break;
+        if (child + 2 < size && m_slots[child + 2].key < m_slots[child].key) child += 2;
+        if (m_slots[child].key >= last.key) break;
+        m_slots[hole] = std::move(m_slots[child]);
+        hole = child;
+    }
+    m_slots[hole] = std::move(last);
+    return order;
+}
+
+// Removes the highest key, the mirror image of popLow along the upper
+// slots. A child pair with a single entry offers that entry as its upper key.
+Order BoundedMQueue::popHigh() {
+    size_t top = m_slots.size() == 1 ? 0 : 1;
+    Order order = std::move(m_slots[top].order);
+    Entry last = std::move(m_slots.back());
+    m_slots.pop_back();
+    size_t size = m_slots.size();
+    // With one order left, it was the lower slot and stays there
+    if (size <= 1) return order;
+    size_t hole = 1;
+    while (true) {
+        size_t low = hole - hole % 2;
+        if (low != hole && last.key < m_slots[low].key) std::swap(last, m_slots[low]);
+        size_t child = 2 * low + 2;
+        if (child >= size) break;
+        size_t high = child + 1 < size ? child + 1 : child;
+        size_t second = child + 2;
+        if (second < size) {
+            size_t secondHigh = second + 1 < size ? second + 1 : second;
+            if (m_slots[secondHigh].key > m_slots[high].key) high = secondHigh;
+        }
+        if (m_slots[high].key <= last.key) break;
+        m_slots[hole] = std::move(m_slots[high]);
+        hole = high;
+    }
+    m_slots[hole] = std::move(last);
+    return order;
+}
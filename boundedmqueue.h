@@ -0,0 +1,71 @@
+#ifndef BOUNDEDMQUEUE_H
+#define BOUNDEDMQUEUE_H
+
+#include <vector>
+#include "mqueue.h"
+
+enum FULLPOLICY {REJECTNEW, EVICTWORST};   // what a full BoundedMQueue does with another order
+enum INSERTRESULT {INSERTED, EVICTEDWORST, REJECTED};
+const int DEFAULTCAPACITY = MAX50;          // the plant takes at most 50 orders at a time
+
+//
+// bounded queue class
+//
+// A double-ended queue of at most capacity orders. It is an interval heap:
+// an array of slot pairs where the lower keys of the pairs form a min-heap,
+// the upper keys form a max-heap, and every pair's keys lie within its
+// parent's pair. Both the best and the worst order are at the root, so
+// getNextOrder and evictWorstOrder each take O(log n).
+//
+// When the queue is full, REJECTNEW turns every new order away. EVICTWORST
+// takes a new order only if it is better than the current worst, which it
+// then evicts; an order no better than the worst is turned away, so that
+// earlier orders win ties.
+//
+class BoundedMQueue {
+  public:
+    friend class Tester; // for testing purposes
+    // Throws out_of_range if capacity is below 1
+    BoundedMQueue(prifn_t priFn, HEAPTYPE heapType, int capacity = DEFAULTCAPACITY,
+                  FULLPOLICY policy = EVICTWORST);
+    // Returns REJECTED if the priority function or a full queue refused the
+    // order. EVICTEDWORST means it was inserted in place of the worst
+    // order, which is moved to evicted if that is not nullptr.
+    INSERTRESULT insertOrder(const Order& order, Order* evicted = nullptr);
+    // Both throw out_of_range if the queue is empty
+    Order getNextOrder();
+    Order evictWorstOrder();
+    const Order& peekNextOrder() const;
+    const Order& peekWorstOrder() const;
+    void clear();
+    int numOrders() const;
+    int getCapacity() const;
+    FULLPOLICY getPolicy() const;
+    prifn_t getPriorityFn() const;
+    HEAPTYPE getHeapType() const;
+
+  private:
+    struct Entry {
+        int key;
+        Order order;
+    };
+
+    // Slots 2i and 2i+1 hold pair i, with the lower key first. With an odd
+    // number of orders the last pair has only its lower slot, which then
+    // counts as both ends.
+    std::vector<Entry> m_slots;
+    prifn_t m_priorFunc;
+    HEAPTYPE m_heapType;
+    int m_capacity;
+    FULLPOLICY m_policy;
+
+    bool better(int key1, int key2) const;
+    size_t bestSlot() const;
+    size_t worstSlot() const;
+    void push(Entry entry);
+    void siftUp(size_t slot, bool low);
+    Order popLow();
+    Order popHigh();
+};
+
+#endif
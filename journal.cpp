@@ -0,0 +1,283 @@
+#include "journal.h"
+#include <cerrno>
+#include <cstddef>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Journal file layout, in native byte order:
+//   JournalHeader
+//   entries, each a JournalEntry followed by length payload bytes
+namespace {
+const char JOURNALMAGIC[8] = {'M', 'Q', 'J', 'R', 'N', 'L', 0, 0};
+const uint32_t JOURNALVERSION = 1;
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t baseSeq;       // sequence number of the first entry after a truncate
+};
+struct JournalEntry {
+    uint32_t length;        // payload bytes
+    uint32_t checksum;      // over seq, type and payload
+    uint64_t seq;
+    uint8_t type;
+};
+const size_t ENTRYSIZE = offsetof(JournalEntry, type) + 1;     // without tail padding
+
+uint32_t checksum(uint64_t seq, uint8_t type, const char* payload, size_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 16777619u;
+    };
+    mix(&seq, sizeof(seq));
+    mix(&type, sizeof(type));
+    mix(payload, length);
+    return hash;
+}
+
+void frame(string& out, uint64_t seq, uint8_t type, const string& payload) {
+    JournalEntry entry = {(uint32_t)payload.size(), checksum(seq, type, payload.data(), payload.size()),
+                          seq, type};
+    out.append(reinterpret_cast<const char*>(&entry), ENTRYSIZE);
+    out.append(payload);
+}
+
+// Walks the intact entries of a journal image; returns the offset after
+// the last one and sets lastSeq to its sequence number
+template <class Fn>
+size_t scan(const string& data, uint64_t& baseSeq, uint64_t& lastSeq, Fn fn) {
+    JournalHeader header;
+    if (data.size() < sizeof(header)) throw std::runtime_error("Journal file is corrupt.");
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, JOURNALMAGIC, sizeof(header.magic)) != 0 || header.version != JOURNALVERSION)
+        throw std::runtime_error("Not a journal file.");
+    baseSeq = header.baseSeq;
+    lastSeq = 0;
+    size_t offset = sizeof(header);
+    while (data.size() - offset >= ENTRYSIZE) {
+        JournalEntry entry;
+        memcpy(&entry, data.data() + offset, ENTRYSIZE);
+        const char* payload = data.data() + offset + ENTRYSIZE;
+        if (data.size() - offset - ENTRYSIZE < entry.length ||
+            entry.checksum != checksum(entry.seq, entry.type, payload, entry.length)) {
+            break;      // torn by a crash: the log ends here
+        }
+        fn(entry.seq, entry.type, string(payload, entry.length));
+        lastSeq = entry.seq;
+        offset += ENTRYSIZE + entry.length;
+    }
+    return offset;
+}
+
+string readFile(const string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open journal " + path);
+    std::ostringstream data;
+    data << in.rdbuf();
+    return data.str();
+}
+
+struct PriorityFns {
+    std::mutex mutex;
+    std::unordered_map<string, prifn_t> byName;
+    std::unordered_map<prifn_t, string> names;
+};
+PriorityFns& priorityFns() {
+    static PriorityFns fns;
+    return fns;
+}
+}
+
+OrderJournal::OrderJournal(const string& path, int maxDelayMs, int maxBatch)
+    : m_fd(-1), m_end(0), m_maxDelayMs(maxDelayMs), m_maxBatch(maxBatch),
+      m_numPending(0), m_nextSeq(1), m_syncs(0), m_failed(false), m_stop(false) {
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0) throw std::runtime_error("Cannot open journal " + path);
+    struct stat info;
+    if (fstat(m_fd, &info) == 0 && info.st_size > 0) {
+        uint64_t baseSeq, lastSeq;
+        try {
+            m_end = scan(readFile(path), baseSeq, lastSeq, [](uint64_t, uint8_t, const string&) {});
+        } catch (...) {
+            close(m_fd);
+            throw;
+        }
+        m_nextSeq = lastSeq >= baseSeq ? lastSeq + 1 : baseSeq;
+        if ((uint64_t)info.st_size > m_end && ftruncate(m_fd, m_end) != 0) {
+            close(m_fd);
+            throw std::runtime_error("Cannot repair journal " + path);
+        }
+    } else {
+        JournalHeader header = {};
+        memcpy(header.magic, JOURNALMAGIC, sizeof(header.magic));
+        header.version = JOURNALVERSION;
+        header.baseSeq = m_nextSeq;
+        writeAt(reinterpret_cast<const char*>(&header), sizeof(header), 0);
+        fdatasync(m_fd);
+        m_end = sizeof(header);
+    }
+    if (m_maxDelayMs > 0) m_flusher = std::thread(&OrderJournal::flushLoop, this);
+}
+
+OrderJournal::~OrderJournal() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    if (m_flusher.joinable()) m_flusher.join();
+    try {
+        sync();
+    } catch (...) {
+        // Nothing more can be done for the last batch
+    }
+    close(m_fd);
+}
+
+uint64_t OrderJournal::append(uint8_t type, const string& payload) {
+    uint64_t seq;
+    bool full;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_failed) throw std::runtime_error("Journal is unusable after a failed write.");
+        seq = m_nextSeq++;
+        frame(m_pending, seq, type, payload);
+        full = ++m_numPending >= m_maxBatch;
+    }
+    if (m_maxDelayMs <= 0) sync();
+    else if (full) m_wake.notify_one();
+    return seq;
+}
+
+// Takes the whole pending batch, so entries appended while it is being
+// written wait for the next sync
+void OrderJournal::sync() {
+    std::lock_guard<std::mutex> io(m_ioLock);
+    string batch;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_pending.empty()) return;
+        batch.swap(m_pending);
+        m_numPending = 0;
+    }
+    try {
+        writeAt(batch.data(), batch.size(), m_end);
+        if (fdatasync(m_fd) != 0) throw std::runtime_error("Cannot sync journal.");
+    } catch (...) {
+        // The batch is gone; later appends must not pretend otherwise
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_failed = true;
+        throw;
+    }
+    m_end += batch.size();
+    std::lock_guard<std::mutex> guard(m_lock);
+    ++m_syncs;
+}
+
+// Rewrites the header with the next sequence number, then cuts the file
+// back to it. A crash in between leaves entries that a snapshot already
+// covers, and replay skips those.
+void OrderJournal::truncate() {
+    std::lock_guard<std::mutex> io(m_ioLock);
+    JournalHeader header = {};
+    memcpy(header.magic, JOURNALMAGIC, sizeof(header.magic));
+    header.version = JOURNALVERSION;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_pending.clear();
+        m_numPending = 0;
+        header.baseSeq = m_nextSeq;
+    }
+    writeAt(reinterpret_cast<const char*>(&header), sizeof(header), 0);
+    if (ftruncate(m_fd, sizeof(header)) != 0 || fdatasync(m_fd) != 0)
+        throw std::runtime_error("Cannot truncate journal.");
+    m_end = sizeof(header);
+}
+
+uint64_t OrderJournal::lastSeq() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_nextSeq - 1;
+}
+
+uint64_t OrderJournal::numSyncs() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_syncs;
+}
+
+bool OrderJournal::failed() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_failed;
+}
+
+void OrderJournal::replay(const string& path, uint64_t after,
+                          const std::function<void(uint8_t, const string&)>& fn) {
+    uint64_t baseSeq, lastSeq;
+    scan(readFile(path), baseSeq, lastSeq, [&](uint64_t seq, uint8_t type, const string& payload) {
+        // Entries below baseSeq survived a crash inside truncate()
+        if (seq > after && seq >= baseSeq) fn(type, payload);
+    });
+}
+
+void OrderJournal::registerPriorityFn(const string& name, prifn_t priFn) {
+    PriorityFns& fns = priorityFns();
+    std::lock_guard<std::mutex> guard(fns.mutex);
+    fns.byName[name] = priFn;
+    fns.names[priFn] = name;
+}
+
+const string& OrderJournal::priorityFnName(prifn_t priFn) {
+    PriorityFns& fns = priorityFns();
+    std::lock_guard<std::mutex> guard(fns.mutex);
+    auto found = fns.names.find(priFn);
+    if (found == fns.names.end())
+        throw std::domain_error("Priority function is not registered with OrderJournal.");
+    return found->second;
+}
+
+prifn_t OrderJournal::priorityFn(const string& name) {
+    PriorityFns& fns = priorityFns();
+    std::lock_guard<std::mutex> guard(fns.mutex);
+    auto found = fns.byName.find(name);
+    if (found == fns.byName.end())
+        throw std::domain_error("Priority function " + name + " is not registered with OrderJournal.");
+    return found->second;
+}
+
+// Syncs every maxDelayMs, or as soon as a full batch is waiting
+void OrderJournal::flushLoop() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (!m_stop) {
+        m_wake.wait_for(guard, std::chrono::milliseconds(m_maxDelayMs),
+                        [this] {return m_stop || m_numPending >= m_maxBatch;});
+        if (m_pending.empty()) continue;
+        guard.unlock();
+        try {
+            sync();
+        } catch (...) {
+            // sync() marked the journal failed; the next append throws
+        }
+        guard.lock();
+    }
+}
+
+void OrderJournal::writeAt(const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(m_fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Cannot write journal.");
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "mqueue.h"
+
+// Kinds of journal entries; MQueue writes and replays their payloads
+enum JOURNALENTRY {JOURNALINSERT = 1, JOURNALINSERTS, JOURNALPOP, JOURNALMERGE,
+                   JOURNALPRIORITY, JOURNALSTRUCTURE, JOURNALCLEAR, JOURNALREPLACE,
+                   JOURNALBUCKETRANGE};
+
+//
+// order journal class
+//
+// An append-only write-ahead log for MQueue. Entries are buffered and
+// written with one fsync per batch (group commit). A background thread
+// syncs every maxDelayMs, or sooner once maxBatch entries are waiting, so
+// a crash loses at most the last maxDelayMs of changes. With maxDelayMs 0
+// every entry is synced before the operation that wrote it returns.
+//
+// Each entry carries a sequence number and a checksum. A snapshot records
+// the last sequence number it covers, so replay skips older entries, and
+// a torn entry at the end of the file marks where the log ends.
+//
+class OrderJournal {
+  public:
+    friend class Tester; // for testing purposes
+    // Opens path for appending, creating it if needed, and cuts off a torn
+    // entry left at its end by a crash; throws runtime_error if path is
+    // not a journal
+    explicit OrderJournal(const string& path, int maxDelayMs = 10, int maxBatch = 1024);
+    ~OrderJournal();
+    OrderJournal(const OrderJournal&) = delete;
+    OrderJournal& operator=(const OrderJournal&) = delete;
+
+    // Appends an entry and returns its sequence number; throws
+    // runtime_error once a batch failed to reach the disk
+    uint64_t append(uint8_t type, const string& payload);
+    // Writes and fsyncs every entry appended so far
+    void sync();
+    // Drops every entry, once a snapshot covers them; sequence numbers
+    // carry on from where they were
+    void truncate();
+    uint64_t lastSeq() const;
+    uint64_t numSyncs() const;
+    // Whether a batch failed to reach the disk, so append throws
+    bool failed() const;
+
+    // Calls fn(type, payload) for every intact entry of a journal file
+    // with a sequence number above after, in order
+    static void replay(const string& path, uint64_t after,
+                       const std::function<void(uint8_t, const string&)>& fn);
+
+    // Priority functions are journaled by name, so every function a
+    // journaled queue uses must be registered under a stable name
+    static void registerPriorityFn(const string& name, prifn_t priFn);
+    // Throws domain_error for a function or name that is not registered
+    static const string& priorityFnName(prifn_t priFn);
+    static prifn_t priorityFn(const string& name);
+
+  private:
+    int m_fd;
+    uint64_t m_end;             // file offset after the last intact entry
+    int m_maxDelayMs;
+    int m_maxBatch;
+
+    mutable std::mutex m_lock;  // guards the fields below
+    std::condition_variable m_wake;
+    string m_pending;           // framed entries not written yet
+    int m_numPending;
+    uint64_t m_nextSeq;
+    uint64_t m_syncs;
+    bool m_failed;              // a batch could not be written
+    bool m_stop;
+
+    std::mutex m_ioLock;        // keeps batches in order on disk
+    std::thread m_flusher;
+
+    void flushLoop();
+    void writeAt(const char* data, size_t size, uint64_t offset);
+};
+
+#endif
@@ -1,217 +1,2090 @@
-#include "mqueue.h"
-#include <iostream>
-#include <stdexcept>
-
-// Constructor implementation
-MQueue::MQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure)
-    : m_heap(nullptr), m_size(0), m_priorFunc(priFn), m_heapType(heapType), m_structure(structure) {}
-
-// Destructor implementation
-MQueue::~MQueue() {
-    clear();
-}
-
-// Copy constructor
-MQueue::MQueue(const MQueue& rhs)
-    : m_heap(nullptr), m_size(rhs.m_size), m_priorFunc(rhs.m_priorFunc),
-      m_heapType(rhs.m_heapType), m_structure(rhs.m_structure) {
-    m_heap = copyNodes(rhs.m_heap);
-}
-
-// Assignment operator
-MQueue& MQueue::operator=(const MQueue& rhs) {
-    if (this != &rhs) {  // Protect against self-assignment
-        clear();
-
-        m_priorFunc = rhs.m_priorFunc;
-        m_heapType = rhs.m_heapType;
-        m_structure = rhs.m_structure;
-        m_size = rhs.m_size;
-
-        Node* newHeap = copyNodes(rhs.m_heap);
-        m_heap = newHeap;
-    }
-    return *this;
-}
-
-// Inserts an order into the queue
-bool MQueue::insertOrder(const Order& input) {
-    if (m_priorFunc(input) < 0) return false;
-    Node* newNode = new Node(input);
-    m_heap = merge(m_heap, newNode);
-    ++m_size;
-    return true;
-}
-
-// Retrieves the next order
-Order MQueue::getNextOrder() {
-    if (!m_heap) throw std::out_of_range("Queue is empty");
-    Order nextOrder = m_heap->getOrder();
-    Node* oldRoot = m_heap;
-    m_heap = merge(m_heap->m_left, m_heap->m_right);
-    delete oldRoot;
-    --m_size;
-    return nextOrder;
-}
-
-// Merges with another queue
-void MQueue::mergeWithQueue(MQueue& rhs) {
-    if (this == &rhs) throw std::domain_error("Cannot merge queue with itself.");
-    if (m_priorFunc != rhs.m_priorFunc || m_structure != rhs.m_structure)
-        throw std::domain_error("Queues must have the same priority function and structure.");
-    m_heap = merge(m_heap, rhs.m_heap);
-    m_size += rhs.m_size;
-    rhs.m_heap = nullptr;
-    rhs.m_size = 0;
-}
-
-// Clears the queue
-void MQueue::clear() {
-    deleteNodes(m_heap);
-    m_heap = nullptr;
-    m_size = 0;
-}
-
-// Recursively deletes nodes
-void MQueue::deleteNodes(Node* node) {
-    if (!node) return;
-    deleteNodes(node->m_left);
-    deleteNodes(node->m_right);
-    delete node;
-}
-
-// Returns the number of orders
-int MQueue::numOrders() const {
-    return m_size;
-}
-
-// Prints the order queue
-void MQueue::printOrderQueue() const {
-    printPreOrder(m_heap);
-    std::cout << std::endl;
-}
-
-// Returns the current priority function
-prifn_t MQueue::getPriorityFn() const {
-    return m_priorFunc;
-}
-
-// Sets a new priority function
-void MQueue::setPriorityFn(prifn_t priFn, HEAPTYPE heapType) {
-    m_priorFunc = priFn;
-    m_heapType = heapType;
-    rebuildHeap();
-}
-
-// Returns the heap type
-HEAPTYPE MQueue::getHeapType() const {
-    return m_heapType;
-}
-
-// Returns the structure type
-STRUCTURE MQueue::getStructure() const {
-    return m_structure;
-}
-
-// Sets the structure
-void MQueue::setStructure(STRUCTURE structure) {
-    m_structure = structure;
-    rebuildHeap();
-}
-
-// Dumps the queue
-void MQueue::dump() const {
-    if (m_size == 0) {
-        std::cout << "Empty heap.\n";
-    } else {
-        dump(m_heap);
-    }
-    std::cout << std::endl;
-}
-
-// Helper dump function
-void MQueue::dump(Node* pos) const {
-    if (pos != nullptr) {
-        std::cout << "(";
-        dump(pos->m_left);
-        if (m_structure == SKEW)
-            std::cout << m_priorFunc(pos->m_order) << ":" << pos->m_order.getCustomer();
-        else
-            std::cout << m_priorFunc(pos->m_order) << ":" << pos->m_order.getCustomer() << ":" << pos->m_npl;
-        dump(pos->m_right);
-        std::cout << ")";
-    }
-}
-
-// Merges two nodes
-Node* MQueue::merge(Node* node1, Node* node2) {
-    if (!node1) return node2;
-    if (!node2) return node1;
-
-    if ((m_heapType == MINHEAP && m_priorFunc(node2->getOrder()) < m_priorFunc(node1->getOrder())) ||
-        (m_heapType == MAXHEAP && m_priorFunc(node2->getOrder()) > m_priorFunc(node1->getOrder()))) {
-        std::swap(node1, node2);
-    }
-
-    if (m_structure == SKEW) {
-        node1->m_right = merge(node1->m_right, node2);
-        std::swap(node1->m_left, node1->m_right);
-    } else if (m_structure == LEFTIST) {
-        node1->m_right = merge(node1->m_right, node2);
-        if (!node1->m_left || node1->m_left->getNPL() < node1->m_right->getNPL()) {
-            std::swap(node1->m_left, node1->m_right);
-        }
-        node1->setNPL(node1->m_right ? node1->m_right->getNPL() + 1 : 0);
-    }
-
-    return node1;
-}
-
-// Recursively copies nodes
-Node* MQueue::copyNodes(Node* node) {
-    if (!node) return nullptr;
-    Node* newNode = new Node(node->getOrder());
-    newNode->m_left = copyNodes(node->m_left);
-    newNode->m_right = copyNodes(node->m_right);
-    newNode->setNPL(node->getNPL());
-    return newNode;
-}
-
-// Rebuilds the heap
-void MQueue::rebuildHeap() {
-    Order* tempOrders = new Order[m_size];
-    int count = 0;
-
-    while (m_heap) {
-        tempOrders[count++] = getNextOrder();
-    }
-
-    for (int i = 0; i < count; ++i) {
-        insertOrder(tempOrders[i]);
-    }
-
-    delete[] tempOrders;
-}
-
-// Prints preorder
-void MQueue::printPreOrder(Node* node) const {
-    if (node) {
-        std::cout << node->getOrder() << " ";
-        printPreOrder(node->m_left);
-        printPreOrder(node->m_right);
-    }
-}
-
-// Overloaded output operators
-ostream& operator<<(ostream& sout, const Order& order) {
-    sout  << "Customer: " << order.getCustomer()
-          << ", importance: " << order.getImportance() 
-          << ", quantity: " << order.getQuantity() 
-          << ", order placement time: " << order.getFIFO();
-    return sout;
-}
-
-ostream& operator<<(ostream& sout, const Node& node) {
-    sout << node.m_order;
-    return sout;
+#include "mqueue.h"
+#include "basicmqueue.h"
+#include "journal.h"
+#include "reclaimer.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The interned names; a deque keeps references to them stable
+namespace {
+struct CustomerNames {
+    std::mutex mutex;
+    std::deque<string> names;
+    std::unordered_map<string, uint32_t> ids;
+    CustomerNames() {
+        names.push_back(DEFAULTCUSTOMER);
+        ids[DEFAULTCUSTOMER] = 0;
+    }
+};
+CustomerNames& customerNames() {
+    static CustomerNames table;
+    return table;
+}
+}
+
+// Returns the id of a customer name, adding it on first use
+uint32_t CustomerTable::intern(const string& customer) {
+    CustomerNames& table = customerNames();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    auto found = table.ids.find(customer);
+    if (found != table.ids.end()) return found->second;
+    uint32_t id = (uint32_t)table.names.size();
+    table.names.push_back(customer);
+    table.ids.emplace(customer, id);
+    return id;
+}
+
+// Returns the customer name of an id
+const string& CustomerTable::name(uint32_t id) {
+    CustomerNames& table = customerNames();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    if (id >= table.names.size()) throw std::out_of_range("Unknown customer id");
+    return table.names[id];
+}
+
+// Returns the number of interned names
+size_t CustomerTable::size() {
+    CustomerNames& table = customerNames();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    return table.names.size();
+}
+
+// Calls fn(policy, compare) with the tree policy and key comparator that
+// match a queue's structure and heap type, so the operation itself runs a
+// fully specialized template
+template <class Fn>
+static Node* withTreePolicy(STRUCTURE structure, HEAPTYPE heapType, Fn fn) {
+    switch (structure) {
+    case SKEW:
+        return heapType == MINHEAP ? fn(SkewPolicy(), std::less<int>())
+                                   : fn(SkewPolicy(), std::greater<int>());
+    case PAIRING:
+        return heapType == MINHEAP ? fn(PairingPolicy(), std::less<int>())
+                                   : fn(PairingPolicy(), std::greater<int>());
+    default:
+        return heapType == MINHEAP ? fn(LeftistPolicy(), std::less<int>())
+                                   : fn(LeftistPolicy(), std::greater<int>());
+    }
+}
+
+// heapify() over a slice of nodes for a tree structure. It touches nothing
+// but those nodes, so rebuild threads can run it side by side.
+static Node* heapifySlice(STRUCTURE structure, HEAPTYPE heapType, Node** nodes, size_t count) {
+    if (count == 0) return nullptr;
+    return withTreePolicy(structure, heapType, [&](auto policy, auto compare) {
+        while (count > 1) {
+            size_t out = 0;
+            for (size_t i = 0; i + 1 < count; i += 2) {
+                nodes[out++] = decltype(policy)::merge(nodes[i], nodes[i + 1], compare);
+            }
+            if (count % 2 == 1) nodes[out++] = nodes[count - 1];
+            count = out;
+        }
+        return nodes[0];
+    });
+}
+
+static Node* mergeTrees(STRUCTURE structure, HEAPTYPE heapType, Node* heap1, Node* heap2) {
+    if (!heap1) return heap2;
+    if (!heap2) return heap1;
+    return withTreePolicy(structure, heapType, [&](auto policy, auto compare) {
+        return decltype(policy)::merge(heap1, heap2, compare);
+    });
+}
+
+// Calls fn(0) to fn(count - 1) on up to threads threads, this one among
+// them; each thread takes the next index until none are left
+template <class Fn>
+static void parallelFor(int threads, size_t count, Fn fn) {
+    std::atomic<size_t> next(0);
+    auto work = [&] {
+        for (size_t i = next++; i < count; i = next++) fn(i);
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < std::min((size_t)threads, count); t++) workers.emplace_back(work);
+    work();
+    for (std::thread& worker : workers) worker.join();
+}
+
+// withTreePolicy for this queue's heap type. With MQUEUE_STATS the
+// comparator also counts the steps of the merge or root removal, one
+// comparison per node taken off the merged paths.
+template <class Fn>
+Node* MQueue::withPolicy(STRUCTURE structure, Fn fn) {
+#ifdef MQUEUE_STATS
+    uint64_t steps = 0;
+    Node* root = withTreePolicy(structure, m_heapType, [&](auto policy, auto compare) {
+        auto counted = [&steps, compare](int key1, int key2) {
+            ++steps;
+            return compare(key1, key2);
+        };
+        return fn(policy, counted);
+    });
+    m_stats.mergeDepth.record(steps);
+    return root;
+#else
+    return withTreePolicy(structure, m_heapType, fn);
+#endif
+}
+
+// Constructor implementation
+MQueue::MQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure, ALLOCATION allocation)
+    : m_heap(nullptr), m_size(0), m_priorFunc(priFn), m_heapType(heapType), m_structure(structure),
+      m_pool(allocation == POOLALLOC ? new NodePool<Node>() : nullptr), m_bucketLo(DEFAULTBUCKETLO),
+      m_bucketHi(DEFAULTBUCKETHI), m_bucketWord(0), m_journal(nullptr), m_journalStale(false),
+      m_countsStale(false), m_rebuildThreads(1), m_reclaimer(nullptr) {}
+
+// Destructor implementation
+MQueue::~MQueue() {
+    discard(false);
+    delete m_pool;
+}
+
+// Copy constructor
+MQueue::MQueue(const MQueue& rhs)
+    : m_heap(nullptr), m_size(rhs.m_size), m_priorFunc(rhs.m_priorFunc),
+      m_heapType(rhs.m_heapType), m_structure(rhs.m_structure),
+      m_pool(rhs.m_pool ? new NodePool<Node>() : nullptr), m_bucketLo(rhs.m_bucketLo),
+      m_bucketHi(rhs.m_bucketHi), m_bucketWord(0), m_journal(nullptr), m_journalStale(false),
+      m_countsStale(rhs.m_countsStale), m_rebuildThreads(rhs.m_rebuildThreads), m_reclaimer(nullptr) {
+    m_heap = copyNodes(rhs.m_heap);
+    copyDary(rhs.m_dary);
+    copyBuckets(rhs);
+}
+
+// Assignment operator
+MQueue& MQueue::operator=(const MQueue& rhs) {
+    if (this != &rhs) {  // Protect against self-assignment
+        journalReplace(rhs);
+        discard(false);
+
+        m_priorFunc = rhs.m_priorFunc;
+        m_heapType = rhs.m_heapType;
+        m_structure = rhs.m_structure;
+        m_size = rhs.m_size;
+        m_bucketLo = rhs.m_bucketLo;
+        m_bucketHi = rhs.m_bucketHi;
+        m_rebuildThreads = rhs.m_rebuildThreads;
+        m_countsStale = rhs.m_countsStale;
+        if (rhs.m_pool && !m_pool) {
+            m_pool = new NodePool<Node>();
+        } else if (!rhs.m_pool && m_pool) {
+            delete m_pool;
+            m_pool = nullptr;
+        }
+
+        Node* newHeap = copyNodes(rhs.m_heap);
+        m_heap = newHeap;
+        copyDary(rhs.m_dary);
+        copyBuckets(rhs);
+    }
+    return *this;
+}
+
+// Move constructor
+MQueue::MQueue(MQueue&& rhs) noexcept
+    : m_heap(rhs.m_heap), m_size(rhs.m_size), m_priorFunc(rhs.m_priorFunc),
+      m_heapType(rhs.m_heapType), m_structure(rhs.m_structure), m_pool(rhs.m_pool),
+      m_dary(std::move(rhs.m_dary)), m_bucketLo(rhs.m_bucketLo), m_bucketHi(rhs.m_bucketHi),
+      m_buckets(std::move(rhs.m_buckets)), m_bucketBits(std::move(rhs.m_bucketBits)),
+      m_bucketWord(rhs.m_bucketWord), m_journal(nullptr), m_journalStale(false),
+      m_countsStale(rhs.m_countsStale), m_rebuildThreads(rhs.m_rebuildThreads), m_reclaimer(nullptr) {
+    // The journal and reclaimer stay with rhs, which is now empty. Writing
+    // that down could throw, so it waits for rhs's next journaled change.
+    if (rhs.m_journal) rhs.m_journalStale = true;
+    rhs.m_dary.clear();
+    rhs.m_buckets.clear();
+    rhs.m_bucketBits.clear();
+    rhs.m_bucketWord = 0;
+    rhs.m_heap = nullptr;
+    rhs.m_size = 0;
+    rhs.m_countsStale = false;
+    rhs.m_pool = nullptr;
+}
+
+// Move assignment operator
+MQueue& MQueue::operator=(MQueue&& rhs) noexcept {
+    if (this != &rhs) {
+        // Neither journal is written here; see the move constructor
+        if (m_journal) m_journalStale = true;
+        if (rhs.m_journal) rhs.m_journalStale = true;
+        discard(false);
+        delete m_pool;
+
+        m_heap = rhs.m_heap;
+        m_size = rhs.m_size;
+        m_priorFunc = rhs.m_priorFunc;
+        m_heapType = rhs.m_heapType;
+        m_structure = rhs.m_structure;
+        m_pool = rhs.m_pool;
+        m_dary = std::move(rhs.m_dary);
+        m_bucketLo = rhs.m_bucketLo;
+        m_bucketHi = rhs.m_bucketHi;
+        m_buckets = std::move(rhs.m_buckets);
+        m_bucketBits = std::move(rhs.m_bucketBits);
+        m_bucketWord = rhs.m_bucketWord;
+        m_rebuildThreads = rhs.m_rebuildThreads;
+        m_countsStale = rhs.m_countsStale;
+        rhs.m_dary.clear();
+        rhs.m_buckets.clear();
+        rhs.m_bucketBits.clear();
+        rhs.m_bucketWord = 0;
+        rhs.m_heap = nullptr;
+        rhs.m_size = 0;
+        rhs.m_countsStale = false;
+        rhs.m_pool = nullptr;
+    }
+    return *this;
+}
+
+// Inserts an order into the queue
+bool MQueue::insertOrder(const Order& input) {
+    MQUEUE_STAT(ScopedTimer timer(m_stats.insertNs));
+    // The priority is computed once here and cached in the node for merge()
+    int key = priority(input);
+    if (key < 0) return false;
+    linkNode(newNode(input, key));
+    return true;
+}
+
+// Inserts an order, moving it into the new node
+bool MQueue::insertOrder(Order&& input) {
+    MQUEUE_STAT(ScopedTimer timer(m_stats.insertNs));
+    int key = priority(input);
+    if (key < 0) return false;
+    Node* node = newNode(std::move(input), key);
+    if (m_journal) {
+        try {
+            journalOrder(node->m_order);
+        } catch (...) {
+            // Hand the order back before the node goes
+            input = std::move(node->m_order);
+            freeNode(node);
+            throw;
+        }
+    }
+    pushNode(node);
+    ++m_size;
+    return true;
+}
+
+// Inserts an order and hands back a handle to it
+bool MQueue::insertOrder(const Order& input, OrderHandle& handle) {
+    MQUEUE_STAT(ScopedTimer timer(m_stats.insertNs));
+    int key = priority(input);
+    if (key < 0) return false;
+    Node* node = newNode(input, key);
+    linkNode(node);
+    handle = OrderHandle(node);
+    return true;
+}
+
+// Replaces the order of a handle: the node is unlinked, given the new
+// order and key, and merged back in
+bool MQueue::updateOrder(const OrderHandle& handle, const Order& newOrder) {
+    checkHandle(handle);
+    checkNotJournaled();
+    int key = priority(newOrder);
+    if (key < 0) return false;
+    Node* node = handle.m_node;
+    unlinkNode(node);
+    node->m_order = newOrder;
+    node->m_key = key;
+    pushNode(node);
+    return true;
+}
+
+// Removes the order of a handle from anywhere in the heap
+Order MQueue::cancelOrder(OrderHandle& handle) {
+    checkHandle(handle);
+    checkNotJournaled();
+    Node* node = handle.m_node;
+    unlinkNode(node);
+    Order order = std::move(node->m_order);
+    freeNode(node);
+    --m_size;
+    handle = OrderHandle();
+    return order;
+}
+
+// Throws unless the handle can be used with this queue's structure
+void MQueue::checkHandle(const OrderHandle& handle) const {
+    if (!handle.isValid()) throw std::out_of_range("Invalid order handle.");
+    if (m_structure == DARY || m_structure == BUCKET)
+        throw std::domain_error("Order handles need a SKEW, LEFTIST or PAIRING structure.");
+}
+
+// Unlinks a node from anywhere in the tree. Its subtree is replaced by the
+// merge of its children (of its child list in a pairing heap, where the
+// next sibling stays in place). A leftist heap then repairs NPLs upwards,
+// stopping at the first ancestor whose NPL did not change. The ancestors'
+// m_count would need the whole path, so they are marked stale instead.
+void MQueue::unlinkNode(Node* node) {
+    Node* parent = node->m_parent;
+    Node* sibling = nullptr;
+    if (m_structure == PAIRING) {
+        sibling = node->m_right;
+        node->m_right = nullptr;
+    }
+    Node* replacement = withPolicy(m_structure, [&](auto policy, auto compare) {
+        return decltype(policy)::removeRoot(node, compare);
+    });
+    if (sibling) {
+        if (replacement) {
+            replacement->m_right = sibling;
+            sibling->m_parent = replacement;
+        } else {
+            replacement = sibling;
+        }
+    }
+    if (replacement) replacement->m_parent = parent;
+    if (parent) m_countsStale = true;
+    if (!parent) {
+        m_heap = replacement;
+    } else if (parent->m_left == node) {
+        parent->m_left = replacement;
+    } else {
+        parent->m_right = replacement;
+    }
+    if (m_structure == LEFTIST) {
+        for (Node* ancestor = parent; ancestor; ancestor = ancestor->m_parent) {
+            int leftNPL = ancestor->m_left ? ancestor->m_left->m_npl : -1;
+            int rightNPL = ancestor->m_right ? ancestor->m_right->m_npl : -1;
+            if (leftNPL < rightNPL) {
+                std::swap(ancestor->m_left, ancestor->m_right);
+                std::swap(leftNPL, rightNPL);
+            }
+            if (ancestor->m_npl == rightNPL + 1) break;
+            ancestor->m_npl = rightNPL + 1;
+        }
+    }
+    node->m_left = node->m_right = node->m_parent = nullptr;
+    node->m_npl = 0;
+    node->m_count = 1;
+}
+
+// Links a node whose order is already in place; the node is freed if the
+// priority function rejects its order
+bool MQueue::insertNode(Node* node) {
+    MQUEUE_STAT(ScopedTimer timer(m_stats.insertNs));
+    node->m_key = priority(node->m_order);
+    if (node->m_key < 0) {
+        freeNode(node);
+        return false;
+    }
+    linkNode(node);
+    return true;
+}
+
+// Journals the order of a new node, then links the node in. The journal
+// comes first, so if it throws the node is freed and the queue unchanged.
+void MQueue::linkNode(Node* node) {
+    if (m_journal) {
+        try {
+            journalOrder(node->m_order);
+        } catch (...) {
+            freeNode(node);
+            throw;
+        }
+    }
+    pushNode(node);
+    ++m_size;
+}
+
+// Retrieves the next order
+Order MQueue::getNextOrder() {
+    if (m_size == 0) throw std::out_of_range("Queue is empty");
+    MQUEUE_STAT(ScopedTimer timer(m_stats.popNs));
+    if (m_journal) journalPops(1);
+    Node* oldRoot = popNode();
+    Order nextOrder = std::move(oldRoot->m_order);
+    freeNode(oldRoot);
+    --m_size;
+    return nextOrder;
+}
+
+const Order& MQueue::peekNextOrder() const {
+    if (m_size == 0) throw std::out_of_range("Queue is empty");
+    if (m_structure == BUCKET) return bucketFront()->m_order;
+    return m_structure == DARY ? m_dary[0].node->m_order : m_heap->m_order;
+}
+
+// The first k orders of the priority-order walk; the tree is only read
+std::vector<Order> MQueue::peekTopK(int k) const {
+    std::vector<Order> top;
+    if (k <= 0) return top;
+    top.reserve(std::min(k, m_size));
+    for (const_iterator it = begin(); it != end() && (int)top.size() < k; ++it) {
+        top.push_back(*it);
+    }
+    return top;
+}
+
+MQueue::const_iterator MQueue::begin() const {
+    return const_iterator(this);
+}
+
+MQueue::const_iterator MQueue::end() const {
+    return const_iterator();
+}
+
+// Starts the walk with the root as the only frontier entry. BUCKET starts
+// with the overflow root and the head of the best bucket.
+MQueue::const_iterator::const_iterator(const MQueue* queue) : m_queue(queue) {
+    if (queue->m_size == 0) return;
+    Entry root = {0, nullptr, 0};
+    if (queue->m_structure == BUCKET) {
+        size_t slot = queue->nextBucket(0);
+        if (slot != NOBUCKET) {
+            Node* head = queue->m_buckets[slot]->m_right;
+            Entry entry = {head->m_key, head, slot};
+            push(entry);
+        }
+        if (!queue->m_heap) return;
+        root.key = queue->m_heap->m_key;
+        root.node = queue->m_heap;
+        root.pos = NOBUCKET;
+    } else if (queue->m_structure == DARY) {
+        root.key = queue->m_dary[0].key;
+        root.node = queue->m_dary[0].node;
+    } else {
+        root.key = queue->m_heap->m_key;
+        root.node = queue->m_heap;
+    }
+    push(root);
+}
+
+const Order& MQueue::const_iterator::operator*() const {
+    return m_frontier.front().node->m_order;
+}
+
+// Replaces the current order on the frontier with its children. PAIRING
+// has to push the whole child list, since a child does not bound its
+// siblings. A bucketed order's successor is the next order of its bucket,
+// and a bucket's head also brings in the head of the next bucket, so each
+// bucket has one entry on the frontier and keeps its FIFO order.
+MQueue::const_iterator& MQueue::const_iterator::operator++() {
+    HEAPTYPE heapType = m_queue->m_heapType;
+    auto worse = [heapType](const Entry& a, const Entry& b) {
+        return heapType == MINHEAP ? a.key > b.key : a.key < b.key;
+    };
+    std::pop_heap(m_frontier.begin(), m_frontier.end(), worse);
+    Entry current = m_frontier.back();
+    m_frontier.pop_back();
+    if (m_queue->m_structure == BUCKET && current.pos != NOBUCKET) {
+        Node* tail = m_queue->m_buckets[current.pos];
+        if (current.node != tail) {
+            Entry entry = {current.key, current.node->m_right, current.pos};
+            push(entry);
+        }
+        if (current.node == tail->m_right) {
+            size_t slot = m_queue->nextBucket(current.pos + 1);
+            if (slot != NOBUCKET) {
+                Node* head = m_queue->m_buckets[slot]->m_right;
+                Entry entry = {head->m_key, head, slot};
+                push(entry);
+            }
+        }
+    } else if (m_queue->m_structure == DARY) {
+        const std::vector<DaryEntry>& dary = m_queue->m_dary;
+        size_t first = current.pos * DaryPolicy::ARITY + 1;
+        for (size_t child = first; child < first + DaryPolicy::ARITY && child < dary.size(); ++child) {
+            Entry entry = {dary[child].key, dary[child].node, child};
+            push(entry);
+        }
+    } else if (m_queue->m_structure == PAIRING) {
+        for (Node* child = current.node->m_left; child; child = child->m_right) {
+            Entry entry = {child->m_key, child, NOBUCKET};
+            push(entry);
+        }
+    } else {
+        for (Node* child : {current.node->m_left, current.node->m_right}) {
+            if (!child) continue;
+            Entry entry = {child->m_key, child, NOBUCKET};
+            push(entry);
+        }
+    }
+    return *this;
+}
+
+MQueue::const_iterator MQueue::const_iterator::operator++(int) {
+    const_iterator old = *this;
+    ++*this;
+    return old;
+}
+
+// Two live iterators are equal when they stand on the same node
+bool MQueue::const_iterator::operator==(const const_iterator& rhs) const {
+    if (m_frontier.empty() || rhs.m_frontier.empty()) return m_frontier.empty() == rhs.m_frontier.empty();
+    return m_frontier.front().node == rhs.m_frontier.front().node;
+}
+
+// std heaps put the largest element on top, so order them by worse key
+void MQueue::const_iterator::push(const Entry& entry) {
+    HEAPTYPE heapType = m_queue->m_heapType;
+    m_frontier.push_back(entry);
+    std::push_heap(m_frontier.begin(), m_frontier.end(), [heapType](const Entry& a, const Entry& b) {
+        return heapType == MINHEAP ? a.key > b.key : a.key < b.key;
+    });
+}
+
+// Returns the priority of the root without touching the order
+int MQueue::getTopPriority() const {
+    if (m_size == 0) throw std::out_of_range("Queue is empty");
+    if (m_structure == BUCKET) return bucketFront()->m_key;
+    return m_structure == DARY ? m_dary[0].key : m_heap->m_key;
+}
+
+// Merges with another queue
+void MQueue::mergeWithQueue(MQueue& rhs) {
+    if (this == &rhs) throw std::domain_error("Cannot merge queue with itself.");
+    if (m_priorFunc != rhs.m_priorFunc || m_structure != rhs.m_structure)
+        throw std::domain_error("Queues must have the same priority function and structure.");
+    if ((m_pool == nullptr) != (rhs.m_pool == nullptr))
+        throw std::domain_error("Queues must use the same node allocation.");
+    MQUEUE_STAT(ScopedTimer timer(m_stats.mergeNs));
+    // The merge goes into this journal and the clear into rhs's, so both
+    // are checked and the image built before either is written
+    if ((m_journal && m_journal->failed()) || (rhs.m_journal && rhs.m_journal->failed()))
+        throw std::runtime_error("Journal is unusable after a failed write.");
+    if (m_journal) {
+        std::ostringstream image;
+        rhs.writeSnapshot(image, 0);
+        journalAppend(JOURNALMERGE, image.str());
+    }
+    if (rhs.m_journal) {
+        try {
+            rhs.journalAppend(JOURNALCLEAR, string());
+        } catch (...) {
+            // This journal has a merge that will not happen; its next
+            // entry records the real state first
+            if (m_journal) m_journalStale = true;
+            throw;
+        }
+    }
+    // rhs's nodes move into this tree, so their slabs move into our pool
+    if (m_pool) m_pool->splice(*rhs.m_pool);
+    if (m_structure == DARY) {
+        // No meld for an array heap: append and restore the heap order
+        size_t first = m_dary.size();
+        m_dary.insert(m_dary.end(), rhs.m_dary.begin(), rhs.m_dary.end());
+        rhs.m_dary.clear();
+        daryAppended(first);
+    } else if (m_structure == BUCKET) {
+        bucketMerge(rhs);
+    } else {
+        m_heap = merge(m_heap, rhs.m_heap);
+    }
+    m_size += rhs.m_size;
+    m_countsStale = m_countsStale || rhs.m_countsStale;
+    rhs.m_heap = nullptr;
+    rhs.m_size = 0;
+    rhs.m_countsStale = false;
+}
+
+// Splits off a subtree of the root or the worse half of the buckets
+MQueue MQueue::splitQueue() {
+    if (m_pool) throw std::domain_error("Cannot split a pooled queue.");
+    if (m_structure == DARY) throw std::domain_error("Cannot split a DARY queue.");
+    checkNotJournaled();
+    MQueue part(m_priorFunc, m_heapType, m_structure);
+    part.m_bucketLo = m_bucketLo;
+    part.m_bucketHi = m_bucketHi;
+    if (m_structure == BUCKET && nextBucket(0) != NOBUCKET) {
+        bucketSplit(part);
+        return part;
+    }
+    if (!m_heap || !m_heap->m_left) return part;
+    Node* subtree = m_heap->m_left;
+    if (m_structure == PAIRING) {
+        // Take the first child alone; its siblings stay under the root
+        m_heap->m_left = subtree->m_right;
+        if (subtree->m_right) subtree->m_right->m_parent = m_heap;
+        subtree->m_right = nullptr;
+    } else {
+        // The right subtree moves to the left, where the next split finds
+        // it; for LEFTIST that also keeps the root leftist, with NPL 0
+        m_heap->m_left = m_heap->m_right;
+        m_heap->m_right = nullptr;
+        m_heap->m_npl = 0;
+    }
+    subtree->m_parent = nullptr;
+    part.m_heap = subtree;
+    if (m_countsStale) {
+        // The subtree may hold an ancestor of an unlinked node
+        part.m_size = countNodes(subtree);
+        part.m_countsStale = true;
+    } else {
+        part.m_size = subtree->m_count;
+    }
+    m_heap->m_count -= part.m_size;
+    m_size -= part.m_size;
+    return part;
+}
+
+// Counts a tree by walking its parent links, in O(1) space
+int MQueue::countNodes(Node* node) {
+    int count = 0;
+    Node* prev = nullptr;
+    while (node) {
+        Node* next;
+        if (prev == node->m_parent) {
+            // First visit: go down the left, then the right
+            ++count;
+            next = node->m_left ? node->m_left : node->m_right ? node->m_right : node->m_parent;
+        } else if (prev == node->m_left && node->m_right) {
+            next = node->m_right;
+        } else {
+            next = node->m_parent;
+        }
+        prev = node;
+        node = next;
+    }
+    return count;
+}
+
+// Clears the queue
+void MQueue::clear() {
+    if (m_journal) journalAppend(JOURNALCLEAR, string());
+    discard(true);
+}
+
+// Frees every node without journaling it. A pooled queue whose nodes need
+// no destructor just hands its slabs back; otherwise every node is
+// destroyed individually.
+void MQueue::reset() {
+    if (m_pool && std::is_trivially_destructible<Node>::value) {
+        MQUEUE_STAT(m_stats.nodeFrees += m_size);
+        m_pool->release();
+    } else {
+        deleteNodes(m_heap);
+        for (const DaryEntry& entry : m_dary) freeNode(entry.node);
+        for (size_t slot = nextBucket(0); slot != NOBUCKET; slot = nextBucket(slot + 1)) {
+            // Open the circular list at its head and free it as a chain
+            Node* tail = m_buckets[slot];
+            Node* node = tail->m_right;
+            tail->m_right = nullptr;
+            while (node) {
+                Node* next = node->m_right;
+                freeNode(node);
+                node = next;
+            }
+        }
+        if (m_pool) m_pool->release();
+    }
+    m_heap = nullptr;
+    m_dary.clear();
+    m_buckets.clear();
+    m_bucketBits.clear();
+    m_bucketWord = 0;
+    m_size = 0;
+    m_countsStale = false;
+}
+
+// reset() in O(1) through m_reclaimer, if there is one: the nodes and the
+// node pool move to a queue of their own, which is retired. With newPool a
+// pooled queue takes a fresh pool, as clear() needs; otherwise it is left
+// without one, for callers that replace or delete the pool anyway. Frees
+// in place if the allocations fail, or if the reclaimer cannot take the
+// queue, so that the destructor and move assignment never throw.
+void MQueue::discard(bool newPool) {
+    if (!m_reclaimer || m_size == 0) {
+        reset();
+        return;
+    }
+    std::unique_ptr<NodePool<Node>> pool;
+    std::unique_ptr<MQueue> retired;
+    try {
+        if (m_pool && newPool) pool.reset(new NodePool<Node>());
+        retired.reset(new MQueue());
+    } catch (const std::bad_alloc&) {
+        reset();
+        return;
+    }
+    MQUEUE_STAT(m_stats.nodeFrees += m_size);
+    // The caller has journaled already, so the move must not mark the
+    // journal stale
+    OrderJournal* journal = m_journal;
+    m_journal = nullptr;
+    *retired = std::move(*this);
+    m_journal = journal;
+    m_pool = pool.release();
+    try {
+        m_reclaimer->retire(retired.get());
+    } catch (...) {
+        // The nodes are out already; free them here after all
+        return;
+    }
+    retired.release();
+}
+
+// Allocates a node from the pool, or from the global heap without one
+Node* MQueue::newNode(Order order, int key) {
+    MQUEUE_STAT(++m_stats.nodeAllocs);
+    if (m_pool) return new (m_pool->allocate()) Node(std::move(order), key);
+    return new Node(std::move(order), key);
+}
+
+// Returns a node to wherever newNode() took it from
+void MQueue::freeNode(Node* node) {
+    MQUEUE_STAT(++m_stats.nodeFrees);
+    if (m_pool) {
+        node->~Node();
+        m_pool->deallocate(node);
+    } else {
+        delete node;
+    }
+}
+
+// Deletes a subtree without recursion; rotating every left child up
+// flattens the tree into a right chain that is freed as it is walked
+void MQueue::deleteNodes(Node* node) {
+    while (node) {
+        if (node->m_left) {
+            Node* left = node->m_left;
+            node->m_left = left->m_right;
+            left->m_right = node;
+            node = left;
+        } else {
+            Node* next = node->m_right;
+            freeNode(node);
+            node = next;
+        }
+    }
+}
+
+// Returns the number of orders
+int MQueue::numOrders() const {
+    return m_size;
+}
+
+// Prints the order queue
+void MQueue::printOrderQueue() const {
+    if (m_structure == DARY) {
+        // Array order is the level order of the d-ary tree
+        for (const DaryEntry& entry : m_dary) std::cout << entry.node->m_order << " ";
+    } else if (m_structure == BUCKET) {
+        // The buckets in priority order, then the overflow heap in preorder
+        for (size_t slot = nextBucket(0); slot != NOBUCKET; slot = nextBucket(slot + 1)) {
+            Node* tail = m_buckets[slot];
+            Node* node = tail;
+            do {
+                node = node->m_right;
+                std::cout << node->m_order << " ";
+            } while (node != tail);
+        }
+        printPreOrder(m_heap);
+    } else {
+        printPreOrder(m_heap);
+    }
+    std::cout << std::endl;
+}
+
+// Returns the current priority function
+prifn_t MQueue::getPriorityFn() const {
+    return m_priorFunc;
+}
+
+// Sets a new priority function
+void MQueue::setPriorityFn(prifn_t priFn, HEAPTYPE heapType) {
+    if (m_journal) journalPriorityFn(priFn, heapType);
+    m_priorFunc = priFn;
+    m_heapType = heapType;
+    rebuildHeap(true);
+}
+
+// Returns the heap type
+HEAPTYPE MQueue::getHeapType() const {
+    return m_heapType;
+}
+
+// Returns the structure type
+STRUCTURE MQueue::getStructure() const {
+    return m_structure;
+}
+
+// Returns where the queue allocates its nodes
+ALLOCATION MQueue::getAllocation() const {
+    return m_pool ? POOLALLOC : GLOBALALLOC;
+}
+
+// Sets the structure
+void MQueue::setStructure(STRUCTURE structure) {
+    if (m_journal) journalAppend(JOURNALSTRUCTURE, string(1, (char)structure));
+    m_structure = structure;
+    rebuildHeap(false);
+}
+
+// Moves every node out, then back in under the new range
+void MQueue::setBucketRange(int lo, int hi) {
+    if (hi < lo || (int64_t)hi - lo >= MAXBUCKETS)
+        throw std::out_of_range("Bucket range must hold 1 to MAXBUCKETS keys.");
+    if (m_journal) {
+        int32_t range[2] = {lo, hi};
+        journalAppend(JOURNALBUCKETRANGE, string(reinterpret_cast<const char*>(range), sizeof(range)));
+    }
+    if (m_structure != BUCKET) {
+        m_bucketLo = lo;
+        m_bucketHi = hi;
+        return;
+    }
+    MQUEUE_STAT(ScopedTimer timer(m_stats.rebuildNs));
+    std::vector<Node*> nodes;
+    nodes.reserve(m_size);
+    takeNodes(nodes);
+    m_bucketLo = lo;
+    m_bucketHi = hi;
+    pushNodes(nodes);
+}
+
+std::pair<int, int> MQueue::getBucketRange() const {
+    return std::make_pair(m_bucketLo, m_bucketHi);
+}
+
+void MQueue::setRebuildThreads(int threads) {
+    if (threads < 1) throw std::out_of_range("A rebuild needs at least one thread.");
+    m_rebuildThreads = threads;
+}
+
+int MQueue::getRebuildThreads() const {
+    return m_rebuildThreads;
+}
+
+// Copies the counters and walks the tree for its shape. The NPLs are
+// recomputed bottom-up, since only LEFTIST keeps them up to date.
+MQueueStats MQueue::getStats() const {
+#ifdef MQUEUE_STATS
+    MQueueStats stats = m_stats;
+    stats.enabled = true;
+#else
+    MQueueStats stats;
+#endif
+    // A pairing heap's right links are sibling lists, and DARY has no tree
+    if (m_structure == PAIRING || m_structure == DARY) return stats;
+    for (const Node* node = m_heap; node; node = node->m_right) ++stats.rightSpine;
+    // Postorder with an explicit stack; a node is finished once both of
+    // its children have left their NPLs on npls, the left one on top
+    std::vector<std::pair<const Node*, bool> > stack;
+    std::vector<int> npls;
+    if (m_heap) stack.push_back(std::make_pair(m_heap, false));
+    while (!stack.empty()) {
+        const Node* node = stack.back().first;
+        if (!stack.back().second) {
+            stack.back().second = true;
+            if (node->m_left) stack.push_back(std::make_pair(node->m_left, false));
+            if (node->m_right) stack.push_back(std::make_pair(node->m_right, false));
+            continue;
+        }
+        stack.pop_back();
+        int left = -1, right = -1;
+        if (node->m_left) {
+            left = npls.back();
+            npls.pop_back();
+        }
+        if (node->m_right) {
+            right = npls.back();
+            npls.pop_back();
+        }
+        int npl = std::min(left, right) + 1;
+        if ((size_t)npl >= stats.nplCounts.size()) stats.nplCounts.resize(npl + 1);
+        ++stats.nplCounts[npl];
+        npls.push_back(npl);
+    }
+    return stats;
+}
+
+void MQueue::resetStats() {
+    MQUEUE_STAT(m_stats = MQueueStats());
+}
+
+// Dumps the queue
+void MQueue::dump() const {
+    if (m_size == 0) {
+        std::cout << "Empty heap.\n";
+    } else if (m_structure == DARY) {
+        dumpDary(0);
+    } else if (m_structure == BUCKET) {
+        dumpBuckets();
+    } else if (m_structure == PAIRING) {
+        dumpPairing(m_heap);
+    } else {
+        dump(m_heap);
+    }
+    std::cout << std::endl;
+}
+
+// Dumps the d-ary subtree at an array slot as (key:customer children...);
+// the recursion is only log4(n) deep
+void MQueue::dumpDary(size_t pos) const {
+    std::cout << "(" << m_dary[pos].key << ":" << m_dary[pos].node->m_order.getCustomer();
+    size_t first = pos * DaryPolicy::ARITY + 1;
+    for (size_t child = first; child < first + DaryPolicy::ARITY && child < m_dary.size(); ++child) {
+        dumpDary(child);
+    }
+    std::cout << ")";
+}
+
+// Dumps a pairing heap as (key:customer children...). A nullptr on the
+// stack closes the node below it; children are pushed in reverse so the
+// first child prints first.
+void MQueue::dumpPairing(Node* pos) const {
+    std::vector<Node*> stack(1, pos);
+    std::vector<Node*> children;
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (!node) {
+            std::cout << ")";
+            continue;
+        }
+        std::cout << "(" << node->m_key << ":" << node->m_order.getCustomer();
+        stack.push_back(nullptr);
+        children.clear();
+        for (Node* child = node->m_left; child; child = child->m_right) children.push_back(child);
+        stack.insert(stack.end(), children.rbegin(), children.rend());
+    }
+}
+
+// Helper dump function, iterative so that a long right path of a skew
+// heap cannot overflow the call stack; state 0 opens the node, 1 prints
+// it and 2 closes it
+void MQueue::dump(Node* pos) const {
+    std::vector<std::pair<Node*, int> > stack;
+    if (pos != nullptr) stack.push_back(std::make_pair(pos, 0));
+    while (!stack.empty()) {
+        Node* node = stack.back().first;
+        int state = stack.back().second++;
+        if (state == 0) {
+            std::cout << "(";
+            if (node->m_left) stack.push_back(std::make_pair(node->m_left, 0));
+        } else if (state == 1) {
+            if (m_structure != LEFTIST)
+                std::cout << node->m_key << ":" << node->m_order.getCustomer();
+            else
+                std::cout << node->m_key << ":" << node->m_order.getCustomer() << ":" << node->m_npl;
+            if (node->m_right) stack.push_back(std::make_pair(node->m_right, 0));
+        } else {
+            std::cout << ")";
+            stack.pop_back();
+        }
+    }
+}
+
+// Merges two nodes; the heap type and structure are resolved once here and
+// the merge loop itself is the same template BasicMQueue uses
+Node* MQueue::merge(Node* node1, Node* node2) {
+    if (!node1) return node2;
+    if (!node2) return node1;
+    return withPolicy(m_structure, [&](auto policy, auto compare) {
+        return decltype(policy)::merge(node1, node2, compare);
+    });
+}
+
+// Copies a subtree using an explicit stack of (source, copy) pairs
+Node* MQueue::copyNodes(Node* node) {
+    if (!node) return nullptr;
+    Node* root = newNode(node->m_order, node->m_key);
+    std::vector<std::pair<const Node*, Node*> > stack;
+    stack.push_back(std::make_pair(node, root));
+    while (!stack.empty()) {
+        const Node* source = stack.back().first;
+        Node* copy = stack.back().second;
+        stack.pop_back();
+        copy->setNPL(source->getNPL());
+        copy->m_count = source->m_count;
+        if (source->m_right) {
+            copy->m_right = newNode(source->m_right->m_order, source->m_right->m_key);
+            copy->m_right->m_parent = copy;
+            stack.push_back(std::make_pair(source->m_right, copy->m_right));
+        }
+        if (source->m_left) {
+            copy->m_left = newNode(source->m_left->m_order, source->m_left->m_key);
+            copy->m_left->m_parent = copy;
+            stack.push_back(std::make_pair(source->m_left, copy->m_left));
+        }
+    }
+    return root;
+}
+
+// Copies the DARY array; the copied entries keep their slots, so the copy
+// is a valid heap without sifting
+void MQueue::copyDary(const std::vector<DaryEntry>& entries) {
+    m_dary.reserve(entries.size());
+    for (const DaryEntry& entry : entries) {
+        DaryEntry copy = {entry.key, newNode(entry.node->m_order, entry.key)};
+        m_dary.push_back(copy);
+    }
+}
+
+// Turns a list of single-node heaps into one heap by merging them in pairs,
+// round after round, until one is left. Every merge combines heaps of
+// similar size, so the whole build is O(n) rather than O(n log n).
+Node* MQueue::heapify(std::vector<Node*>& nodes) {
+    size_t count = nodes.size();
+    if (count == 0) return nullptr;
+    while (count > 1) {
+        size_t out = 0;
+        for (size_t i = 0; i + 1 < count; i += 2) {
+            nodes[out++] = merge(nodes[i], nodes[i + 1]);
+        }
+        if (count % 2 == 1) nodes[out++] = nodes[count - 1];
+        count = out;
+    }
+    return nodes[0];
+}
+
+// Adds one detached node to the heap
+void MQueue::pushNode(Node* node) {
+    if (m_structure == DARY) {
+        DaryEntry entry = {node->m_key, node};
+        m_dary.push_back(entry);
+        darySiftUp(m_dary.size() - 1);
+    } else if (m_structure == BUCKET) {
+        bucketPush(node);
+    } else {
+        m_heap = merge(m_heap, node);
+    }
+}
+
+// Adds detached nodes in bulk: heapify() builds a tree to merge in, or the
+// entries are appended to the DARY array and the heap order restored.
+// BUCKET appends to the buckets in the order given and heapifies the rest.
+void MQueue::pushNodes(std::vector<Node*>& nodes) {
+    if (m_structure == BUCKET) {
+        size_t overflow = 0;
+        for (Node* node : nodes) {
+            size_t slot = bucketSlot(node->m_key);
+            if (slot == NOBUCKET) nodes[overflow++] = node;
+            else bucketAppend(slot, node);
+        }
+        nodes.resize(overflow);
+        m_heap = merge(m_heap, heapify(nodes));
+    } else if (m_structure == DARY) {
+        size_t first = m_dary.size();
+        for (Node* node : nodes) {
+            DaryEntry entry = {node->m_key, node};
+            m_dary.push_back(entry);
+        }
+        daryAppended(first);
+    } else {
+        m_heap = merge(m_heap, heapify(nodes));
+    }
+}
+
+// Unlinks and returns the highest priority node; the queue must not be empty
+Node* MQueue::popNode() {
+    Node* root;
+    if (m_structure == DARY) {
+        root = m_dary.front().node;
+        m_dary.front() = m_dary.back();
+        m_dary.pop_back();
+        if (!m_dary.empty()) darySiftDown(0);
+    } else if (m_structure == BUCKET) {
+        root = bucketPop();
+    } else {
+        root = m_heap;
+        m_heap = withPolicy(m_structure, [&](auto policy, auto compare) {
+            return decltype(policy)::removeRoot(root, compare);
+        });
+    }
+    return root;
+}
+
+// Moves every node of the queue into nodes with its links and NPL reset,
+// whatever structure currently holds them; leaves the heap empty
+void MQueue::takeNodes(std::vector<Node*>& nodes) {
+    size_t first = nodes.size();
+    if (m_heap) nodes.push_back(m_heap);
+    // nodes doubles as the breadth-first work list
+    for (size_t i = first; i < nodes.size(); ++i) {
+        if (nodes[i]->m_left) nodes.push_back(nodes[i]->m_left);
+        if (nodes[i]->m_right) nodes.push_back(nodes[i]->m_right);
+    }
+    for (const DaryEntry& entry : m_dary) nodes.push_back(entry.node);
+    // Bucket by bucket, so a rebuild into BUCKET keeps the FIFO order
+    for (size_t slot = nextBucket(0); slot != NOBUCKET; slot = nextBucket(slot + 1)) {
+        Node* tail = m_buckets[slot];
+        Node* node = tail;
+        do {
+            node = node->m_right;
+            nodes.push_back(node);
+        } while (node != tail);
+    }
+    for (size_t i = first; i < nodes.size(); ++i) {
+        nodes[i]->m_left = nodes[i]->m_right = nodes[i]->m_parent = nullptr;
+        nodes[i]->m_npl = 0;
+        nodes[i]->m_count = 1;
+    }
+    m_heap = nullptr;
+    m_countsStale = false;
+    m_dary.clear();
+    m_buckets.clear();
+    m_bucketBits.clear();
+    m_bucketWord = 0;
+}
+
+// Restores the DARY heap order after entries were appended from slot
+// first on: a few entries are sifted up one by one, many at once trigger a
+// linear bottom-up heapify
+void MQueue::daryAppended(size_t first) {
+    size_t added = m_dary.size() - first;
+    if (added * 8 >= m_dary.size()) {
+        daryHeapify();
+    } else {
+        for (size_t pos = first; pos < m_dary.size(); ++pos) darySiftUp(pos);
+    }
+}
+
+// The DARY helpers resolve the heap type once and run the DaryPolicy templates
+void MQueue::darySiftUp(size_t pos) {
+    if (m_heapType == MINHEAP) DaryPolicy::siftUp(m_dary.data(), pos, std::less<int>());
+    else DaryPolicy::siftUp(m_dary.data(), pos, std::greater<int>());
+}
+
+void MQueue::darySiftDown(size_t pos) {
+    if (m_heapType == MINHEAP) DaryPolicy::siftDown(m_dary.data(), m_dary.size(), pos, std::less<int>());
+    else DaryPolicy::siftDown(m_dary.data(), m_dary.size(), pos, std::greater<int>());
+}
+
+void MQueue::daryHeapify() {
+    if (m_heapType == MINHEAP) DaryPolicy::heapify(m_dary.data(), m_dary.size(), std::less<int>());
+    else DaryPolicy::heapify(m_dary.data(), m_dary.size(), std::greater<int>());
+}
+
+// The BUCKET helpers. Slot 0 holds the best key of the range, the lowest
+// for MINHEAP and the highest for MAXHEAP, so the next bucketed order is
+// always at the head of the first non-empty slot.
+size_t MQueue::bucketSlot(int key) const {
+    if (key < m_bucketLo || key > m_bucketHi) return NOBUCKET;
+    return m_heapType == MINHEAP ? (size_t)(key - m_bucketLo) : (size_t)(m_bucketHi - key);
+}
+
+int MQueue::bucketKey(size_t slot) const {
+    return m_heapType == MINHEAP ? m_bucketLo + (int)slot : m_bucketHi - (int)slot;
+}
+
+// Returns the first non-empty slot at or after slot, or NOBUCKET. Skips
+// the words before m_bucketWord, then one count-trailing-zeros per word.
+size_t MQueue::nextBucket(size_t slot) const {
+    size_t word = slot / 64;
+    uint64_t mask = ~0ULL << (slot % 64);
+    if (word < m_bucketWord) {
+        word = m_bucketWord;
+        mask = ~0ULL;
+    }
+    if (word >= m_bucketBits.size()) return NOBUCKET;
+    uint64_t bits = m_bucketBits[word] & mask;
+    while (!bits) {
+        if (++word == m_bucketBits.size()) return NOBUCKET;
+        bits = m_bucketBits[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+// Appends a detached node to the FIFO list of a slot. The arrays are
+// allocated by the first append after the range or structure changed.
+void MQueue::bucketAppend(size_t slot, Node* node) {
+    if (m_buckets.empty()) {
+        size_t slots = (size_t)((int64_t)m_bucketHi - m_bucketLo) + 1;
+        m_buckets.assign(slots, nullptr);
+        m_bucketBits.assign((slots + 63) / 64, 0);
+        m_bucketWord = m_bucketBits.size();
+    }
+    Node*& tail = m_buckets[slot];
+    if (tail) {
+        node->m_right = tail->m_right;
+        tail->m_right = node;
+    } else {
+        node->m_right = node;
+        m_bucketBits[slot / 64] |= 1ULL << (slot % 64);
+        m_bucketWord = std::min(m_bucketWord, slot / 64);
+    }
+    tail = node;
+}
+
+void MQueue::bucketPush(Node* node) {
+    size_t slot = bucketSlot(node->m_key);
+    if (slot == NOBUCKET) m_heap = merge(m_heap, node);
+    else bucketAppend(slot, node);
+}
+
+// The better of the first bucket's head and the overflow root. Overflow
+// keys lie outside the range, so the two never tie.
+Node* MQueue::bucketFront() const {
+    size_t slot = nextBucket(0);
+    Node* head = slot == NOBUCKET ? nullptr : m_buckets[slot]->m_right;
+    if (!head || !m_heap) return head ? head : m_heap;
+    bool overflowFirst = m_heapType == MINHEAP ? m_heap->m_key < head->m_key : m_heap->m_key > head->m_key;
+    return overflowFirst ? m_heap : head;
+}
+
+Node* MQueue::bucketPop() {
+    size_t slot = nextBucket(0);
+    Node* head = bucketFront();
+    if (head == m_heap) {
+        m_heap = withPolicy(LEFTIST, [&](auto policy, auto compare) {
+            return decltype(policy)::removeRoot(head, compare);
+        });
+        return head;
+    }
+    m_bucketWord = slot / 64;
+    Node*& tail = m_buckets[slot];
+    if (head == tail) {
+        tail = nullptr;
+        m_bucketBits[slot / 64] &= ~(1ULL << (slot % 64));
+    } else {
+        tail->m_right = head->m_right;
+    }
+    head->m_right = nullptr;
+    return head;
+}
+
+// Melds the overflow heaps and, when both queues use the same slots,
+// splices each of rhs's lists onto the end of ours in O(1); otherwise
+// rhs's bucketed nodes are pushed one by one
+void MQueue::bucketMerge(MQueue& rhs) {
+    m_heap = merge(m_heap, rhs.m_heap);
+    bool sameSlots = m_bucketLo == rhs.m_bucketLo && m_bucketHi == rhs.m_bucketHi &&
+                     m_heapType == rhs.m_heapType;
+    if (sameSlots && m_buckets.empty()) {
+        m_buckets.swap(rhs.m_buckets);
+        m_bucketBits.swap(rhs.m_bucketBits);
+        m_bucketWord = rhs.m_bucketWord;
+    } else {
+        for (size_t slot = rhs.nextBucket(0); slot != NOBUCKET; slot = rhs.nextBucket(slot + 1)) {
+            Node* tail = rhs.m_buckets[slot];
+            if (!sameSlots) {
+                Node* node = tail->m_right;
+                tail->m_right = nullptr;
+                while (node) {
+                    Node* next = node->m_right;
+                    node->m_right = nullptr;
+                    bucketPush(node);
+                    node = next;
+                }
+                continue;
+            }
+            Node*& mine = m_buckets[slot];
+            if (mine) {
+                Node* head = mine->m_right;
+                mine->m_right = tail->m_right;
+                tail->m_right = head;
+            } else {
+                m_bucketBits[slot / 64] |= 1ULL << (slot % 64);
+                m_bucketWord = std::min(m_bucketWord, slot / 64);
+            }
+            mine = tail;
+        }
+    }
+    rhs.m_buckets.clear();
+    rhs.m_bucketBits.clear();
+    rhs.m_bucketWord = 0;
+}
+
+// Moves the worse half of the bucketed orders into part, which has the
+// same slots: whole buckets from the worst one up, then the back of the
+// bucket where the half is reached. The overflow heap stays.
+void MQueue::bucketSplit(MQueue& part) {
+    std::vector<size_t> slots;
+    for (size_t slot = nextBucket(0); slot != NOBUCKET; slot = nextBucket(slot + 1)) slots.push_back(slot);
+    int target = (m_size - (m_heap ? m_heap->m_count : 0)) / 2;
+    int moved = 0;
+    std::vector<Node*> list;
+    for (auto slot = slots.rbegin(); slot != slots.rend() && moved < target; ++slot) {
+        Node* tail = m_buckets[*slot];
+        list.clear();
+        Node* node = tail;
+        do {
+            node = node->m_right;
+            list.push_back(node);
+        } while (node != tail);
+        size_t keep = list.size() - std::min(list.size(), (size_t)(target - moved));
+        if (keep == 0) {
+            m_buckets[*slot] = nullptr;
+            m_bucketBits[*slot / 64] &= ~(1ULL << (*slot % 64));
+        } else {
+            list[keep - 1]->m_right = list[0];
+            m_buckets[*slot] = list[keep - 1];
+        }
+        for (size_t i = keep; i < list.size(); ++i) part.bucketAppend(*slot, list[i]);
+        moved += (int)(list.size() - keep);
+    }
+    part.m_size = moved;
+    m_size -= moved;
+}
+
+// Copies rhs's buckets list by list; the caller has already taken rhs's
+// range and heap type, so every node keeps its slot
+void MQueue::copyBuckets(const MQueue& rhs) {
+    for (size_t slot = rhs.nextBucket(0); slot != NOBUCKET; slot = rhs.nextBucket(slot + 1)) {
+        Node* tail = rhs.m_buckets[slot];
+        const Node* node = tail;
+        do {
+            node = node->m_right;
+            bucketAppend(slot, newNode(node->m_order, node->m_key));
+        } while (node != tail);
+    }
+}
+
+// Dumps each non-empty bucket as [key: customers...], then the overflow heap
+void MQueue::dumpBuckets() const {
+    for (size_t slot = nextBucket(0); slot != NOBUCKET; slot = nextBucket(slot + 1)) {
+        std::cout << "[" << bucketKey(slot) << ":";
+        Node* tail = m_buckets[slot];
+        Node* node = tail;
+        do {
+            node = node->m_right;
+            std::cout << " " << node->m_order.getCustomer();
+        } while (node != tail);
+        std::cout << "]";
+    }
+    dump(m_heap);
+}
+
+// Rebuilds the heap in place: the existing nodes are collected from the old
+// structure, their keys recomputed when the priority function changed, and
+// they are relinked into the new structure in O(n) without allocating or
+// copying any order
+void MQueue::rebuildHeap(bool refreshKeys) {
+    MQUEUE_STAT(ScopedTimer timer(m_stats.rebuildNs));
+    std::vector<Node*> nodes;
+    nodes.reserve(m_size);
+    takeNodes(nodes);
+    if (nodes.size() >= (size_t)PARALLELREBUILDMIN) {
+        parallelRebuild(nodes, refreshKeys);
+        return;
+    }
+    size_t kept = 0;
+    for (Node* node : nodes) {
+        if (refreshKeys) node->m_key = priority(node->m_order);
+        // Orders the new priority function rejects leave the queue, just
+        // as insertOrder() would have refused them
+        if (node->m_key < 0) {
+            freeNode(node);
+        } else {
+            nodes[kept++] = node;
+        }
+    }
+    nodes.resize(kept);
+    m_size = (int)kept;
+    pushNodes(nodes);
+}
+
+// rebuildHeap() in REBUILDSLICES slices on m_rebuildThreads threads. Each
+// slice of nodes gets its keys refreshed, its kept nodes moved to the
+// front, and for the tree structures is heapified; the slice heaps are
+// then merged in rounds of disjoint pairs. The shape depends only on the
+// slices, never on the threads, since a journal replays the rebuild on
+// whatever thread count the recovering queue has. DARY and BUCKET only
+// compute the keys in parallel. The rejected nodes are freed on this
+// thread, as a NodePool is not thread-safe.
+void MQueue::parallelRebuild(std::vector<Node*>& nodes, bool refreshKeys) {
+    size_t slices = (size_t)REBUILDSLICES;
+    size_t share = (nodes.size() + slices - 1) / slices;
+    auto bounds = [&](size_t slice) {
+        size_t first = std::min(nodes.size(), slice * share);
+        return std::make_pair(first, std::min(nodes.size(), first + share));
+    };
+    bool tree = m_structure != DARY && m_structure != BUCKET;
+    prifn_t priFn = m_priorFunc;
+    STRUCTURE structure = m_structure;
+    HEAPTYPE heapType = m_heapType;
+    std::vector<size_t> kept(slices);
+    std::vector<Node*> roots(slices, nullptr);
+    parallelFor(m_rebuildThreads, slices, [&](size_t slice) {
+        std::pair<size_t, size_t> range = bounds(slice);
+        size_t keep = range.first;
+        for (size_t i = range.first; i < range.second; i++) {
+            if (refreshKeys) nodes[i]->m_key = priFn(nodes[i]->m_order);
+            if (nodes[i]->m_key >= 0) std::swap(nodes[keep++], nodes[i]);
+        }
+        kept[slice] = keep - range.first;
+        if (tree) roots[slice] = heapifySlice(structure, heapType, &nodes[range.first], kept[slice]);
+    });
+    MQUEUE_STAT(if (refreshKeys) m_stats.priorityCalls += nodes.size());
+    size_t total = 0;
+    for (size_t slice = 0; slice < slices; slice++) {
+        std::pair<size_t, size_t> range = bounds(slice);
+        for (size_t i = range.first + kept[slice]; i < range.second; i++) freeNode(nodes[i]);
+        // heapifySlice reused the front of a tree slice, so only the
+        // other structures still have their kept nodes there
+        if (!tree) {
+            for (size_t i = range.first; i < range.first + kept[slice]; i++) nodes[total + i - range.first] = nodes[i];
+        }
+        total += kept[slice];
+    }
+    m_size = (int)total;
+    if (!tree) {
+        nodes.resize(total);
+        pushNodes(nodes);
+        return;
+    }
+    while (roots.size() > 1) {
+        std::vector<Node*> merged((roots.size() + 1) / 2);
+        parallelFor(m_rebuildThreads, roots.size() / 2, [&](size_t pair) {
+            merged[pair] = mergeTrees(structure, heapType, roots[2 * pair], roots[2 * pair + 1]);
+        });
+        if (roots.size() % 2 == 1) merged.back() = roots.back();
+        roots.swap(merged);
+    }
+    m_heap = roots[0];
+}
+
+// Prints preorder
+void MQueue::printPreOrder(Node* node) const {
+    std::vector<Node*> stack;
+    if (node) stack.push_back(node);
+    while (!stack.empty()) {
+        Node* current = stack.back();
+        stack.pop_back();
+        std::cout << current->m_order << " ";
+        if (current->m_right) stack.push_back(current->m_right);
+        if (current->m_left) stack.push_back(current->m_left);
+    }
+}
+
+// Snapshot file layout, in native byte order:
+//   SnapshotHeader
+//   uint64_t journal sequence number the snapshot covers (version 2 on)
+//   int32_t bucket range lo and hi (version 3 on)
+//   numOrders SnapshotNode records: the tree in level order, root first,
+//     so a child's index is always larger than its parent's; for DARY the
+//     array in slot order; for BUCKET the bucket orders in priority order,
+//     without links, then the overflow heap in level order (version 4 on;
+//     before, every order in priority order and no overflow shape)
+//   numCustomers strings, each a uint32_t length and its bytes
+namespace {
+const char SNAPSHOTMAGIC[8] = {'M', 'Q', 'S', 'N', 'A', 'P', 0, 0};
+const uint32_t SNAPSHOTVERSION = 4;
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint8_t heapType;
+    uint8_t structure;
+    uint16_t reserved;
+    uint32_t numOrders;
+    uint32_t numCustomers;
+    uint64_t stringsOffset;     // file offset of the customer strings
+};
+struct SnapshotNode {
+    uint32_t customer;          // index into the snapshot's customer strings
+    int16_t fields[8];          // FIFO through quantity, in Order's field order
+    int32_t key;
+    int32_t left;               // record index of m_left, -1 for none
+    int32_t right;              // record index of m_right, -1 for none
+    int32_t npl;
+};
+static_assert(sizeof(SnapshotHeader) == 32 && sizeof(SnapshotNode) == 36,
+              "snapshot records must not be padded");
+
+// A read-only mapping of a whole file, unmapped when it goes out of scope
+class MappedFile {
+  public:
+    explicit MappedFile(const string& path) : m_data(nullptr), m_size(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open snapshot " + path);
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            m_size = (size_t)info.st_size;
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) m_data = static_cast<const char*>(data);
+        }
+        close(fd);
+        if (!m_data) throw std::runtime_error("Cannot map snapshot " + path);
+    }
+    ~MappedFile() {munmap(const_cast<char*>(m_data), m_size);}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const char* data() const {return m_data;}
+    size_t size() const {return m_size;}
+  private:
+    const char* m_data;
+    size_t m_size;
+};
+
+SnapshotNode readRecord(const char* records, size_t index) {
+    SnapshotNode record;
+    memcpy(&record, records + index * sizeof(SnapshotNode), sizeof(record));
+    return record;
+}
+
+void corrupt() {
+    throw std::runtime_error("Snapshot file is corrupt.");
+}
+}
+
+// A journaled queue's snapshot records the last journal entry it covers;
+// the journal is synced first, so that entry is never lost after a crash
+void MQueue::saveSnapshot(const string& path) const {
+    uint64_t journalSeq = 0;
+    if (m_journal) {
+        m_journal->sync();
+        journalSeq = m_journal->lastSeq();
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("Cannot write snapshot " + path);
+    writeSnapshot(out, journalSeq);
+    out.flush();
+    if (!out) throw std::runtime_error("Cannot write snapshot " + path);
+}
+
+// Writes the header, the records in level order through a small buffer,
+// the customer strings, and finally the header again with the counts
+void MQueue::writeSnapshot(std::ostream& out, uint64_t journalSeq) const {
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOTMAGIC, sizeof(header.magic));
+    header.version = SNAPSHOTVERSION;
+    header.heapType = (uint8_t)m_heapType;
+    header.structure = (uint8_t)m_structure;
+    header.numOrders = (uint32_t)m_size;
+    int32_t bucketRange[2] = {m_bucketLo, m_bucketHi};
+    header.stringsOffset = sizeof(header) + sizeof(journalSeq) + sizeof(bucketRange) +
+                           (uint64_t)m_size * sizeof(SnapshotNode);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(&journalSeq), sizeof(journalSeq));
+    out.write(reinterpret_cast<const char*>(bucketRange), sizeof(bucketRange));
+
+    std::unordered_map<uint32_t, uint32_t> customerIndex;
+    std::vector<uint32_t> customers;
+    std::vector<SnapshotNode> buffer;
+    buffer.reserve(4096);
+    auto write = [&](const Node* node, int32_t left, int32_t right) {
+        const Order& order = node->m_order;
+        auto found = customerIndex.emplace(order.m_customerId, (uint32_t)customers.size());
+        if (found.second) customers.push_back(order.m_customerId);
+        SnapshotNode record = {found.first->second,
+                               {order.m_FIFO, order.m_processTime, order.m_dueTime, order.m_slackTime,
+                                order.m_material, order.m_importance, order.m_workForce, order.m_quantity},
+                               node->m_key, left, right, node->m_npl};
+        buffer.push_back(record);
+        if (buffer.size() == buffer.capacity()) {
+            out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(SnapshotNode));
+            buffer.clear();
+        }
+    };
+    // BUCKET writes its bucket orders in priority order, which lets the
+    // loader append to the buckets as it reads; the overflow heap follows
+    // with its shape, so that a replay pops it the same way
+    int32_t first = 0;
+    if (m_structure == BUCKET) {
+        for (size_t slot = nextBucket(0); slot != NOBUCKET; slot = nextBucket(slot + 1)) {
+            const Node* tail = m_buckets[slot];
+            const Node* node = tail;
+            do {
+                node = node->m_right;
+                write(node, -1, -1);
+                ++first;
+            } while (node != tail);
+        }
+    }
+    if (m_structure == DARY) {
+        for (const DaryEntry& entry : m_dary) write(entry.node, -1, -1);
+    } else {
+        // Children are numbered as they are queued, so every record can
+        // be written as soon as its node comes up
+        std::vector<const Node*> level;
+        level.reserve(m_size - first);
+        if (m_heap) level.push_back(m_heap);
+        for (size_t i = 0; i < level.size(); ++i) {
+            const Node* node = level[i];
+            int32_t left = -1, right = -1;
+            if (node->m_left) {
+                left = first + (int32_t)level.size();
+                level.push_back(node->m_left);
+            }
+            if (node->m_right) {
+                right = first + (int32_t)level.size();
+                level.push_back(node->m_right);
+            }
+            write(node, left, right);
+        }
+    }
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(SnapshotNode));
+
+    for (uint32_t id : customers) {
+        const string& name = CustomerTable::name(id);
+        uint32_t length = (uint32_t)name.size();
+        out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        out.write(name.data(), length);
+    }
+    header.numCustomers = (uint32_t)customers.size();
+    std::streampos end = out.tellp();
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.seekp(end);
+}
+
+void MQueue::loadSnapshot(const string& path, int maxOrders) {
+    checkNotJournaled();
+    if (!m_priorFunc) throw std::domain_error("Queue needs a priority function to load a snapshot.");
+    MappedFile file(path);
+    readSnapshot(file.data(), file.size(), maxOrders);
+}
+
+// Checks the header and string table, then rebuilds the queue straight
+// from the records. A full load links each node to its children as it
+// goes; a partial load walks the records best-first, like the priority
+// iterator, and heapifies the orders it took. Returns the journal
+// sequence number the snapshot covers.
+uint64_t MQueue::readSnapshot(const char* data, size_t size, int maxOrders) {
+    SnapshotHeader header;
+    if (size < sizeof(header)) corrupt();
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOTMAGIC, sizeof(header.magic)) != 0) corrupt();
+    if (header.version < 1 || header.version > SNAPSHOTVERSION)
+        throw std::runtime_error("Unsupported snapshot version " + std::to_string(header.version));
+    uint64_t journalSeq = 0;
+    size_t recordsOffset = sizeof(header);
+    if (header.version >= 2) {
+        if (size < sizeof(header) + sizeof(journalSeq)) corrupt();
+        memcpy(&journalSeq, data + sizeof(header), sizeof(journalSeq));
+        recordsOffset += sizeof(journalSeq);
+    }
+    int32_t bucketRange[2] = {DEFAULTBUCKETLO, DEFAULTBUCKETHI};
+    if (header.version >= 3) {
+        if (size - recordsOffset < sizeof(bucketRange)) corrupt();
+        memcpy(bucketRange, data + recordsOffset, sizeof(bucketRange));
+        recordsOffset += sizeof(bucketRange);
+        if (bucketRange[1] < bucketRange[0] || (int64_t)bucketRange[1] - bucketRange[0] >= MAXBUCKETS) corrupt();
+    }
+    if (header.heapType > MAXHEAP || header.structure > BUCKET || header.numOrders > (uint32_t)INT32_MAX ||
+        header.stringsOffset != recordsOffset + (uint64_t)header.numOrders * sizeof(SnapshotNode) ||
+        header.stringsOffset > size) {
+        corrupt();
+    }
+    std::vector<uint32_t> customers;
+    customers.reserve(header.numCustomers);
+    size_t offset = header.stringsOffset;
+    for (uint32_t i = 0; i < header.numCustomers; ++i) {
+        uint32_t length;
+        if (size - offset < sizeof(length)) corrupt();
+        memcpy(&length, data + offset, sizeof(length));
+        offset += sizeof(length);
+        if (size - offset < length) corrupt();
+        customers.push_back(CustomerTable::intern(string(data + offset, length)));
+        offset += length;
+    }
+
+    reset();
+    m_heapType = (HEAPTYPE)header.heapType;
+    m_structure = (STRUCTURE)header.structure;
+    m_bucketLo = bucketRange[0];
+    m_bucketHi = bucketRange[1];
+    const char* records = data + recordsOffset;
+    int32_t count = (int32_t)header.numOrders;
+    HEAPTYPE heapType = m_heapType;
+    auto before = [heapType](int key1, int key2) {
+        return heapType == MINHEAP ? key1 < key2 : key1 > key2;
+    };
+    bool partial = maxOrders >= 0 && maxOrders < count;
+    // Nodes built so far, freed if the file turns out to be bad
+    std::vector<Node*> nodes;
+    try {
+        if (m_structure == BUCKET && header.version < 4) {
+            int32_t taken = partial ? maxOrders : count;
+            nodes.reserve(taken);
+            for (int32_t i = 0; i < taken; ++i) {
+                nodes.push_back(snapshotNode(records + i * sizeof(SnapshotNode), customers, false));
+                if (i > 0 && before(nodes[i]->m_key, nodes[i - 1]->m_key)) corrupt();
+            }
+            pushNodes(nodes);
+            m_size = taken;
+            return journalSeq;
+        }
+        // BUCKET: records [0, first) are the bucket orders in priority
+        // order, and the overflow heap starts at first, the first record
+        // with a key outside the range
+        int32_t first = 0;
+        if (m_structure == BUCKET) {
+            while (first < count && bucketSlot(readRecord(records, first).key) != NOBUCKET) {
+                if (first > 0 && before(readRecord(records, first).key, readRecord(records, first - 1).key))
+                    corrupt();
+                ++first;
+            }
+        }
+        if (partial) {
+            // Best-first over the records; (key, index) pairs with the best key on top
+            auto worse = [&](const std::pair<int, int32_t>& a, const std::pair<int, int32_t>& b) {
+                return before(b.first, a.first);
+            };
+            std::vector<std::pair<int, int32_t> > frontier;
+            auto push = [&](int32_t index, int32_t parent) {
+                if (index <= parent || index >= count) corrupt();
+                frontier.push_back(std::make_pair(readRecord(records, index).key, index));
+                std::push_heap(frontier.begin(), frontier.end(), worse);
+            };
+            nodes.reserve(maxOrders);
+            if (count > first && maxOrders > 0) push(first, first - 1);
+            // A BUCKET record is next while it is no worse than the heap's
+            int32_t bucketNext = 0;
+            while ((int)nodes.size() < maxOrders && (!frontier.empty() || bucketNext < first)) {
+                if (bucketNext < first &&
+                    (frontier.empty() || !before(frontier.front().first, readRecord(records, bucketNext).key))) {
+                    nodes.push_back(snapshotNode(records + bucketNext++ * sizeof(SnapshotNode), customers, false));
+                    continue;
+                }
+                std::pop_heap(frontier.begin(), frontier.end(), worse);
+                int32_t index = frontier.back().second;
+                frontier.pop_back();
+                const char* record = records + index * sizeof(SnapshotNode);
+                nodes.push_back(snapshotNode(record, customers, false));
+                SnapshotNode current = readRecord(records, index);
+                if (m_structure == DARY) {
+                    int64_t first = (int64_t)index * DARYARITY + 1;
+                    for (int64_t child = first; child < first + (int64_t)DARYARITY && child < count; ++child) {
+                        push((int32_t)child, index);
+                    }
+                } else if (m_structure == PAIRING) {
+                    // The whole child list: one child does not bound its siblings
+                    for (int32_t child = current.left; child >= 0; child = readRecord(records, child).right) {
+                        push(child, index);
+                    }
+                } else {
+                    if (current.left >= 0) push(current.left, index);
+                    if (current.right >= 0) push(current.right, index);
+                }
+            }
+            int taken = (int)nodes.size();
+            pushNodes(nodes);
+            m_size = taken;
+            return journalSeq;
+        }
+        if (m_structure == DARY) {
+            m_dary.reserve(count);
+            for (int32_t i = 0; i < count; ++i) {
+                Node* node = snapshotNode(records + i * sizeof(SnapshotNode), customers, false);
+                DaryEntry entry = {node->m_key, node};
+                m_dary.push_back(entry);
+                if (i > 0 && before(entry.key, m_dary[(i - 1) / DARYARITY].key)) corrupt();
+            }
+            m_size = count;
+            return journalSeq;
+        }
+        // Bucket nodes go straight to their buckets, which reset() frees
+        for (int32_t i = 0; i < first; ++i) {
+            Node* node = snapshotNode(records + i * sizeof(SnapshotNode), customers, false);
+            bucketAppend(bucketSlot(node->m_key), node);
+        }
+        nodes.assign(count, nullptr);
+        if (count > first) nodes[first] = snapshotNode(records + first * sizeof(SnapshotNode), customers, true);
+        for (int32_t i = first; i < count; ++i) {
+            Node* node = nodes[i];
+            if (!node) corrupt();   // no parent points at this record
+            if (m_structure == BUCKET && bucketSlot(node->m_key) != NOBUCKET) corrupt();
+            SnapshotNode record = readRecord(records, i);
+            for (int side = 0; side < 2; ++side) {
+                int32_t index = side == 0 ? record.left : record.right;
+                if (index < 0) continue;
+                if (index <= i || index >= count || nodes[index]) corrupt();
+                Node* child = snapshotNode(records + index * sizeof(SnapshotNode), customers, true);
+                nodes[index] = child;
+                child->m_parent = node;
+                (side == 0 ? node->m_left : node->m_right) = child;
+                // Only a pairing sibling may come before the node that links it
+                bool ordered = side == 0 || m_structure != PAIRING;
+                if (ordered && before(child->m_key, node->m_key)) corrupt();
+            }
+        }
+        // Children come after their parents, so a backwards pass sums the
+        // subtree sizes; a pairing node takes its whole child list
+        for (int32_t i = count - 1; i >= first; --i) {
+            Node* node = nodes[i];
+            if (m_structure == PAIRING) {
+                for (Node* child = node->m_left; child; child = child->m_right) node->m_count += child->m_count;
+            } else {
+                if (node->m_left) node->m_count += node->m_left->m_count;
+                if (node->m_right) node->m_count += node->m_right->m_count;
+            }
+        }
+        m_heap = count > first ? nodes[first] : nullptr;
+        m_size = count;
+        return journalSeq;
+    } catch (...) {
+        // Nodes still in the vector are not linked from m_heap yet; DARY
+        // nodes already in m_dary go with reset()
+        for (Node* node : nodes) {
+            if (node) freeNode(node);
+        }
+        reset();
+        throw;
+    }
+}
+
+// Builds a detached node from one snapshot record. The key is recomputed:
+// a mismatch means the queue's priority function is not the saved one.
+Node* MQueue::snapshotNode(const char* bytes, const std::vector<uint32_t>& customers, bool keepShape) {
+    SnapshotNode record;
+    memcpy(&record, bytes, sizeof(record));
+    if (record.customer >= customers.size()) corrupt();
+    Order order;
+    order.m_customerId = customers[record.customer];
+    order.m_FIFO = record.fields[0];
+    order.m_processTime = record.fields[1];
+    order.m_dueTime = record.fields[2];
+    order.m_slackTime = record.fields[3];
+    order.m_material = record.fields[4];
+    order.m_importance = record.fields[5];
+    order.m_workForce = record.fields[6];
+    order.m_quantity = record.fields[7];
+    int key = priority(order);
+    if (key != record.key)
+        throw std::domain_error("Snapshot was saved with a different priority function.");
+    Node* node = newNode(std::move(order), key);
+    if (keepShape) node->m_npl = record.npl;
+    return node;
+}
+
+// Journal payloads: an order is its customer name and its eight fields,
+// a whole tree is a snapshot image
+namespace {
+template <class T>
+void put(string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void putString(string& out, const string& text) {
+    put<uint32_t>(out, (uint32_t)text.size());
+    out.append(text);
+}
+
+void putOrder(string& out, const Order& order) {
+    putString(out, order.getCustomer());
+    int fields[8] = {order.getFIFO(), order.getProcessTime(), order.getDueTime(), order.getSlackTime(),
+                     order.getMaterial(), order.getImportance(), order.getWorkForce(), order.getQuantity()};
+    for (int field : fields) put<int16_t>(out, (int16_t)field);
+}
+
+// Reads a payload front to back; running past its end means corruption
+class PayloadReader {
+  public:
+    explicit PayloadReader(const string& data) : m_data(data), m_pos(0) {}
+    template <class T>
+    T get() {
+        T value;
+        if (m_data.size() - m_pos < sizeof(value)) corrupt();
+        memcpy(&value, m_data.data() + m_pos, sizeof(value));
+        m_pos += sizeof(value);
+        return value;
+    }
+    string getString() {
+        uint32_t length = get<uint32_t>();
+        if (m_data.size() - m_pos < length) corrupt();
+        string text = m_data.substr(m_pos, length);
+        m_pos += length;
+        return text;
+    }
+    Order getOrder() {
+        string customer = getString();
+        int fields[8];
+        for (int& field : fields) field = get<int16_t>();
+        return Order(customer, fields[0], fields[1], fields[2], fields[3],
+                     fields[4], fields[5], fields[6], fields[7]);
+    }
+    const char* rest() const {return m_data.data() + m_pos;}
+    size_t restSize() const {return m_data.size() - m_pos;}
+  private:
+    const string& m_data;
+    size_t m_pos;
+};
+}
+
+// Attaching journals the current contents first, so the journal alone can
+// rebuild the queue even before the first checkpoint
+void MQueue::setJournal(OrderJournal* journal) {
+    OrderJournal* old = m_journal;
+    m_journal = journal;
+    try {
+        journalReplace(*this);
+    } catch (...) {
+        m_journal = old;
+        throw;
+    }
+}
+
+OrderJournal* MQueue::getJournal() const {
+    return m_journal;
+}
+
+void MQueue::setReclaimer(Reclaimer* reclaimer) {
+    m_reclaimer = reclaimer;
+}
+
+Reclaimer* MQueue::getReclaimer() const {
+    return m_reclaimer;
+}
+
+// The snapshot only replaces the old one once it is fully on disk
+void MQueue::checkpoint(const string& snapshotPath) {
+    string temp = snapshotPath + ".tmp";
+    saveSnapshot(temp);
+    int fd = open(temp.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!synced || std::rename(temp.c_str(), snapshotPath.c_str()) != 0)
+        throw std::runtime_error("Cannot write snapshot " + snapshotPath);
+    if (m_journal) {
+        m_journal->truncate();
+        m_journalStale = false;     // the snapshot has the current state
+    }
+}
+
+void MQueue::recover(const string& snapshotPath, const string& journalPath) {
+    checkNotJournaled();
+    uint64_t journalSeq = 0;
+    if (snapshotPath.empty()) {
+        reset();
+    } else {
+        if (!m_priorFunc) throw std::domain_error("Queue needs a priority function to load a snapshot.");
+        MappedFile file(snapshotPath);
+        journalSeq = readSnapshot(file.data(), file.size(), -1);
+    }
+    OrderJournal::replay(journalPath, journalSeq, [this](uint8_t type, const string& payload) {
+        applyJournalEntry(type, payload);
+    });
+}
+
+// Every entry goes through here. If a move left the journal stale, the
+// queue's whole state goes first, unless the entry replaces it anyway.
+void MQueue::journalAppend(uint8_t type, const string& payload) {
+    if (m_journalStale && type != JOURNALCLEAR && type != JOURNALREPLACE) journalReplace(*this);
+    m_journal->append(type, payload);
+    m_journalStale = false;
+}
+
+void MQueue::journalOrder(const Order& order) {
+    string payload;
+    putOrder(payload, order);
+    journalAppend(JOURNALINSERT, payload);
+}
+
+// Bulk inserts are replayed with insertOrders, so the heapified shape and
+// every later pop come out the same
+void MQueue::journalOrders(const std::vector<Node*>& nodes) {
+    string payload;
+    put<uint32_t>(payload, (uint32_t)nodes.size());
+    for (const Node* node : nodes) putOrder(payload, node->m_order);
+    journalAppend(JOURNALINSERTS, payload);
+}
+
+// A pop needs no payload: replay removes the same root
+void MQueue::journalPops(int count) {
+    string payload;
+    put<uint32_t>(payload, (uint32_t)count);
+    journalAppend(JOURNALPOP, payload);
+}
+
+// Throws domain_error for an unregistered function before anything changes
+void MQueue::journalPriorityFn(prifn_t priFn, HEAPTYPE heapType) {
+    string payload;
+    putString(payload, OrderJournal::priorityFnName(priFn));
+    put<uint8_t>(payload, (uint8_t)heapType);
+    journalAppend(JOURNALPRIORITY, payload);
+}
+
+// The whole state of rhs, for assignment and for attaching a journal
+void MQueue::journalReplace(const MQueue& rhs) {
+    if (!m_journal) return;
+    string payload;
+    putString(payload, rhs.m_priorFunc ? OrderJournal::priorityFnName(rhs.m_priorFunc) : string());
+    std::ostringstream image;
+    rhs.writeSnapshot(image, 0);
+    payload += image.str();
+    journalAppend(JOURNALREPLACE, payload);
+}
+
+void MQueue::checkNotJournaled() const {
+    if (m_journal) throw std::domain_error("Operation cannot be journaled; detach the journal first.");
+}
+
+// Redoes one journaled change. Pops, merges and bulk inserts go through the
+// same code as the first time, so the tree ends up in the same shape.
+void MQueue::applyJournalEntry(uint8_t type, const string& payload) {
+    PayloadReader reader(payload);
+    switch (type) {
+    case JOURNALINSERT:
+        insertOrder(reader.getOrder());
+        break;
+    case JOURNALINSERTS: {
+        uint32_t count = reader.get<uint32_t>();
+        std::vector<Order> orders;
+        for (uint32_t i = 0; i < count; ++i) orders.push_back(reader.getOrder());
+        insertOrders(orders.begin(), orders.end());
+        break;
+    }
+    case JOURNALPOP: {
+        uint32_t count = reader.get<uint32_t>();
+        if (count > (uint32_t)m_size) corrupt();
+        for (uint32_t i = 0; i < count; ++i) getNextOrder();
+        break;
+    }
+    case JOURNALMERGE: {
+        MQueue part(m_priorFunc, m_heapType, m_structure, getAllocation());
+        part.readSnapshot(payload.data(), payload.size(), -1);
+        mergeWithQueue(part);
+        break;
+    }
+    case JOURNALPRIORITY: {
+        prifn_t priFn = OrderJournal::priorityFn(reader.getString());
+        uint8_t heapType = reader.get<uint8_t>();
+        if (heapType > MAXHEAP) corrupt();
+        setPriorityFn(priFn, (HEAPTYPE)heapType);
+        break;
+    }
+    case JOURNALSTRUCTURE: {
+        uint8_t structure = reader.get<uint8_t>();
+        if (structure > BUCKET) corrupt();
+        setStructure((STRUCTURE)structure);
+        break;
+    }
+    case JOURNALCLEAR:
+        reset();
+        break;
+    case JOURNALBUCKETRANGE: {
+        int lo = reader.get<int32_t>();
+        setBucketRange(lo, reader.get<int32_t>());
+        break;
+    }
+    case JOURNALREPLACE: {
+        string name = reader.getString();
+        m_priorFunc = name.empty() ? nullptr : OrderJournal::priorityFn(name);
+        readSnapshot(reader.rest(), reader.restSize(), -1);
+        break;
+    }
+    default:
+        corrupt();
+    }
+}
+
+// Overloaded output operators
+ostream& operator<<(ostream& sout, const Order& order) {
+    sout  << "Customer: " << order.getCustomer()
+          << ", importance: " << order.getImportance() 
+          << ", quantity: " << order.getQuantity() 
+          << ", order placement time: " << order.getFIFO();
+    return sout;
+}
+
+ostream& operator<<(ostream& sout, const Node& node) {
+    sout << node.m_order;
+    return sout;
 }
\ No newline at end of file
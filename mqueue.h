@@ -1,153 +1,569 @@
-#ifndef MQUEUE_H
-#define MQUEUE_H
-
-#include <stdexcept>
-#include <iostream>
-#include <string>
-using namespace std;
-using std::out_of_range;
-class Grader;   // forward declaration (for grading purposes)
-class Tester;   //forward declaration
-class MQueue;   //forward declaration
-class Order;    //forward declaration
-// Constant parameters, min and max values
-const int MINZERO = 0;
-const int MINONE = 1;
-const int MIN1000 = 1000;
-const int MAX12 = 12;
-const int MAX50 = 50;
-const int MAX100 = 100;
-const int MAX200 = 200;
-const int MAX10000 = 10000;
-#define DEFAULTCUSTOMER "NONAME"
-
-enum HEAPTYPE {MINHEAP, MAXHEAP};
-enum STRUCTURE {SKEW, LEFTIST};
-
-// Priority function pointer type
-typedef int (*prifn_t)(const Order&);  
-
-//
-// order class
-//
-class Order {
-  public:
-    friend class Grader; // for grading purposes
-    friend class Tester; // for testing purposes
-    friend class MQueue;
-    Order(){
-        m_customer=DEFAULTCUSTOMER; m_FIFO=0; m_processTime=0;
-        m_dueTime=0; m_slackTime=0; m_material=0;
-        m_importance=0; m_workForce=0; m_quantity=0;
-    }
-    Order(string customer, int FIFO, int process, int due, int slack,
-            int material, int importance, int workers, int quantity) {
-        m_customer=customer; m_FIFO=FIFO; m_processTime=process;
-        m_dueTime=due; m_slackTime=slack; m_material=material;
-        m_importance=importance; m_workForce=workers; m_quantity=quantity;
-    }
-
-    string getCustomer() const {return m_customer;}
-    
-    int getFIFO() const {return m_FIFO;}
-    int getProcessTime() const {return m_processTime;}
-    int getDueTime() const {return m_dueTime;}
-    int getSlackTime() const {return m_slackTime;}
-
-    int getMaterial() const {return m_material;}
-    int getImportance() const {return m_importance;}
-    int getWorkForce() const {return m_workForce;}
-    int getQuantity() const{return m_quantity;}
-
-    // Overloaded insertion operator
-    friend ostream& operator<<(ostream& sout, const Order& order);
-  private:
-    string m_customer;//customer name
-
-    // m_FIFO is an integer indicating in what order customers placed their orders
-    // it takes a value between 1 and 50, at any time the plant only accepts 50 orders at max
-    // therefore this value cannot go beyond 50
-    // a value of 1 means this was the first customer who placed the order
-    // a value of 50 means this was the 50th customer who placed the order
-    int m_FIFO;// (ordinal position) = 1(higher) - 50(lower)
-    int m_processTime;// (month) = 1(higher) - 12(lower)
-    int m_dueTime;// (month) = 1(higher) - 12(lower)
-    int m_slackTime;// (month) = 1(higher) - 12(lower)
-
-    int m_material;//material availability, (percentage) = 100(higher) - 0(lower)
-    int m_importance;// customer importance (percentage) = 100(higher) - 1(lower)
-    int m_workForce;// work force availability, (person count) = 200(higher) - 100(lower)
-    int m_quantity;//quantity of the order, (unit count) = 10000(higher) - 1000(lower)
-};
-
-class Node {
-  public:
-    friend class Grader; // for grading purposes
-    friend class Tester; // for testing purposes
-    friend class MQueue;
-    Node(Order order) {  
-        m_order = order;
-        m_right = nullptr;
-        m_left = nullptr;
-        m_npl = 0;
-    }
-    void setNPL(int npl) {m_npl = npl;}
-    int getNPL() const {return m_npl;}
-    Order getOrder() const {return m_order;}
-    // Overloaded insertion operator
-    friend ostream& operator<<(ostream& sout, const Node& node);
-  private:
-    Order m_order;   // order information
-    Node * m_right;  // right child
-    Node * m_left;   // left child
-    int m_npl;       // null path length for leftist heap
-};
-
-class MQueue {
-public:
-    // stores the skew/leftist heap, minheap/maxheap
-    friend class Grader; // for grading purposes
-    friend class Tester; // for testing purposes
-    MQueue(){}
-    MQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure);
-    ~MQueue();
-    void clear();
-    MQueue(const MQueue& rhs);
-    MQueue& operator=(const MQueue& rhs);
-    bool insertOrder(const Order& input);
-    Order getNextOrder();
-    void mergeWithQueue(MQueue& rhs);
-    int numOrders() const;
-    // The following function prints the queue using preorder traversal.  
-    // Although the first order printed should have the highest priority, 
-    // the remaining orders will not necessarily be in priority order.
-    void printOrderQueue() const;
-    prifn_t getPriorityFn() const;
-    // Set a new priority function. Must rebuild the heap!!!
-    void setPriorityFn(prifn_t priFn, HEAPTYPE heapType);
-    HEAPTYPE getHeapType() const;
-    STRUCTURE getStructure() const;
-    // Set a new data structure (skew/leftist). Must rebuild the heap!!!
-    void setStructure(STRUCTURE structure);
-    void dump() const; // For debugging purposes
-
-private:
-    Node * m_heap;          // Pointer to root of skew heap
-    int m_size;             // Current size of the heap
-    prifn_t m_priorFunc;    // Function to compute priority
-    HEAPTYPE m_heapType;    // MINHEAP or MAXHEAP
-    STRUCTURE m_structure;  // skew heap or leftist heap
-
-    void dump(Node *pos) const; // helper function for dump
-
-    /******************************************
-     * Private function declarations go here! *
-     ******************************************/
-    Node* merge(Node* node1, Node* node2);
-    void rebuildHeap();
-    void printPreOrder(Node* node) const;
-    Node* copyNodes(Node* node);
-    void deleteNodes(Node* node);
-};
-
+#ifndef MQUEUE_H
+#define MQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+#include "mqueuestats.h"
+#include "nodepool.h"
+using namespace std;
+using std::out_of_range;
+class Grader;   // forward declaration (for grading purposes)
+class Tester;   //forward declaration
+class MQueue;   //forward declaration
+class Order;    //forward declaration
+class OrderJournal;     //forward declaration
+class Reclaimer;        //forward declaration
+struct SkewPolicy;      //forward declaration
+struct LeftistPolicy;   //forward declaration
+struct DaryPolicy;      //forward declaration
+struct PairingPolicy;   //forward declaration
+template <class Key, class Compare, class Structure> class BasicMQueue;
+// Constant parameters, min and max values
+const int MINZERO = 0;
+const int MINONE = 1;
+const int MIN1000 = 1000;
+const int MAX12 = 12;
+const int MAX50 = 50;
+const int MAX100 = 100;
+const int MAX200 = 200;
+const int MAX10000 = 10000;
+#define DEFAULTCUSTOMER "NONAME"
+
+enum HEAPTYPE {MINHEAP, MAXHEAP};
+enum STRUCTURE {SKEW, LEFTIST, DARY, PAIRING, BUCKET};
+enum ALLOCATION {GLOBALALLOC, POOLALLOC}; // where a queue gets its nodes from
+const size_t DARYARITY = 4; // children per slot of the DARY array heap
+const int DEFAULTBUCKETLO = 0;      // BUCKET key range until setBucketRange
+const int DEFAULTBUCKETHI = 1023;
+const int MAXBUCKETS = 1 << 22;     // largest BUCKET key range
+const int PARALLELREBUILDMIN = 1 << 16; // smallest queue rebuilt on several threads
+const int REBUILDSLICES = 64;           // slices of such a rebuild, whatever the thread count
+
+// Priority function pointer type
+typedef int (*prifn_t)(const Order&);  
+
+//
+// customer table class
+//
+// Interns customer names so that an Order only carries a 32-bit id. A plant
+// has a few thousand customers but millions of orders, so each name is
+// stored once. Id 0 is always DEFAULTCUSTOMER. The table is shared by all
+// queues and safe to use from several threads; names are never removed.
+//
+class CustomerTable {
+  public:
+    // Returns the id of a name, adding the name on first use
+    static uint32_t intern(const string& customer);
+    // Returns the name of an id; the reference stays valid for the program's life
+    static const string& name(uint32_t id);
+    static size_t size();
+};
+
+//
+// order class
+//
+// Every field is stored in 16 bits and the customer as an interned id, so
+// an Order takes 20 bytes instead of 64. The constructor throws
+// out_of_range for a value that does not fit in 16 bits; all documented
+// ranges below fit with room to spare.
+//
+class Order {
+  public:
+    friend class Grader; // for grading purposes
+    friend class Tester; // for testing purposes
+    friend class MQueue;
+    Order(){
+        m_customerId=0; m_FIFO=0; m_processTime=0;
+        m_dueTime=0; m_slackTime=0; m_material=0;
+        m_importance=0; m_workForce=0; m_quantity=0;
+    }
+    Order(const string& customer, int FIFO, int process, int due, int slack,
+            int material, int importance, int workers, int quantity) {
+        m_customerId=CustomerTable::intern(customer); m_FIFO=narrow(FIFO); m_processTime=narrow(process);
+        m_dueTime=narrow(due); m_slackTime=narrow(slack); m_material=narrow(material);
+        m_importance=narrow(importance); m_workForce=narrow(workers); m_quantity=narrow(quantity);
+    }
+
+    const string& getCustomer() const {return CustomerTable::name(m_customerId);}
+    uint32_t getCustomerId() const {return m_customerId;}
+    
+    int getFIFO() const {return m_FIFO;}
+    int getProcessTime() const {return m_processTime;}
+    int getDueTime() const {return m_dueTime;}
+    int getSlackTime() const {return m_slackTime;}
+
+    int getMaterial() const {return m_material;}
+    int getImportance() const {return m_importance;}
+    int getWorkForce() const {return m_workForce;}
+    int getQuantity() const{return m_quantity;}
+
+    // Overloaded insertion operator
+    friend ostream& operator<<(ostream& sout, const Order& order);
+  private:
+    uint32_t m_customerId;//customer name, an id into CustomerTable
+
+    // m_FIFO is an integer indicating in what order customers placed their orders
+    // it takes a value between 1 and 50, at any time the plant only accepts 50 orders at max
+    // therefore this value cannot go beyond 50
+    // a value of 1 means this was the first customer who placed the order
+    // a value of 50 means this was the 50th customer who placed the order
+    int16_t m_FIFO;// (ordinal position) = 1(higher) - 50(lower)
+    int16_t m_processTime;// (month) = 1(higher) - 12(lower)
+    int16_t m_dueTime;// (month) = 1(higher) - 12(lower)
+    int16_t m_slackTime;// (month) = 1(higher) - 12(lower)
+
+    int16_t m_material;//material availability, (percentage) = 100(higher) - 0(lower)
+    int16_t m_importance;// customer importance (percentage) = 100(higher) - 1(lower)
+    int16_t m_workForce;// work force availability, (person count) = 200(higher) - 100(lower)
+    int16_t m_quantity;//quantity of the order, (unit count) = 10000(higher) - 1000(lower)
+
+    static int16_t narrow(int value) {
+        if (value < INT16_MIN || value > INT16_MAX)
+            throw std::out_of_range("Order field does not fit in 16 bits");
+        return (int16_t)value;
+    }
+};
+
+class Node {
+  public:
+    friend class Grader; // for grading purposes
+    friend class Tester; // for testing purposes
+    friend class MQueue;
+    friend struct SkewPolicy;
+    friend struct LeftistPolicy;
+    friend struct PairingPolicy;
+    template <class Key, class Compare, class Structure> friend class BasicMQueue;
+    Node(Order order, int key = 0) {  
+        m_order = std::move(order);
+        m_right = nullptr;
+        m_left = nullptr;
+        m_parent = nullptr;
+        m_npl = 0;
+        m_key = key;
+        m_count = 1;
+    }
+    void setNPL(int npl) {m_npl = npl;}
+    int getNPL() const {return m_npl;}
+    int getKey() const {return m_key;}
+    const Order& getOrder() const {return m_order;}
+    // Overloaded insertion operator
+    friend ostream& operator<<(ostream& sout, const Node& node);
+  private:
+    Order m_order;   // order information
+    Node * m_right;  // right child, next sibling in a pairing heap
+    Node * m_left;   // left child, first child in a pairing heap
+    Node * m_parent; // node whose m_left or m_right points here, nullptr at the root
+    int m_npl;       // null path length for leftist heap
+    int m_key;       // cached priority of m_order under the queue's priority function
+    int m_count;     // nodes in this subtree, not counting a pairing node's siblings
+};
+
+//
+// order handle class
+//
+// Identifies one queued order so that it can be updated or cancelled
+// without draining the queue. A handle stays valid until its order is
+// popped or cancelled, including across mergeWithQueue (use it with the
+// queue that absorbed the order), setPriorityFn and setStructure.
+//
+class OrderHandle {
+  public:
+    friend class Tester; // for testing purposes
+    friend class MQueue;
+    OrderHandle() : m_node(nullptr) {}
+    bool isValid() const {return m_node != nullptr;}
+    const Order& getOrder() const {return m_node->getOrder();}
+  private:
+    explicit OrderHandle(Node* node) : m_node(node) {}
+    Node* m_node;
+};
+
+// Slot of the DARY array: the cached key sits next to the node that holds
+// the order, so sifting compares keys without touching the nodes
+struct DaryEntry {
+    int key;
+    Node* node;
+};
+
+class MQueue {
+public:
+    // stores the skew/leftist heap, minheap/maxheap
+    friend class Grader; // for grading purposes
+    friend class Tester; // for testing purposes
+    // Forward iterator over the orders in priority order. It holds a
+    // frontier heap of the nodes whose parents were already visited, so
+    // the first k orders cost O(k log k) and the rest are never touched.
+    // The queue must not change while an iterator is in use.
+    class const_iterator {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Order value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Order* pointer;
+        typedef const Order& reference;
+        const_iterator() : m_queue(nullptr) {}
+        reference operator*() const;
+        pointer operator->() const {return &**this;}
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const {return !(*this == rhs);}
+      private:
+        friend class MQueue;
+        struct Entry {
+            int key;
+            Node* node;
+            size_t pos;     // slot in m_dary for DARY, bucket slot or NOBUCKET for BUCKET
+        };
+        explicit const_iterator(const MQueue* queue);
+        void push(const Entry& entry);
+        const MQueue* m_queue;
+        std::vector<Entry> m_frontier;  // heap with the current order on top
+    };
+    MQueue() : m_heap(nullptr), m_size(0), m_priorFunc(nullptr), m_heapType(MINHEAP),
+               m_structure(SKEW), m_pool(nullptr), m_bucketLo(DEFAULTBUCKETLO),
+               m_bucketHi(DEFAULTBUCKETHI), m_bucketWord(0), m_journal(nullptr), m_journalStale(false),
+               m_countsStale(false), m_rebuildThreads(1), m_reclaimer(nullptr) {}
+    // A POOLALLOC queue takes its nodes from a NodePool it owns; clear()
+    // and the destructor then hand whole slabs back at once
+    MQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure,
+           ALLOCATION allocation = GLOBALALLOC);
+    // Builds the queue from a range of orders in linear time
+    template <class InputIt>
+    MQueue(InputIt first, InputIt last, prifn_t priFn, HEAPTYPE heapType,
+           STRUCTURE structure, ALLOCATION allocation = GLOBALALLOC);
+    ~MQueue();
+    void clear();
+    MQueue(const MQueue& rhs);
+    MQueue& operator=(const MQueue& rhs);
+    // Moves take over the tree and node pool of rhs in O(1) and leave rhs
+    // an empty GLOBALALLOC queue
+    MQueue(MQueue&& rhs) noexcept;
+    MQueue& operator=(MQueue&& rhs) noexcept;
+    bool insertOrder(const Order& input);
+    bool insertOrder(Order&& input);
+    // Same as insertOrder, and on success sets handle to the new order
+    bool insertOrder(const Order& input, OrderHandle& handle);
+    // Replaces the order behind a handle and moves it to its new place in
+    // O(log n) for LEFTIST and amortized O(log n) for SKEW and PAIRING.
+    // Returns false, changing nothing, if the priority function rejects
+    // newOrder. Throws domain_error for DARY and BUCKET.
+    bool updateOrder(const OrderHandle& handle, const Order& newOrder);
+    // Removes the order behind a handle and returns it; same bounds as
+    // updateOrder. The handle is invalid afterwards.
+    Order cancelOrder(OrderHandle& handle);
+    // Constructs the order inside its node from Order constructor arguments
+    template <class... Args>
+    bool emplaceOrder(Args&&... args);
+    // Inserts a range of orders with a linear-time heapify instead of one
+    // merge per order; returns how many orders were accepted
+    template <class InputIt>
+    int insertOrders(InputIt first, InputIt last);
+    // Removes the root and moves its order out to the caller
+    Order getNextOrder();
+    // Removes up to k orders in priority order and moves them to out;
+    // returns how many were written
+    template <class OutputIt>
+    int getNextOrders(int k, OutputIt out);
+    // Returns the next order without removing it; throws out_of_range if
+    // the queue is empty. The reference is valid until the queue changes.
+    const Order& peekNextOrder() const;
+    // Returns copies of the next k orders in priority order without
+    // changing the queue. Explores the heap best-first with a frontier heap
+    // in O(k log k); PAIRING also scans the child list of each order taken.
+    std::vector<Order> peekTopK(int k) const;
+    const_iterator begin() const;
+    const_iterator end() const;
+    // Calls fn(order) for every order with lo <= priority <= hi, in no
+    // particular order. A node already past the range (above hi for
+    // MINHEAP, below lo for MAXHEAP) rules out its whole subtree, so the
+    // walk only touches the orders up to the far end of the range.
+    template <class Fn>
+    void forEachInPriorityRange(int lo, int hi, Fn fn) const;
+    // Returns the cached priority of the next order in O(1) without
+    // removing it; throws out_of_range if the queue is empty
+    int getTopPriority() const;
+    void mergeWithQueue(MQueue& rhs);
+    // Detaches part of the queue and returns it as a new queue with the
+    // same priority function and structure: the root's left subtree for
+    // SKEW and LEFTIST, its first child for PAIRING, and the worse half of
+    // the bucketed orders for BUCKET (the overflow heap's left subtree once
+    // the buckets are empty). The trees split in O(1), as every node keeps
+    // the size of its subtree; after a handle update or cancel the split
+    // walks the detached part to count it instead, until a rebuild or clear.
+    // Handles follow their orders into the new queue. Throws domain_error
+    // for a POOLALLOC queue, whose nodes cannot leave its pool, and for
+    // DARY, which has no part to detach without copying.
+    MQueue splitQueue();
+    int numOrders() const;
+    // The following function prints the queue using preorder traversal.  
+    // Although the first order printed should have the highest priority, 
+    // the remaining orders will not necessarily be in priority order.
+    void printOrderQueue() const;
+    prifn_t getPriorityFn() const;
+    // Set a new priority function. Must rebuild the heap!!!
+    void setPriorityFn(prifn_t priFn, HEAPTYPE heapType);
+    HEAPTYPE getHeapType() const;
+    STRUCTURE getStructure() const;
+    // Set a new data structure (skew/leftist/d-ary/pairing/bucket). Must rebuild the heap!!!
+    void setStructure(STRUCTURE structure);
+    // Declares the keys BUCKET keeps in buckets, one FIFO list per key in
+    // [lo, hi]: insert is O(1) and a pop finds the next non-empty bucket by
+    // scanning a bitmap a word at a time. Orders of equal key come out in
+    // the order they went in. Keys outside the range go to a leftist
+    // overflow heap, which has no such order. Other structures only
+    // remember the range. Throws out_of_range if hi < lo or the range has more than
+    // MAXBUCKETS keys.
+    void setBucketRange(int lo, int hi);
+    std::pair<int, int> getBucketRange() const;
+    // Sets the threads setPriorityFn and setStructure rebuild with. A queue
+    // of at least PARALLELREBUILDMIN orders is rebuilt in REBUILDSLICES
+    // slices: the threads compute the new keys of a slice and heapify it,
+    // then the slice heaps are merged pairwise in parallel rounds. The
+    // slices do not depend on the thread count, so neither does the new
+    // heap, and a journal replays it exactly on any thread count. Smaller
+    // queues rebuild on the calling thread. The priority function must be
+    // safe to call from several threads at once. Throws out_of_range
+    // below 1.
+    void setRebuildThreads(int threads);
+    int getRebuildThreads() const;
+    ALLOCATION getAllocation() const;
+    // Writes the queue to a versioned binary file: the tree shape with
+    // cached keys and NPLs, the DARY array, or for BUCKET the bucket orders
+    // in priority order and the overflow heap's shape, plus a table of the
+    // customer names. Throws runtime_error if the file cannot be written.
+    void saveSnapshot(const string& path) const;
+    // Replaces the contents of the queue with a snapshot, taking its heap
+    // type and structure. The file is mapped and every node rebuilt in one
+    // pass, without heapifying. With maxOrders >= 0 only that many orders
+    // of highest priority are read. The queue's priority function must be
+    // the one the snapshot was saved with, else domain_error is thrown;
+    // runtime_error means the file is missing or corrupt. On error the
+    // queue is left empty.
+    void loadSnapshot(const string& path, int maxOrders = -1);
+    // Writes every later change of the queue to journal, starting with the
+    // current contents, until setJournal(nullptr). The journal must outlive
+    // that. Its priority functions must be registered with OrderJournal;
+    // setPriorityFn and copy assignment throw domain_error otherwise. Moves
+    // must not throw, so they write nothing; they leave the journals of
+    // both queues stale, and the next journaled change of either records
+    // its whole state first. Handle updates and cancels, splitQueue and
+    // loadSnapshot cannot be journaled and throw domain_error.
+    void setJournal(OrderJournal* journal);
+    OrderJournal* getJournal() const;
+    // Hands the nodes of every later clear(), assignment or destruction to
+    // reclaimer, which frees them on its own thread, so those return in
+    // O(1); nullptr frees them in place again. The reclaimer must outlive
+    // that. Copies and moves of the queue do not take it along.
+    void setReclaimer(Reclaimer* reclaimer);
+    Reclaimer* getReclaimer() const;
+    // Saves a snapshot atomically (write, fsync, rename) and empties the
+    // journal, whose entries the snapshot now covers
+    void checkpoint(const string& snapshotPath);
+    // Rebuilds the queue after a crash: loads the snapshot (skipped if
+    // snapshotPath is empty) and replays the journal entries written after
+    // it. Throws domain_error while a journal is attached; attach it after.
+    void recover(const string& snapshotPath, const string& journalPath);
+    // Returns the counters and latency histograms described in
+    // mqueuestats.h, plus the current shape of the tree, which takes an
+    // O(n) walk. Built without MQUEUE_STATS, only the shape is filled in.
+    MQueueStats getStats() const;
+    void resetStats();
+    void dump() const; // For debugging purposes
+
+private:
+    Node * m_heap;          // Pointer to root of skew heap
+    int m_size;             // Current size of the heap
+    prifn_t m_priorFunc;    // Function to compute priority
+    HEAPTYPE m_heapType;    // MINHEAP or MAXHEAP
+    STRUCTURE m_structure;  // skew heap or leftist heap
+    NodePool<Node>* m_pool; // node pool for POOLALLOC, nullptr for GLOBALALLOC
+    std::vector<DaryEntry> m_dary; // implicit 4-ary heap, used instead of m_heap for DARY
+    int m_bucketLo;                // BUCKET key range; m_heap holds the other keys
+    int m_bucketHi;
+    std::vector<Node*> m_buckets;  // BUCKET: tail of each slot's circular FIFO list, linked through m_right
+    std::vector<uint64_t> m_bucketBits;    // BUCKET: one bit per non-empty slot
+    size_t m_bucketWord;           // BUCKET: every bit word before this one is zero
+    OrderJournal* m_journal;       // write-ahead log of changes, nullptr for none
+    bool m_journalStale;           // a move changed the queue behind m_journal's back
+    bool m_countsStale;            // a handle unlinked a node without fixing its ancestors' m_count
+    int m_rebuildThreads;          // threads rebuildHeap may use
+    Reclaimer* m_reclaimer;        // frees dropped nodes in the background, nullptr for none
+#ifdef MQUEUE_STATS
+    MQueueStats m_stats;           // counters since construction or resetStats()
+#endif
+
+    static const size_t NOBUCKET = SIZE_MAX;   // no such bucket slot
+
+    void dump(Node *pos) const; // helper function for dump
+
+    /******************************************
+     * Private function declarations go here! *
+     ******************************************/
+    int priority(const Order& order);
+    Node* merge(Node* node1, Node* node2);
+    template <class Fn>
+    Node* withPolicy(STRUCTURE structure, Fn fn);
+    void rebuildHeap(bool refreshKeys);
+    void parallelRebuild(std::vector<Node*>& nodes, bool refreshKeys);
+    void printPreOrder(Node* node) const;
+    Node* copyNodes(Node* node);
+    void deleteNodes(Node* node);
+    Node* newNode(Order order, int key);
+    bool insertNode(Node* node);
+    void linkNode(Node* node);
+    void freeNode(Node* node);
+    Node* heapify(std::vector<Node*>& nodes);
+    void pushNode(Node* node);
+    void pushNodes(std::vector<Node*>& nodes);
+    Node* popNode();
+    void takeNodes(std::vector<Node*>& nodes);
+    void daryAppended(size_t first);
+    void copyDary(const std::vector<DaryEntry>& entries);
+    void darySiftUp(size_t pos);
+    void darySiftDown(size_t pos);
+    void daryHeapify();
+    void dumpDary(size_t pos) const;
+    void dumpPairing(Node* pos) const;
+    size_t bucketSlot(int key) const;
+    int bucketKey(size_t slot) const;
+    size_t nextBucket(size_t slot) const;
+    void bucketAppend(size_t slot, Node* node);
+    void bucketPush(Node* node);
+    Node* bucketFront() const;
+    Node* bucketPop();
+    void bucketMerge(MQueue& rhs);
+    void bucketSplit(MQueue& part);
+    void copyBuckets(const MQueue& rhs);
+    void dumpBuckets() const;
+    void unlinkNode(Node* node);
+    void checkHandle(const OrderHandle& handle) const;
+    static int countNodes(Node* node);
+    Node* snapshotNode(const char* record, const std::vector<uint32_t>& customers, bool keepShape);
+    void writeSnapshot(std::ostream& out, uint64_t journalSeq) const;
+    uint64_t readSnapshot(const char* data, size_t size, int maxOrders);
+    void reset();
+    void discard(bool newPool);
+    void journalAppend(uint8_t type, const string& payload);
+    void journalOrder(const Order& order);
+    void journalOrders(const std::vector<Node*>& nodes);
+    void journalPops(int count);
+    void journalPriorityFn(prifn_t priFn, HEAPTYPE heapType);
+    void journalReplace(const MQueue& rhs);
+    void checkNotJournaled() const;
+    void applyJournalEntry(uint8_t type, const string& payload);
+};
+
+template <class InputIt>
+MQueue::MQueue(InputIt first, InputIt last, prifn_t priFn, HEAPTYPE heapType,
+               STRUCTURE structure, ALLOCATION allocation)
+    : MQueue(priFn, heapType, structure, allocation) {
+    insertOrders(first, last);
+}
+
+template <class OutputIt>
+int MQueue::getNextOrders(int k, OutputIt out) {
+    int count = k < m_size ? k : m_size;
+    if (count <= 0) return 0;
+    if (m_journal) journalPops(count);
+    for (int i = 0; i < count; ++i) {
+        Node* oldRoot = popNode();
+        *out++ = std::move(oldRoot->m_order);
+        freeNode(oldRoot);
+        --m_size;
+    }
+    return count;
+}
+
+template <class Fn>
+void MQueue::forEachInPriorityRange(int lo, int hi, Fn fn) const {
+    HEAPTYPE heapType = m_heapType;
+    auto beyond = [=](int key) {return heapType == MINHEAP ? key > hi : key < lo;};
+    if (m_structure == BUCKET) {
+        // The slots of the keys in [lo, hi]; the overflow heap follows below
+        int first = lo > m_bucketLo ? lo : m_bucketLo;
+        int last = hi < m_bucketHi ? hi : m_bucketHi;
+        if (first <= last) {
+            size_t to = bucketSlot(heapType == MINHEAP ? last : first);
+            for (size_t slot = nextBucket(bucketSlot(heapType == MINHEAP ? first : last));
+                 slot <= to; slot = nextBucket(slot + 1)) {
+                Node* tail = m_buckets[slot];
+                Node* node = tail;
+                do {
+                    node = node->m_right;
+                    fn(static_cast<const Order&>(node->m_order));
+                } while (node != tail);
+            }
+        }
+    } else if (m_structure == DARY) {
+        std::vector<size_t> stack;
+        if (!m_dary.empty()) stack.push_back(0);
+        while (!stack.empty()) {
+            size_t pos = stack.back();
+            stack.pop_back();
+            const DaryEntry& entry = m_dary[pos];
+            if (beyond(entry.key)) continue;
+            if (entry.key >= lo && entry.key <= hi) fn(static_cast<const Order&>(entry.node->m_order));
+            size_t first = pos * DARYARITY + 1;
+            for (size_t child = first; child < first + DARYARITY && child < m_dary.size(); ++child) {
+                stack.push_back(child);
+            }
+        }
+        return;
+    }
+    std::vector<Node*> stack;
+    if (m_heap) stack.push_back(m_heap);
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        // A pairing sibling is not below node in heap order, so it is
+        // visited even when node's own subtree is cut off
+        if (m_structure == PAIRING && node->m_right) stack.push_back(node->m_right);
+        if (beyond(node->m_key)) continue;
+        if (node->m_key >= lo && node->m_key <= hi) fn(static_cast<const Order&>(node->m_order));
+        if (node->m_left) stack.push_back(node->m_left);
+        if (m_structure != PAIRING && node->m_right) stack.push_back(node->m_right);
+    }
+}
+
+// Every priority function call goes through here, so that it can be counted
+inline int MQueue::priority(const Order& order) {
+    MQUEUE_STAT(++m_stats.priorityCalls);
+    return m_priorFunc(order);
+}
+
+template <class... Args>
+bool MQueue::emplaceOrder(Args&&... args) {
+    return insertNode(newNode(Order(std::forward<Args>(args)...), 0));
+}
+
+template <class InputIt>
+int MQueue::insertOrders(InputIt first, InputIt last) {
+    std::vector<Node*> nodes;
+    for (; first != last; ++first) {
+        int key = priority(*first);
+        if (key < 0) continue;
+        nodes.push_back(newNode(*first, key));
+    }
+    int count = (int)nodes.size();
+    if (m_journal) {
+        // Before pushNodes, which reuses the vector
+        try {
+            journalOrders(nodes);
+        } catch (...) {
+            for (Node* node : nodes) freeNode(node);
+            throw;
+        }
+    }
+    pushNodes(nodes);
+    m_size += count;
+    return count;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,1048 @@
+#include "mqueue.h"
+#include "basicmqueue.h"
+#include "multimqueue.h"
+#include "workstealing.h"
+#include "journal.h"
+#include "persistentmqueue.h"
+#include "blockingmqueue.h"
+#include "boundedmqueue.h"
+#include "reclaimer.h"
+#include "random.h"
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+using namespace std;
+
+int priorityFn1(const Order &order);
+int priorityFn2(const Order &order);
+
+// Builds n orders with every field drawn uniformly from its documented
+// range, placed by a pool of a few thousand customers
+vector<Order> makeOrders(int n, unsigned seed = 10) {
+    const int customers = 2000;
+    mt19937 gen(seed);
+    uniform_int_distribution<> letter(97, 122), customer(0, customers - 1);
+    vector<string> names(customers);
+    for (string& name : names) {
+        for (int j = 0; j < 5; j++) name += (char)letter(gen);
+    }
+    uniform_int_distribution<> fifo(MINONE, MAX50), month(MINONE, MAX12);
+    uniform_int_distribution<> material(MINZERO, MAX100), importance(MINONE, MAX100);
+    uniform_int_distribution<> workers(MAX100, MAX200), quantity(MIN1000, MAX10000);
+    vector<Order> orders;
+    orders.reserve(n);
+    for (int i = 0; i < n; i++) {
+        orders.push_back(Order(names[customer(gen)], fifo(gen), month(gen), month(gen), month(gen),
+                               material(gen), importance(gen), workers(gen), quantity(gen)));
+    }
+    return orders;
+}
+
+// Returns the wall time of fn() in milliseconds
+template <class Fn>
+double timeMs(Fn fn) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+const char* structureName(STRUCTURE structure) {
+    switch (structure) {
+    case SKEW: return "SKEW";
+    case LEFTIST: return "LEFTIST";
+    case PAIRING: return "PAIRING";
+    case BUCKET: return "BUCKET";
+    default: return "DARY";
+    }
+}
+
+// Insert every order, then pop them all; this is dominated by merge comparisons
+void benchInsertPop(const vector<Order>& orders) {
+    cout << "insert/pop of " << orders.size() << " orders\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST}) {
+        for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+            prifn_t fn = heapType == MINHEAP ? priorityFn2 : priorityFn1;
+            MQueue queue(fn, heapType, structure);
+            double insertMs = timeMs([&] {
+                for (const Order& order : orders) queue.insertOrder(order);
+            });
+            double popMs = timeMs([&] {
+                while (queue.numOrders() > 0) queue.getNextOrder();
+            });
+            cout << "  " << structureName(structure)
+                 << (heapType == MINHEAP ? " MINHEAP" : " MAXHEAP")
+                 << "  insert " << insertMs << " ms, pop " << popMs << " ms\n";
+        }
+    }
+}
+
+// Steady-state churn (pop one, insert one) on a resident queue, then many
+// short-lived per-worker queues; POOLALLOC against the global allocator
+void benchNodePool(const vector<Order>& orders) {
+    const size_t resident = 100000;
+    const size_t cycles = orders.size() * 4;
+    cout << "node pool: " << cycles << " pop/insert cycles on " << resident << " orders\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST}) {
+        for (ALLOCATION allocation : {GLOBALALLOC, POOLALLOC}) {
+            MQueue queue(priorityFn2, MINHEAP, structure, allocation);
+            for (size_t i = 0; i < resident; i++) queue.insertOrder(orders[i]);
+            double churnMs = timeMs([&] {
+                for (size_t i = 0; i < cycles; i++) {
+                    queue.getNextOrder();
+                    queue.insertOrder(orders[i % orders.size()]);
+                }
+            });
+            double shortMs = timeMs([&] {
+                for (size_t q = 0; q < 2000; q++) {
+                    MQueue worker(priorityFn2, MINHEAP, structure, allocation);
+                    for (size_t i = 0; i < 500; i++) worker.insertOrder(orders[q + i]);
+                    while (worker.numOrders() > 0) worker.getNextOrder();
+                }
+            });
+            double clearMs = timeMs([&] {queue.clear();});
+            cout << "  " << structureName(structure)
+                 << (allocation == POOLALLOC ? " POOLALLOC  " : " GLOBALALLOC")
+                 << "  churn " << churnMs << " ms, 2000 short-lived queues " << shortMs
+                 << " ms, clear " << clearMs << " ms\n";
+        }
+    }
+}
+
+// Loading a backlog: one insertOrder per order against insertOrders
+void benchBulkLoad(const vector<Order>& orders) {
+    cout << "bulk load of " << orders.size() << " orders\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST}) {
+        MQueue loopQueue(priorityFn2, MINHEAP, structure);
+        double loopMs = timeMs([&] {
+            for (const Order& order : orders) loopQueue.insertOrder(order);
+        });
+        MQueue bulkQueue(priorityFn2, MINHEAP, structure);
+        double bulkMs = timeMs([&] {
+            bulkQueue.insertOrders(orders.begin(), orders.end());
+        });
+        cout << "  " << structureName(structure) << "  insertOrder loop " << loopMs
+             << " ms, insertOrders " << bulkMs << " ms\n";
+    }
+}
+
+// Rebuilds triggered by setPriorityFn and setStructure on a full queue
+void benchRebuild(const vector<Order>& orders) {
+    cout << "rebuild of " << orders.size() << " orders\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST}) {
+        MQueue queue(orders.begin(), orders.end(), priorityFn2, MINHEAP, structure);
+        double priorityMs = timeMs([&] {queue.setPriorityFn(priorityFn1, MAXHEAP);});
+        STRUCTURE other = structure == SKEW ? LEFTIST : SKEW;
+        double structureMs = timeMs([&] {queue.setStructure(other);});
+        cout << "  " << structureName(structure) << "  setPriorityFn " << priorityMs
+             << " ms, setStructure(" << structureName(other) << ") " << structureMs << " ms\n";
+    }
+}
+
+// The same rebuilds on 1 to 32 threads. Speedups beyond the machine's
+// hardware threads only measure the cost of the extra threads.
+void benchParallelRebuild(const vector<Order>& orders) {
+    cout << "parallel rebuild of " << orders.size() << " orders, "
+         << thread::hardware_concurrency() << " hardware threads\n";
+    for (STRUCTURE structure : {SKEW, PAIRING}) {
+        MQueue queue(orders.begin(), orders.end(), priorityFn2, MINHEAP, structure);
+        for (int threads : {1, 2, 4, 8, 16, 32}) {
+            queue.setRebuildThreads(threads);
+            double priorityMs = timeMs([&] {queue.setPriorityFn(priorityFn1, MAXHEAP);});
+            double structureMs = timeMs([&] {queue.setStructure(LEFTIST);});
+            queue.setPriorityFn(priorityFn2, MINHEAP);
+            queue.setStructure(structure);
+            cout << "  " << structureName(structure) << "  " << threads << " threads  setPriorityFn "
+                 << priorityMs << " ms, setStructure(LEFTIST) " << structureMs << " ms\n";
+        }
+    }
+}
+
+// Inlined functor versions of the priority functions below
+struct PriorityFn1Key {
+    int operator()(const Order& order) const {return priorityFn1(order);}
+};
+struct PriorityFn2Key {
+    int operator()(const Order& order) const {return priorityFn2(order);}
+};
+
+template <class Queue>
+void timeQueue(const char* name, Queue& queue, const vector<Order>& orders) {
+    double insertMs = timeMs([&] {
+        for (const Order& order : orders) queue.insertOrder(order);
+    });
+    double popMs = timeMs([&] {
+        while (queue.numOrders() > 0) queue.getNextOrder();
+    });
+    cout << "  " << name << "  insert " << insertMs << " ms, pop " << popMs << " ms\n";
+}
+
+// MQueue (runtime dispatch) against BasicMQueue with a function pointer key
+// and with inlined functor keys
+void benchBasicMQueue(const vector<Order>& orders) {
+    cout << "BasicMQueue insert/pop of " << orders.size() << " orders\n";
+    {
+        MQueue queue(priorityFn1, MAXHEAP, LEFTIST);
+        timeQueue("MQueue priorityFn1 MAXHEAP LEFTIST            ", queue, orders);
+        BasicMQueue<FunctionKey, greater<int>, LeftistPolicy> pointerQueue(priorityFn1);
+        timeQueue("BasicMQueue<FunctionKey> MAXHEAP LEFTIST      ", pointerQueue, orders);
+        BasicMQueue<PriorityFn1Key, greater<int>, LeftistPolicy> inlineQueue;
+        timeQueue("BasicMQueue<PriorityFn1Key> MAXHEAP LEFTIST   ", inlineQueue, orders);
+    }
+    {
+        MQueue queue(priorityFn2, MINHEAP, SKEW);
+        timeQueue("MQueue priorityFn2 MINHEAP SKEW               ", queue, orders);
+        BasicMQueue<FunctionKey, less<int>, SkewPolicy> pointerQueue(priorityFn2);
+        timeQueue("BasicMQueue<FunctionKey> MINHEAP SKEW         ", pointerQueue, orders);
+        BasicMQueue<PriorityFn2Key, less<int>, SkewPolicy> inlineQueue;
+        timeQueue("BasicMQueue<PriorityFn2Key> MINHEAP SKEW      ", inlineQueue, orders);
+    }
+}
+
+MQueue buildQueue(const vector<Order>& orders, STRUCTURE structure) {
+    MQueue queue(orders.begin(), orders.end(), priorityFn2, MINHEAP, structure);
+    return queue;
+}
+
+// Handing a built queue to its owner: deep copy against move
+void benchMove(const vector<Order>& orders) {
+    cout << "copy vs move of a " << orders.size() << " order queue\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST}) {
+        MQueue source = buildQueue(orders, structure);
+        MQueue copied(priorityFn2, MINHEAP, structure);
+        double copyMs = timeMs([&] {copied = source;});
+        MQueue moved(priorityFn2, MINHEAP, structure);
+        double moveMs = timeMs([&] {moved = std::move(source);});
+        cout << "  " << structureName(structure) << "  copy assignment " << copyMs
+             << " ms, move assignment " << moveMs << " ms\n";
+    }
+}
+
+// Footprint of one queued order; a Node must fit in a 64-byte cache line
+void benchFootprint(const vector<Order>& orders) {
+    cout << "footprint\n";
+    cout << "  sizeof(Order) " << sizeof(Order) << " bytes, sizeof(Node) " << sizeof(Node)
+         << " bytes, " << CustomerTable::size() << " interned customers for "
+         << orders.size() << " orders\n";
+}
+
+// DARY against the tree structures: insert/pop at several sizes and a
+// merge-heavy trace where the array heap has to re-heapify
+void benchDary(const vector<Order>& orders) {
+    cout << "DARY vs trees\n";
+    for (size_t size : {size_t(10000), size_t(100000), orders.size()}) {
+        vector<Order> slice(orders.begin(), orders.begin() + size);
+        for (STRUCTURE structure : {SKEW, LEFTIST, DARY}) {
+            MQueue queue(priorityFn2, MINHEAP, structure, POOLALLOC);
+            double insertMs = timeMs([&] {
+                for (const Order& order : slice) queue.insertOrder(order);
+            });
+            double popMs = timeMs([&] {
+                while (queue.numOrders() > 0) queue.getNextOrder();
+            });
+            cout << "  " << size << " " << structureName(structure) << "  insert " << insertMs
+                 << " ms, pop " << popMs << " ms\n";
+        }
+    }
+    const size_t parts = 1000, partSize = 200;
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY}) {
+        MQueue plant(priorityFn2, MINHEAP, structure);
+        double mergeMs = timeMs([&] {
+            for (size_t p = 0; p < parts; p++) {
+                MQueue line(orders.begin() + p * partSize, orders.begin() + (p + 1) * partSize,
+                            priorityFn2, MINHEAP, structure);
+                plant.mergeWithQueue(line);
+            }
+        });
+        cout << "  merge " << parts << " queues of " << partSize << " " << structureName(structure)
+             << "  " << mergeMs << " ms\n";
+    }
+}
+
+// PAIRING against SKEW and LEFTIST on three traces: insert-heavy (one pop
+// per ten inserts), pop-heavy (bulk load then drain) and merge-heavy
+// (per-line queues melded into a plant queue between pops)
+void benchPairing(const vector<Order>& orders) {
+    cout << "pairing heap traces on " << orders.size() << " orders\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST, PAIRING}) {
+        MQueue insertQueue(priorityFn2, MINHEAP, structure, POOLALLOC);
+        double insertMs = timeMs([&] {
+            for (size_t i = 0; i < orders.size(); i++) {
+                insertQueue.insertOrder(orders[i]);
+                if (i % 10 == 9) insertQueue.getNextOrder();
+            }
+        });
+        MQueue popQueue(orders.begin(), orders.end(), priorityFn2, MINHEAP, structure, POOLALLOC);
+        double popMs = timeMs([&] {
+            while (popQueue.numOrders() > 0) popQueue.getNextOrder();
+        });
+        MQueue plant(priorityFn2, MINHEAP, structure, POOLALLOC);
+        const size_t lineSize = 100;
+        double mergeMs = timeMs([&] {
+            for (size_t first = 0; first + lineSize <= orders.size(); first += lineSize) {
+                MQueue line(priorityFn2, MINHEAP, structure, POOLALLOC);
+                for (size_t i = first; i < first + lineSize; i++) line.insertOrder(orders[i]);
+                plant.mergeWithQueue(line);
+                for (int i = 0; i < 10; i++) plant.getNextOrder();
+            }
+        });
+        cout << "  " << structureName(structure) << "  insert-heavy " << insertMs
+             << " ms, pop-heavy " << popMs << " ms, merge-heavy " << mergeMs << " ms\n";
+    }
+}
+
+// BUCKET against SKEW and LEFTIST with the real priority functions and
+// their documented ranges: insert all then pop all, and a steady churn of
+// one pop per insert on a resident queue
+void benchBucket(const vector<Order>& orders) {
+    cout << "bucket queue on " << orders.size() << " orders\n";
+    for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+        prifn_t fn = heapType == MINHEAP ? priorityFn2 : priorityFn1;
+        for (STRUCTURE structure : {SKEW, LEFTIST, BUCKET}) {
+            MQueue queue(fn, heapType, structure);
+            if (heapType == MINHEAP) queue.setBucketRange(4, 86);
+            else queue.setBucketRange(1101, 10400);
+            double insertMs = timeMs([&] {
+                for (const Order& order : orders) queue.insertOrder(order);
+            });
+            double popMs = timeMs([&] {
+                while (queue.numOrders() > 0) queue.getNextOrder();
+            });
+            size_t resident = orders.size() / 10;
+            for (size_t i = 0; i < resident; i++) queue.insertOrder(orders[i]);
+            double churnMs = timeMs([&] {
+                for (size_t i = resident; i < orders.size(); i++) {
+                    queue.getNextOrder();
+                    queue.insertOrder(orders[i]);
+                }
+            });
+            cout << "  " << structureName(structure) << (heapType == MINHEAP ? " priorityFn2" : " priorityFn1")
+                 << "  insert " << insertMs << " ms, pop " << popMs << " ms, churn " << churnMs << " ms\n";
+        }
+    }
+}
+
+// Priority changes through handles against the old drain-and-reinsert way
+void benchHandles(const vector<Order>& orders) {
+    const size_t size = 100000, changes = 10000;
+    cout << "handles: " << changes << " changes in a queue of " << size << " orders\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST, PAIRING}) {
+        MQueue queue(priorityFn2, MINHEAP, structure, POOLALLOC);
+        vector<OrderHandle> handles(size);
+        for (size_t i = 0; i < size; i++) queue.insertOrder(orders[i], handles[i]);
+        double updateMs = timeMs([&] {
+            for (size_t i = 0; i < changes; i++) {
+                queue.updateOrder(handles[(i * 7919) % size], orders[size + i]);
+            }
+        });
+        double cancelMs = timeMs([&] {
+            for (size_t i = 0; i < changes; i++) queue.cancelOrder(handles[(i * 7919) % size]);
+        });
+        // One drain and reinsert, the cost of a single change before handles
+        vector<Order> drained;
+        double drainMs = timeMs([&] {
+            while (queue.numOrders() > 0) drained.push_back(queue.getNextOrder());
+            for (const Order& order : drained) queue.insertOrder(order);
+        });
+        cout << "  " << structureName(structure) << "  updateOrder " << updateMs
+             << " ms, cancelOrder " << cancelMs << " ms, one drain+reinsert " << drainMs << " ms\n";
+    }
+}
+
+// Previewing the next k orders: peekTopK against popping k and putting
+// them back, and batched against single pops
+void benchPeekTopK(const vector<Order>& orders) {
+    const size_t size = 1000000;
+    const int k = 100, rounds = 1000;
+    cout << "top-k: " << rounds << " previews of " << k << " orders in a queue of " << size << "\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+        MQueue queue(orders.begin(), orders.begin() + size, priorityFn2, MINHEAP, structure);
+        queue.getNextOrder();   // gives the pairing heap its multi-level shape
+        double peekMs = timeMs([&] {
+            for (int r = 0; r < rounds; r++) queue.peekTopK(k);
+        });
+        vector<Order> taken;
+        double popMs = timeMs([&] {
+            for (int r = 0; r < rounds; r++) {
+                taken.clear();
+                for (int i = 0; i < k; i++) taken.push_back(queue.getNextOrder());
+                for (const Order& order : taken) queue.insertOrder(order);
+            }
+        });
+        double singleMs = timeMs([&] {
+            for (int i = 0; i < rounds * k; i++) taken.push_back(queue.getNextOrder());
+        });
+        double batchMs = timeMs([&] {
+            queue.getNextOrders(rounds * k, back_inserter(taken));
+        });
+        cout << "  " << structureName(structure) << "  peekTopK " << peekMs << " ms, pop+reinsert "
+             << popMs << " ms; " << rounds * k << " pops: single " << singleMs << " ms, batched "
+             << batchMs << " ms\n";
+    }
+}
+
+// The report "everything with priorityFn2 <= 20" over a live queue: the
+// pruned range walk and the lazy iterator against copying and draining
+void benchPriorityRange(const vector<Order>& orders) {
+    const size_t size = 1000000;
+    cout << "range query: priorityFn2 <= 20 in a queue of " << size << " orders\n";
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+        MQueue queue(orders.begin(), orders.begin() + size, priorityFn2, MINHEAP, structure);
+        queue.getNextOrder();
+        int walked = 0, iterated = 0, drained = 0;
+        double walkMs = timeMs([&] {
+            queue.forEachInPriorityRange(0, 20, [&](const Order&) {walked++;});
+        });
+        double iterMs = timeMs([&] {
+            for (MQueue::const_iterator it = queue.begin(); it != queue.end() && priorityFn2(*it) <= 20; ++it) {
+                iterated++;
+            }
+        });
+        double drainMs = timeMs([&] {
+            MQueue copy(queue);
+            while (copy.numOrders() > 0 && priorityFn2(copy.peekNextOrder()) <= 20) {
+                copy.getNextOrder();
+                drained++;
+            }
+        });
+        cout << "  " << structureName(structure) << "  " << walked << " orders: range walk " << walkMs
+             << " ms, iterator " << iterMs << " ms, copy+drain " << drainMs << " ms"
+             << (walked == iterated && iterated == drained ? "" : "  MISMATCH") << "\n";
+    }
+}
+
+// Restoring a queue after a restart: from the snapshot file, fully and
+// top 1000 only, against rebuilding it from the orders
+void benchSnapshot() {
+    const char* path = "mqueue_bench.snap";
+    for (int size : {1000000, 10000000}) {
+        vector<Order> orders = makeOrders(size, 7);
+        cout << "snapshot of " << size << " orders\n";
+        for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+            MQueue queue(orders.begin(), orders.end(), priorityFn2, MINHEAP, structure);
+            queue.getNextOrder();
+            double saveMs = timeMs([&] {queue.saveSnapshot(path);});
+            // The partial load goes first: after the full load is freed,
+            // glibc's first allocations consolidate millions of free chunks
+            MQueue loaded(priorityFn2, MINHEAP, SKEW);
+            double topMs = timeMs([&] {loaded.loadSnapshot(path, 1000);});
+            double loadMs = timeMs([&] {loaded.loadSnapshot(path);});
+            loaded.clear();
+            queue.clear();
+            double insertMs = timeMs([&] {
+                for (const Order& order : orders) loaded.insertOrder(order);
+            });
+            loaded.clear();
+            double bulkMs = timeMs([&] {loaded.insertOrders(orders.begin(), orders.end());});
+            cout << "  " << structureName(structure) << "  save " << saveMs << " ms, load " << loadMs
+                 << " ms, load top 1000 " << topMs << " ms; rebuild by insertOrder " << insertMs
+                 << " ms, by insertOrders " << bulkMs << " ms\n";
+        }
+    }
+    remove(path);
+}
+
+// What-if planning: copies of a 1M-order leftist queue, each changed by
+// 1000 inserts and 1000 pops, as deep MQueue copies and as persistent ones
+void benchPersistent(const vector<Order>& orders) {
+    const int copies = 20, changes = 1000;
+    vector<Order> extra = makeOrders(changes, 3);
+    MQueue queue(orders.begin(), orders.end(), priorityFn2, MINHEAP, LEFTIST);
+    PersistentMQueue persistent(orders.begin(), orders.end(), priorityFn2, MINHEAP);
+    cout << "what-if copies of " << orders.size() << " orders, " << changes << " inserts and pops each\n";
+    double deepCopyMs = 0, persistentCopyMs = 0;
+    double deepMs = timeMs([&] {
+        for (int i = 0; i < copies; i++) {
+            MQueue* copy = nullptr;
+            deepCopyMs += timeMs([&] {copy = new MQueue(queue);});
+            for (const Order& order : extra) copy->insertOrder(order);
+            for (int j = 0; j < changes; j++) copy->getNextOrder();
+            delete copy;
+        }
+    });
+    double persistentMs = timeMs([&] {
+        for (int i = 0; i < copies; i++) {
+            PersistentMQueue* copy = nullptr;
+            persistentCopyMs += timeMs([&] {copy = new PersistentMQueue(persistent);});
+            for (const Order& order : extra) copy->insertOrder(order);
+            for (int j = 0; j < changes; j++) copy->getNextOrder();
+            delete copy;
+        }
+    });
+    cout << "  deep copy   " << deepCopyMs / copies << " ms per copy, " << deepMs / copies << " ms per scenario\n";
+    cout << "  persistent  " << persistentCopyMs / copies << " ms per copy, " << persistentMs / copies
+         << " ms per scenario\n";
+    // Unshared, a persistent queue changes nodes in place like MQueue
+    queue.clear();
+    persistent.clear();
+    double insertMs = timeMs([&] {for (const Order& order : orders) persistent.insertOrder(order);});
+    double popMs = timeMs([&] {while (persistent.numOrders() > 0) persistent.getNextOrder();});
+    cout << "  persistent    insert " << insertMs << " ms, pop " << popMs << " ms\n";
+    insertMs = timeMs([&] {for (const Order& order : orders) queue.insertOrder(order);});
+    popMs = timeMs([&] {while (queue.numOrders() > 0) queue.getNextOrder();});
+    cout << "  leftist MQueue insert " << insertMs << " ms, pop " << popMs << " ms\n";
+}
+
+// Insert and pop throughput with the journal off, synced on every change,
+// and group-committed every 1 and 10 ms
+void benchJournal(const vector<Order>& orders) {
+    const char* path = "mqueue_bench.journal";
+    OrderJournal::registerPriorityFn("priorityFn2", priorityFn2);
+    cout << "journaled inserts and pops, ops/sec\n";
+    for (int delayMs : {-1, 0, 1, 10}) {
+        // Syncing every change is thousands of times slower, so it gets
+        // fewer orders
+        size_t n = delayMs == 0 ? 2000 : orders.size();
+        remove(path);
+        MQueue queue(priorityFn2, MINHEAP, SKEW);
+        unique_ptr<OrderJournal> journal;
+        if (delayMs >= 0) {
+            journal.reset(new OrderJournal(path, delayMs));
+            queue.setJournal(journal.get());
+        }
+        double ms = timeMs([&] {
+            for (size_t i = 0; i < n; i++) queue.insertOrder(orders[i]);
+            for (size_t i = 0; i < n; i++) queue.getNextOrder();
+            if (journal) journal->sync();
+        });
+        cout << "  " << (delayMs < 0 ? string("no journal") : "max delay " + to_string(delayMs) + " ms")
+             << ": " << 2 * n / ms * 1000 << " ops/sec";
+        if (journal) cout << ", " << journal->numSyncs() << " syncs";
+        cout << "\n";
+        queue.setJournal(nullptr);
+    }
+    remove(path);
+}
+
+// One MQueue behind one mutex, the baseline the MultiMQueue replaces
+struct LockedMQueue {
+    LockedMQueue() : queue(priorityFn1, MAXHEAP, SKEW) {}
+    bool insertOrder(const Order& order) {
+        lock_guard<mutex> guard(lock);
+        return queue.insertOrder(order);
+    }
+    bool tryGetNextOrder(Order& order) {
+        lock_guard<mutex> guard(lock);
+        if (queue.numOrders() == 0) return false;
+        order = queue.getNextOrder();
+        return true;
+    }
+    mutex lock;
+    MQueue queue;
+};
+
+// Every thread alternates insert and pop on a prefilled queue; returns
+// million operations per second
+template <class Queue>
+double timeThreads(Queue& queue, const vector<Order>& orders, int threads, size_t prefill, size_t ops) {
+    for (size_t i = 0; i < prefill; i++) queue.insertOrder(orders[i]);
+    size_t perThread = ops / threads;
+    double ms = timeMs([&] {
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                Order order;
+                for (size_t i = 0; i < perThread; i += 2) {
+                    queue.insertOrder(orders[prefill + (t * perThread + i) % (orders.size() - prefill)]);
+                    queue.tryGetNextOrder(order);
+                }
+            });
+        }
+        for (thread& worker : workers) worker.join();
+    });
+    return perThread * threads / ms / 1000.0;
+}
+
+// Rank error of the pops: for each pop in global order, the number of
+// queued orders that had a strictly better priority at that moment.
+// Counted by replaying the pops over a Fenwick tree of priorities.
+pair<double, int> rankError(const vector<Order>& orders, const vector<pair<int, int> >& pops) {
+    const int maxKey = MAX100 + MAX100 + MAX200 + MAX10000;
+    vector<int> tree(maxKey + 2, 0);
+    auto add = [&](int key, int delta) {
+        for (int i = key + 1; i <= maxKey + 1; i += i & -i) tree[i] += delta;
+    };
+    auto countUpTo = [&](int key) {
+        int sum = 0;
+        for (int i = key + 1; i > 0; i -= i & -i) sum += tree[i];
+        return sum;
+    };
+    int queued = 0;
+    for (size_t i = 0; i < pops.size(); i++) {
+        add(priorityFn1(orders[i]), 1);
+        queued++;
+    }
+    double total = 0;
+    int worst = 0;
+    for (const pair<int, int>& pop : pops) {
+        int rank = queued - countUpTo(pop.second);   // MAXHEAP: larger keys are better
+        total += rank;
+        worst = max(worst, rank);
+        add(pop.second, -1);
+        queued--;
+    }
+    return make_pair(total / pops.size(), worst);
+}
+
+// Throughput from 1 to 64 threads against a single locked MQueue, then
+// how far the relaxed pops stray from the exact priority order
+void benchMultiQueue(const vector<Order>& orders) {
+    const size_t prefill = 100000, ops = 1000000;
+    cout << "multiqueue: " << ops << " insert/pop ops on " << prefill << " prefilled orders, Mops/s\n";
+    for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+        LockedMQueue locked;
+        MultiMQueue multi(priorityFn1, MAXHEAP, SKEW, threads);
+        double lockedOps = timeThreads(locked, orders, threads, prefill, ops);
+        double multiOps = timeThreads(multi, orders, threads, prefill, ops);
+        cout << "  " << threads << " threads  locked MQueue " << lockedOps
+             << ", MultiMQueue (" << multi.numShards() << " shards) " << multiOps << "\n";
+    }
+    cout << "multiqueue: rank error while draining " << prefill << " orders\n";
+    for (int threads : {1, 4, 16, 64}) {
+        MultiMQueue multi(priorityFn1, MAXHEAP, SKEW, threads);
+        for (size_t i = 0; i < prefill; i++) multi.insertOrder(orders[i]);
+        // Each pop takes a ticket right after it returns; tickets order the replay
+        vector<pair<int, int> > pops(prefill);
+        atomic<size_t> ticket(0);
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&] {
+                Order order;
+                while (multi.tryGetNextOrder(order)) {
+                    size_t seq = ticket++;
+                    pops[seq] = make_pair((int)seq, priorityFn1(order));
+                }
+            });
+        }
+        for (thread& worker : workers) worker.join();
+        pair<double, int> error = rankError(orders, pops);
+        cout << "  " << threads << " threads (" << multi.numShards() << " shards)  mean rank "
+             << error.first << ", max rank " << error.second << "\n";
+    }
+}
+
+// Runs fn(t) on threads threads and returns the wall time in ms
+template <class Fn>
+double timeWorkers(int threads, Fn fn) {
+    return timeMs([&] {
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) workers.emplace_back(fn, t);
+        for (thread& worker : workers) worker.join();
+    });
+}
+
+// Per-worker queues with stealing against one global locked queue: first
+// a backlog that arrived at one worker and must be spread by steals, then
+// a balanced load where every worker feeds and drains its own queue
+void benchWorkStealing(const vector<Order>& orders) {
+    const size_t backlog = 200000, ops = 1000000;
+    cout << "work stealing: drain " << backlog << " orders queued at worker 0, then "
+         << ops << " balanced insert/pop ops\n";
+    for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+        LockedMQueue locked;
+        WorkStealingMQueue stealing(priorityFn1, MAXHEAP, SKEW, threads);
+        for (size_t i = 0; i < backlog; i++) {
+            locked.insertOrder(orders[i]);
+            stealing.insertOrder(0, orders[i]);
+        }
+        double lockedDrainMs = timeWorkers(threads, [&](int) {
+            Order order;
+            while (locked.tryGetNextOrder(order)) {}
+        });
+        double stealingDrainMs = timeWorkers(threads, [&](int t) {
+            Order order;
+            while (stealing.tryGetNextOrder(t, order)) {}
+        });
+        int drainSteals = stealing.numSteals();
+        size_t perThread = ops / threads;
+        double lockedMixMs = timeWorkers(threads, [&](int t) {
+            Order order;
+            for (size_t i = 0; i < perThread; i += 2) {
+                locked.insertOrder(orders[(t * perThread + i) % orders.size()]);
+                locked.tryGetNextOrder(order);
+            }
+        });
+        double stealingMixMs = timeWorkers(threads, [&](int t) {
+            Order order;
+            for (size_t i = 0; i < perThread; i += 2) {
+                stealing.insertOrder(t, orders[(t * perThread + i) % orders.size()]);
+                stealing.tryGetNextOrder(t, order);
+            }
+        });
+        cout << "  " << threads << " threads  drain: locked " << lockedDrainMs << " ms, stealing "
+             << stealingDrainMs << " ms (" << drainSteals << " steals)  balanced: locked "
+             << lockedMixMs << " ms, stealing " << stealingMixMs << " ms\n";
+    }
+}
+
+// Intake at a fixed capacity: once the queue is full, every new order
+// either replaces the worst one or is turned away. The MQueue does this by
+// draining itself to find the worst order, as the intake layer did; the
+// BoundedMQueue evicts from its interval heap.
+void benchBounded(const vector<Order>& orders) {
+    cout << "bounded intake of " << orders.size() << " orders\n";
+    for (int capacity : {50, 1000}) {
+        size_t drained = std::min(orders.size(), (size_t)(capacity == 50 ? 100000 : 10000));
+        MQueue queue(priorityFn1, MAXHEAP, SKEW);
+        double drainMs = timeMs([&] {
+            vector<Order> held;
+            for (size_t i = 0; i < drained; i++) {
+                if (queue.numOrders() < capacity) {
+                    queue.insertOrder(orders[i]);
+                    continue;
+                }
+                held.clear();
+                queue.getNextOrders(capacity, back_inserter(held));
+                // held[capacity - 1] is the worst order
+                if (priorityFn1(orders[i]) > priorityFn1(held.back())) held.back() = orders[i];
+                queue.insertOrders(held.begin(), held.end());
+            }
+        });
+        BoundedMQueue bounded(priorityFn1, MAXHEAP, capacity);
+        double boundedMs = timeMs([&] {
+            for (const Order& order : orders) bounded.insertOrder(order);
+        });
+        cout << "  capacity " << capacity << "  MQueue drain " << drainMs * 1e6 / drained
+             << " ns/order, BoundedMQueue " << boundedMs * 1e6 / orders.size() << " ns/order\n";
+    }
+}
+
+// clear() of a full queue in place against through a Reclaimer, which
+// then refills the queue while the old nodes are still being freed. The
+// peak is the memory those pending nodes held on top of the new ones.
+void benchReclaim(const vector<Order>& orders) {
+    cout << "clear of " << orders.size() << " orders\n";
+    for (ALLOCATION allocation : {GLOBALALLOC, POOLALLOC}) {
+        MQueue queue(orders.begin(), orders.end(), priorityFn1, MAXHEAP, SKEW, allocation);
+        double inPlaceMs = timeMs([&] {queue.clear();});
+        queue.insertOrders(orders.begin(), orders.end());
+        Reclaimer reclaimer;
+        queue.setReclaimer(&reclaimer);
+        double clearMs = timeMs([&] {queue.clear();});
+        double refillMs = timeMs([&] {queue.insertOrders(orders.begin(), orders.end());});
+        double flushMs = timeMs([&] {reclaimer.flush();});
+        cout << "  " << (allocation == POOLALLOC ? "POOLALLOC  " : "GLOBALALLOC")
+             << "  in place " << inPlaceMs << " ms, reclaimer " << clearMs * 1000
+             << " us (refill " << refillMs << " ms, flush " << flushMs << " ms), peak pending "
+             << reclaimer.peakPendingOrders() * sizeof(Node) / (1 << 20) << " MB\n";
+    }
+}
+
+#ifdef BLOCKINGMQUEUE_COROUTINES
+// Starts at once and runs on whichever thread resumes it
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() {return DetachedTask();}
+        suspend_never initial_suspend() {return {};}
+        suspend_never final_suspend() noexcept {return {};}
+        void return_void() {}
+        void unhandled_exception() {terminate();}
+    };
+};
+
+DetachedTask awaitOrders(BlockingMQueue& queue, size_t count, vector<chrono::steady_clock::time_point>& received) {
+    for (size_t i = 0; i < count; i++) {
+        co_await queue.next();
+        received[i] = chrono::steady_clock::now();
+    }
+}
+#endif
+
+// One consumer waiting for orders that trickle in every 100 us: polling
+// numOrders() under a lock, as workers do without BlockingMQueue, against
+// waitNextOrder and a suspended coroutine. Reports the wake-up latency from
+// insert to receipt, and the CPU time the whole process used.
+void benchBlocking(const vector<Order>& orders) {
+    const size_t count = 2000;
+    cout << "blocking consumer: " << count << " orders, one every 100 us\n";
+    vector<chrono::steady_clock::time_point> sent(count), received(count);
+    auto produce = [&](auto insert) {
+        for (size_t i = 0; i < count; i++) {
+            this_thread::sleep_for(chrono::microseconds(100));
+            sent[i] = chrono::steady_clock::now();
+            insert(orders[i]);
+        }
+    };
+    auto report = [&](const char* name, double wallMs, double cpuMs) {
+        vector<double> latencies;
+        for (size_t i = 0; i < count; i++) {
+            latencies.push_back(chrono::duration<double, micro>(received[i] - sent[i]).count());
+        }
+        sort(latencies.begin(), latencies.end());
+        cout << "  " << name << "  latency median " << latencies[count / 2] << " us, p99 "
+             << latencies[count * 99 / 100] << " us, cpu " << cpuMs << " ms of " << wallMs << " ms\n";
+    };
+    auto cpuMs = [] {return 1000.0 * clock() / CLOCKS_PER_SEC;};
+
+    {
+        mutex lock;
+        MQueue queue(priorityFn1, MAXHEAP, SKEW);
+        double cpu = cpuMs();
+        double wall = timeMs([&] {
+            thread consumer([&] {
+                for (size_t i = 0; i < count;) {
+                    lock_guard<mutex> guard(lock);
+                    if (queue.numOrders() == 0) continue;
+                    queue.getNextOrder();
+                    received[i++] = chrono::steady_clock::now();
+                }
+            });
+            produce([&](const Order& order) {
+                lock_guard<mutex> guard(lock);
+                queue.insertOrder(order);
+            });
+            consumer.join();
+        });
+        report("polling       ", wall, cpuMs() - cpu);
+    }
+    {
+        BlockingMQueue queue(priorityFn1, MAXHEAP, SKEW);
+        double cpu = cpuMs();
+        double wall = timeMs([&] {
+            thread consumer([&] {
+                for (size_t i = 0; i < count; i++) {
+                    queue.waitNextOrder();
+                    received[i] = chrono::steady_clock::now();
+                }
+            });
+            produce([&](const Order& order) {queue.insertOrder(order);});
+            consumer.join();
+        });
+        report("waitNextOrder ", wall, cpuMs() - cpu);
+    }
+#ifdef BLOCKINGMQUEUE_COROUTINES
+    {
+        BlockingMQueue queue(priorityFn1, MAXHEAP, SKEW);
+        double cpu = cpuMs();
+        double wall = timeMs([&] {
+            awaitOrders(queue, count, received);
+            thread producer([&] {
+                produce([&](const Order& order) {queue.insertOrder(order);});
+            });
+            producer.join();
+        });
+        report("co_await next ", wall, cpuMs() - cpu);
+    }
+#endif
+}
+
+// Orders for the regression suite, drawn field by field with the driver's
+// Random class. NORMAL centres every field on its range, with a quarter of
+// the range as standard deviation. Each field gets its own seed, so runs
+// repeat exactly and the fields are not correlated.
+unique_ptr<Random> makeField(int min, int max, RANDOM distribution, int seed) {
+    unique_ptr<Random> field(distribution == NORMAL
+        ? new Random(min, max, NORMAL, (min + max) / 2, std::max(1, (max - min) / 4))
+        : new Random(min, max));
+    field->setSeed(seed);
+    return field;
+}
+
+vector<Order> makeRandomOrders(int n, RANDOM distribution) {
+    const int customers = 2000;
+    Random letters(97, 122);
+    vector<string> names;
+    for (int i = 0; i < customers; i++) names.push_back(letters.getRandString(5));
+    unique_ptr<Random> customer = makeField(0, customers - 1, UNIFORMINT, 1);
+    unique_ptr<Random> fifo = makeField(MINONE, MAX50, distribution, 2);
+    unique_ptr<Random> process = makeField(MINONE, MAX12, distribution, 3);
+    unique_ptr<Random> due = makeField(MINONE, MAX12, distribution, 4);
+    unique_ptr<Random> slack = makeField(MINONE, MAX12, distribution, 5);
+    unique_ptr<Random> material = makeField(MINZERO, MAX100, distribution, 6);
+    unique_ptr<Random> importance = makeField(MINONE, MAX100, distribution, 7);
+    unique_ptr<Random> workers = makeField(MAX100, MAX200, distribution, 8);
+    unique_ptr<Random> quantity = makeField(MIN1000, MAX10000, distribution, 9);
+    vector<Order> orders;
+    orders.reserve(n);
+    for (int i = 0; i < n; i++) {
+        orders.push_back(Order(names[customer->getRandNum()], fifo->getRandNum(), process->getRandNum(),
+                               due->getRandNum(), slack->getRandNum(), material->getRandNum(),
+                               importance->getRandNum(), workers->getRandNum(), quantity->getRandNum()));
+    }
+    return orders;
+}
+
+struct SuiteResult {
+    STRUCTURE structure;
+    HEAPTYPE heapType;
+    RANDOM distribution;
+    int size;
+    const char* op;
+    double ms;              // per repetition
+};
+
+// Times op on size orders, repeating small sizes so every measurement
+// covers about 100000 orders. setup runs before each repetition and is not
+// timed.
+template <class Setup, class Op>
+double timeRepeated(int size, Setup setup, Op op) {
+    int reps = std::max(1, 100000 / size);
+    double total = 0;
+    for (int rep = 0; rep < reps; rep++) {
+        auto state = setup();
+        total += timeMs([&] {op(*state);});
+    }
+    return total / reps;
+}
+
+// insert, pop, merge, copy, setPriorityFn and setStructure on SKEW and
+// LEFTIST queues, for both heap types and both distributions, at sizes
+// from 1e3 up to maxSize in powers of ten
+vector<SuiteResult> runSuite(int maxSize) {
+    vector<SuiteResult> results;
+    for (RANDOM distribution : {UNIFORMINT, NORMAL}) {
+        vector<Order> orders = makeRandomOrders(maxSize, distribution);
+        for (STRUCTURE structure : {SKEW, LEFTIST}) {
+            for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+                prifn_t fn = heapType == MINHEAP ? priorityFn2 : priorityFn1;
+                prifn_t otherFn = heapType == MINHEAP ? priorityFn1 : priorityFn2;
+                HEAPTYPE otherType = heapType == MINHEAP ? MAXHEAP : MINHEAP;
+                STRUCTURE otherStructure = structure == SKEW ? LEFTIST : SKEW;
+                for (int size = 1000; size <= maxSize; size *= 10) {
+                    auto first = orders.begin(), last = orders.begin() + size;
+                    auto empty = [&] {return unique_ptr<MQueue>(new MQueue(fn, heapType, structure));};
+                    auto full = [&] {
+                        unique_ptr<MQueue> queue = empty();
+                        for (auto it = first; it != last; ++it) queue->insertOrder(*it);
+                        return queue;
+                    };
+                    auto halves = [&] {
+                        auto mid = first + size / 2;
+                        unique_ptr<pair<MQueue, MQueue> > queues(new pair<MQueue, MQueue>(
+                            MQueue(fn, heapType, structure), MQueue(fn, heapType, structure)));
+                        for (auto it = first; it != mid; ++it) queues->first.insertOrder(*it);
+                        for (auto it = mid; it != last; ++it) queues->second.insertOrder(*it);
+                        return queues;
+                    };
+                    auto record = [&](const char* op, double ms) {
+                        results.push_back({structure, heapType, distribution, size, op, ms});
+                    };
+                    record("insert", timeRepeated(size, empty, [&](MQueue& queue) {
+                        for (auto it = first; it != last; ++it) queue.insertOrder(*it);
+                    }));
+                    record("pop", timeRepeated(size, full, [](MQueue& queue) {
+                        while (queue.numOrders() > 0) queue.getNextOrder();
+                    }));
+                    record("merge", timeRepeated(size, halves, [](pair<MQueue, MQueue>& queues) {
+                        queues.first.mergeWithQueue(queues.second);
+                    }));
+                    record("copy", timeRepeated(size, full, [](MQueue& queue) {
+                        MQueue copy(queue);
+                    }));
+                    record("setPriorityFn", timeRepeated(size, full, [&](MQueue& queue) {
+                        queue.setPriorityFn(otherFn, otherType);
+                    }));
+                    record("setStructure", timeRepeated(size, full, [&](MQueue& queue) {
+                        queue.setStructure(otherStructure);
+                    }));
+                }
+            }
+        }
+    }
+    return results;
+}
+
+// One record per measurement; nsPerOp divides by the number of orders, so
+// it stays comparable across sizes for every op
+bool writeJson(const char* path, const vector<SuiteResult>& results) {
+    FILE* out = fopen(path, "w");
+    if (!out) return false;
+    fprintf(out, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const SuiteResult& result = results[i];
+        fprintf(out, "    {\"structure\": \"%s\", \"heapType\": \"%s\", \"distribution\": \"%s\", "
+                     "\"size\": %d, \"op\": \"%s\", \"ms\": %.4f, \"nsPerOp\": %.2f}%s\n",
+                structureName(result.structure), result.heapType == MINHEAP ? "MINHEAP" : "MAXHEAP",
+                result.distribution == NORMAL ? "NORMAL" : "UNIFORMINT", result.size, result.op,
+                result.ms, result.ms * 1e6 / result.size, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+}
+
+// Without arguments, prints the individual benchmarks. With --json FILE,
+// runs only the regression suite and writes its results to FILE;
+// --max-size N caps the largest size (default 1e7).
+int main(int argc, char* argv[]) {
+    const char* jsonPath = nullptr;
+    int maxSize = 10000000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            maxSize = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--json FILE [--max-size N]]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (jsonPath) {
+        if (!writeJson(jsonPath, runSuite(maxSize))) {
+            fprintf(stderr, "cannot write %s\n", jsonPath);
+            return 1;
+        }
+        return 0;
+    }
+
+    vector<Order> orders = makeOrders(1000000);
+    benchFootprint(orders);
+    benchInsertPop(orders);
+    benchNodePool(orders);
+    benchBulkLoad(orders);
+    benchRebuild(orders);
+    benchParallelRebuild(orders);
+    benchBasicMQueue(orders);
+    benchMove(orders);
+    benchDary(orders);
+    benchPairing(orders);
+    benchBucket(orders);
+    benchHandles(orders);
+    benchPeekTopK(orders);
+    benchPriorityRange(orders);
+    benchSnapshot();
+    benchJournal(orders);
+    benchPersistent(orders);
+    benchMultiQueue(orders);
+    benchWorkStealing(orders);
+    benchBlocking(orders);
+    benchBounded(orders);
+    benchReclaim(orders);
+    return 0;
+}
+
+/* Priority functions, identical to the ones in driver.cpp */
+int priorityFn1(const Order & order) {
+    //this function works with a MAXHEAP
+    //priority value falls in the range [1101-10400]
+    int minValue = MIN1000 + MAX100 + MINONE + MINZERO;
+    int maxValue = MAX100 + MAX100 + MAX200 + MAX10000;
+    int priority = order.getMaterial() + order.getImportance() +
+                    order.getWorkForce() + order.getQuantity();
+    if (priority >= minValue && priority <= maxValue)
+        return priority;
+    else
+        return 0; // this is an invalid order object
+}
+
+int priorityFn2(const Order & order) {
+    //this function works with a MINHEAP
+    //priority value falls in the range [4-86]
+    int minValue = MINONE + MINONE + MINONE + MINONE;
+    int maxValue = MAX12 + MAX12 + MAX12 + MAX50;
+    int priority = order.getFIFO() + order.getProcessTime() +
+                order.getDueTime() + order.getSlackTime();
+    if (priority >= minValue && priority <= maxValue)
+        return priority;
+    else
+        return 0; // this is an invalid order object
+}
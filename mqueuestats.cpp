@@ -0,0 +1,57 @@
+#include "mqueuestats.h"
+#include <sstream>
+
+namespace {
+// Largest value of a bucket's bit width
+uint64_t upperBound(int bucket) {
+    return bucket == 0 ? 0 : bucket == 64 ? UINT64_MAX : (1ULL << bucket) - 1;
+}
+}
+
+uint64_t Histogram::percentile(double p) const {
+    if (m_count == 0) return 0;
+    uint64_t rank = (uint64_t)(p * m_count);
+    if (rank >= m_count) rank = m_count - 1;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += m_buckets[bucket];
+        if (seen > rank) {
+            // The upper end of the bucket, but never above the largest value
+            return upperBound(bucket) < m_max ? upperBound(bucket) : m_max;
+        }
+    }
+    return m_max;
+}
+
+std::string Histogram::toJson() const {
+    std::ostringstream out;
+    out << "{\"count\": " << m_count << ", \"sum\": " << m_sum << ", \"mean\": " << mean()
+        << ", \"max\": " << m_max << ", \"p50\": " << percentile(0.5)
+        << ", \"p90\": " << percentile(0.9) << ", \"p99\": " << percentile(0.99) << ", \"buckets\": [";
+    const char* separator = "";
+    for (int bucket = 0; bucket < BUCKETS; bucket++) {
+        if (m_buckets[bucket] == 0) continue;
+        out << separator << "{\"le\": " << upperBound(bucket) << ", \"count\": " << m_buckets[bucket] << "}";
+        separator = ", ";
+    }
+    out << "]}";
+    return out.str();
+}
+
+std::string MQueueStats::toJson() const {
+    std::ostringstream out;
+    out << "{\"enabled\": " << (enabled ? "true" : "false")
+        << ", \"priorityCalls\": " << priorityCalls
+        << ", \"nodeAllocs\": " << nodeAllocs << ", \"nodeFrees\": " << nodeFrees
+        << ", \"mergeDepth\": " << mergeDepth.toJson()
+        << ", \"rebuildNs\": " << rebuildNs.toJson()
+        << ", \"insertNs\": " << insertNs.toJson()
+        << ", \"popNs\": " << popNs.toJson()
+        << ", \"mergeNs\": " << mergeNs.toJson()
+        << ", \"rightSpine\": " << rightSpine << ", \"nplCounts\": [";
+    for (size_t npl = 0; npl < nplCounts.size(); npl++) {
+        out << (npl ? ", " : "") << nplCounts[npl];
+    }
+    out << "]}";
+    return out.str();
+}
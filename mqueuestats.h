@@ -0,0 +1,95 @@
+#ifndef MQUEUESTATS_H
+#define MQUEUESTATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Counting and timing are compiled in only with MQUEUE_STATS defined (the
+// MQUEUE_STATS CMake option). Without it MQUEUE_STAT(...) expands to
+// nothing and the queue carries no counters.
+#ifdef MQUEUE_STATS
+#define MQUEUE_STAT(statement) statement
+#else
+#define MQUEUE_STAT(statement)
+#endif
+
+//
+// histogram class
+//
+// Counts values in power-of-two buckets: bucket b holds the values of bit
+// width b, so 0, 1, 2-3, 4-7 and so on. Recording is a few instructions,
+// and percentiles are resolved to the upper end of their bucket.
+//
+class Histogram {
+  public:
+    static const int BUCKETS = 65;
+    Histogram() : m_buckets(), m_count(0), m_sum(0), m_max(0) {}
+    void record(uint64_t value) {
+        ++m_buckets[value ? 64 - __builtin_clzll(value) : 0];
+        ++m_count;
+        m_sum += value;
+        if (value > m_max) m_max = value;
+    }
+    uint64_t count() const {return m_count;}
+    uint64_t sum() const {return m_sum;}
+    uint64_t max() const {return m_max;}
+    double mean() const {return m_count ? (double)m_sum / m_count : 0;}
+    // Returns an upper bound of the value below which a fraction p of the
+    // recorded values fall, or 0 if nothing was recorded
+    uint64_t percentile(double p) const;
+    // {"count", "sum", "mean", "max", "p50", "p90", "p99", "buckets"}, where
+    // buckets lists the non-empty buckets as {"le": upper bound, "count"}
+    std::string toJson() const;
+  private:
+    uint64_t m_buckets[BUCKETS];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+};
+
+// Records the wall time of its scope in nanoseconds
+class ScopedTimer {
+  public:
+    explicit ScopedTimer(Histogram& histogram)
+        : m_histogram(histogram), m_start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - m_start;
+        m_histogram.record((uint64_t)elapsed.count());
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+  private:
+    Histogram& m_histogram;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+//
+// queue statistics
+//
+// What MQueue::getStats() returns. The counters cover the life of the
+// queue object, or the time since resetStats(); a copy or move of a queue
+// starts from zero. The shape fields describe the tree at the time of the
+// call and are filled in every build.
+//
+struct MQueueStats {
+    MQueueStats() : enabled(false), priorityCalls(0), nodeAllocs(0), nodeFrees(0), rightSpine(0) {}
+    bool enabled;               // false without MQUEUE_STATS; only the shape is filled then
+    uint64_t priorityCalls;     // calls of the priority function
+    uint64_t nodeAllocs;
+    uint64_t nodeFrees;
+    // Steps down the merged paths per merge or root removal; for SKEW and
+    // LEFTIST that is the combined length of the right spines walked
+    Histogram mergeDepth;
+    Histogram rebuildNs;        // one entry per rebuild by setPriorityFn, setStructure or setBucketRange
+    Histogram insertNs;         // latency of insertOrder and emplaceOrder
+    Histogram popNs;            // latency of getNextOrder
+    Histogram mergeNs;          // latency of mergeWithQueue
+    // Shape of the SKEW or LEFTIST tree, or the BUCKET overflow heap
+    int rightSpine;                     // nodes on the right spine of the root
+    std::vector<uint64_t> nplCounts;    // nplCounts[k] is the number of nodes with NPL k
+    std::string toJson() const;
+};
+
+#endif
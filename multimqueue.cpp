@@ -0,0 +1,91 @@
+#include "multimqueue.h"
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+MultiMQueue::MultiMQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure, int numThreads,
+                         int shardsPerThread, ALLOCATION allocation)
+    : m_size(0), m_heapType(heapType) {
+    if (numThreads < 1 || shardsPerThread < 1)
+        throw std::out_of_range("MultiMQueue needs at least one shard.");
+    for (int i = 0; i < numThreads * shardsPerThread; i++) {
+        m_shards.emplace_back(new Shard(priFn, heapType, structure, allocation));
+    }
+}
+
+// Inserts into a random shard
+bool MultiMQueue::insertOrder(const Order& order) {
+    Shard& shard = *m_shards[randomShard()];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if (!shard.queue.insertOrder(order)) return false;
+    shard.top.store(shard.queue.getTopPriority(), std::memory_order_relaxed);
+    m_size.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Pops from the better of two random shards, skipping a shard whose lock
+// is taken rather than waiting on it
+bool MultiMQueue::tryGetNextOrder(Order& order) {
+    for (int attempt = 0; attempt < SAMPLETRIES; attempt++) {
+        Shard* first = m_shards[randomShard()].get();
+        Shard* second = m_shards[randomShard()].get();
+        int top1 = first->top.load(std::memory_order_relaxed);
+        int top2 = second->top.load(std::memory_order_relaxed);
+        if (top1 == EMPTYSHARD && top2 == EMPTYSHARD) continue;
+        Shard& shard = (top2 == EMPTYSHARD || (top1 != EMPTYSHARD && !better(top2, top1)))
+                       ? *first : *second;
+        std::unique_lock<std::mutex> guard(shard.lock, std::try_to_lock);
+        if (guard.owns_lock() && popFrom(shard, order)) return true;
+    }
+    // Sampling kept missing: visit every shard, so false means empty
+    for (auto& shard : m_shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        if (popFrom(*shard, order)) return true;
+    }
+    return false;
+}
+
+Order MultiMQueue::getNextOrder() {
+    Order order;
+    if (!tryGetNextOrder(order)) throw std::out_of_range("Queue is empty");
+    return order;
+}
+
+int MultiMQueue::numOrders() const {
+    return m_size.load(std::memory_order_relaxed);
+}
+
+int MultiMQueue::numShards() const {
+    return (int)m_shards.size();
+}
+
+HEAPTYPE MultiMQueue::getHeapType() const {
+    return m_heapType;
+}
+
+// True if key1 comes out of the queue before key2
+bool MultiMQueue::better(int key1, int key2) const {
+    return m_heapType == MINHEAP ? key1 < key2 : key1 > key2;
+}
+
+// Pops the root of a locked shard and refreshes its cached top
+bool MultiMQueue::popFrom(Shard& shard, Order& order) {
+    if (shard.queue.numOrders() == 0) return false;
+    order = shard.queue.getNextOrder();
+    shard.top.store(shard.queue.numOrders() > 0 ? shard.queue.getTopPriority() : EMPTYSHARD,
+                    std::memory_order_relaxed);
+    m_size.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+// A per-thread xorshift generator; std::mt19937 would cost more than the
+// lock it is used to spread out
+size_t MultiMQueue::randomShard() const {
+    static thread_local uint64_t state =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (size_t)(state % m_shards.size());
+}
@@ -0,0 +1,64 @@
+#ifndef MULTIMQUEUE_H
+#define MULTIMQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "mqueue.h"
+
+//
+// multi queue class
+//
+// A relaxed concurrent priority queue for many producers and consumers.
+// Orders are spread over numThreads * shardsPerThread MQueue shards, each
+// behind its own lock. insertOrder locks one random shard. getNextOrder
+// samples two random shards, compares their cached top priorities without
+// locking either, and pops from the better one if its lock is free. The
+// popped order is not always the best in the whole queue, but it is close
+// to it, and threads rarely wait on each other. With one shard the queue
+// is exact.
+//
+class MultiMQueue {
+  public:
+    friend class Tester; // for testing purposes
+    MultiMQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure, int numThreads,
+                int shardsPerThread = 2, ALLOCATION allocation = GLOBALALLOC);
+    MultiMQueue(const MultiMQueue&) = delete;
+    MultiMQueue& operator=(const MultiMQueue&) = delete;
+    // Both pops and inserts are safe to call from any thread
+    bool insertOrder(const Order& order);
+    // Pops a high-priority order into order; returns false only if every
+    // shard was empty when it was visited
+    bool tryGetNextOrder(Order& order);
+    // Same as tryGetNextOrder but throws out_of_range when empty
+    Order getNextOrder();
+    // Exact once no other thread is inserting or popping
+    int numOrders() const;
+    int numShards() const;
+    HEAPTYPE getHeapType() const;
+
+  private:
+    static const int EMPTYSHARD = -1;   // cached top of an empty shard; priorities are >= 0
+    static const int SAMPLETRIES = 8;   // random two-shard attempts before a full sweep
+
+    // One MQueue with its lock, on its own cache line so that locking a
+    // shard does not slow down its neighbours
+    struct alignas(64) Shard {
+        Shard(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure, ALLOCATION allocation)
+            : queue(priFn, heapType, structure, allocation), top(EMPTYSHARD) {}
+        std::mutex lock;
+        MQueue queue;
+        std::atomic<int> top;   // queue's top priority or EMPTYSHARD, written under lock
+    };
+
+    std::vector<std::unique_ptr<Shard> > m_shards;
+    std::atomic<int> m_size;    // orders in all shards
+    HEAPTYPE m_heapType;
+
+    bool better(int key1, int key2) const;
+    bool popFrom(Shard& shard, Order& order);
+    size_t randomShard() const;
+};
+
+#endif
@@ -1,331 +1,2142 @@
-#include "mqueue.h"
-#include <iostream>
-#include <stdexcept>
-#include <climits>
-#include <cstdlib>
-#include <ctime>
-
-using namespace std;
-
-// Sample priority functions for testing
-int priorityFn1(const Order& order) {
-    return order.getImportance() + order.getQuantity();
-}
-
-int priorityFn2(const Order& order) {
-    return order.getFIFO() + order.getProcessTime();
-}
-
-class Tester {
-public:
-    bool testBasicInsertionMinHeap();
-    bool testBasicInsertionMaxHeap();
-    bool testBasicRemovalMinHeap();
-    bool testBasicRemovalMaxHeap();
-    bool testLargeScaleInsertionMinHeap();
-    bool testLargeScaleInsertionMaxHeap();
-    bool testLargeScaleRemovalMinHeap();
-    bool testLargeScaleRemovalMaxHeap();
-    bool testLeftistNPLValues();
-    bool testLeftistProperty();
-    bool testCopyConstructor();
-    bool testCopyConstructorEmpty();
-    bool testAssignmentOperator();
-    bool testAssignmentOperatorEmpty();
-    bool testExceptionOnEmptyDequeue();
-    bool testMergeEmptyQueue();
-    bool testMergeDifferentPriorityFunctions();
-    bool testPriorityFunctionChange();
-
-    void runTests() {
-        cout << "testBasicInsertionMinHeap: " << (testBasicInsertionMinHeap() ? "Pass" : "Fail") << endl;
-        cout << "testBasicInsertionMaxHeap: " << (testBasicInsertionMaxHeap() ? "Pass" : "Fail") << endl;
-        cout << "testBasicRemovalMinHeap: " << (testBasicRemovalMinHeap() ? "Pass" : "Fail") << endl;
-        cout << "testBasicRemovalMaxHeap: " << (testBasicRemovalMaxHeap() ? "Pass" : "Fail") << endl;
-        cout << "testLargeScaleInsertionMinHeap: " << (testLargeScaleInsertionMinHeap() ? "Pass" : "Fail") << endl;
-        cout << "testLargeScaleInsertionMaxHeap: " << (testLargeScaleInsertionMaxHeap() ? "Pass" : "Fail") << endl;
-        cout << "testLargeScaleRemovalMinHeap: " << (testLargeScaleRemovalMinHeap() ? "Pass" : "Fail") << endl;
-        cout << "testLargeScaleRemovalMaxHeap: " << (testLargeScaleRemovalMaxHeap() ? "Pass" : "Fail") << endl;
-        cout << "testLeftistNPLValues: " << (testLeftistNPLValues() ? "Pass" : "Fail") << endl;
-        cout << "testLeftistProperty: " << (testLeftistProperty() ? "Pass" : "Fail") << endl;
-        cout << "testCopyConstructor: " << (testCopyConstructor() ? "Pass" : "Fail") << endl;
-        cout << "testCopyConstructorEmpty: " << (testCopyConstructorEmpty() ? "Pass" : "Fail") << endl;
-        cout << "testAssignmentOperator: " << (testAssignmentOperator() ? "Pass" : "Fail") << endl;
-        cout << "testAssignmentOperatorEmpty: " << (testAssignmentOperatorEmpty() ? "Pass" : "Fail") << endl;
-        cout << "testExceptionOnEmptyDequeue: " << (testExceptionOnEmptyDequeue() ? "Pass" : "Fail") << endl;
-        cout << "testMergeEmptyQueue: " << (testMergeEmptyQueue() ? "Pass" : "Fail") << endl;
-        cout << "testMergeDifferentPriorityFunctions: " << (testMergeDifferentPriorityFunctions() ? "Pass" : "Fail") << endl;
-        cout << "testPriorityFunctionChange: " << (testPriorityFunctionChange() ? "Pass" : "Fail") << endl;
-    }
-};
-
-// Run all tests
-int main() {
-    srand(static_cast<unsigned int>(time(nullptr))); // Seed for random number generation
-    Tester tester;
-    tester.runTests();
-    return 0;
-}
-
-// Helper function for generating random Order objects
-Order generateRandomOrder(int id) {
-    return Order(
-        "Customer" + to_string(id),
-        rand() % MAX50 + 1, // FIFO: 1 to 50
-        rand() % MAX12 + 1, // Process time: 1 to 12
-        rand() % MAX12 + 1, // Due time: 1 to 12
-        rand() % MAX12 + 1, // Slack time: 1 to 12
-        rand() % MAX100 + 1, // Material: 1 to 100
-        rand() % MAX100 + 1, // Importance: 1 to 100
-        rand() % (MAX200 - 100 + 1) + 100, // WorkForce: 100 to 200
-        rand() % (MAX10000 - MIN1000 + 1) + MIN1000 // Quantity: 1000 to 10000
-    );
-}
-
-// Test functions for basic and large-scale testing
-
-bool Tester::testBasicInsertionMinHeap() {
-    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 10; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-    // Verify min-heap property
-    Node* node = queue.m_heap;
-    while (node && node->m_left) {
-        if (priorityFn2(node->getOrder()) > priorityFn2(node->m_left->getOrder())) return false;
-        node = node->m_left;
-    }
-    return true;
-}
-
-bool Tester::testBasicInsertionMaxHeap() {
-    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
-    for (int i = 0; i < 10; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-    // Verify max-heap property
-    Node* node = queue.m_heap;
-    while (node && node->m_left) {
-        if (priorityFn2(node->getOrder()) < priorityFn2(node->m_left->getOrder())) return false;
-        node = node->m_left;
-    }
-    return true;
-}
-
-bool Tester::testBasicRemovalMinHeap() {
-    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 10; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-
-    int lastPriority = -1;
-    while (queue.numOrders() > 0) {
-        Order order = queue.getNextOrder();
-        int priority = priorityFn2(order);
-        if (lastPriority != -1 && priority < lastPriority) {
-            return false; // Priority should not decrease
-        }
-        lastPriority = priority;
-    }
-    return true;
-}
-
-bool Tester::testBasicRemovalMaxHeap() {
-    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
-    for (int i = 0; i < 10; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-
-    int lastPriority = INT_MAX;
-    while (queue.numOrders() > 0) {
-        Order order = queue.getNextOrder();
-        int priority = priorityFn2(order);
-        if (priority > lastPriority) {
-            return false; // Priority should not increase
-        }
-        lastPriority = priority;
-    }
-    return true;
-}
-
-bool Tester::testLargeScaleInsertionMinHeap() {
-    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 300; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-    // Verify min-heap property
-    Node* node = queue.m_heap;
-    while (node && node->m_left) {
-        if (priorityFn2(node->getOrder()) > priorityFn2(node->m_left->getOrder())) return false;
-        node = node->m_left;
-    }
-    return true;
-}
-
-bool Tester::testLargeScaleInsertionMaxHeap() {
-    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
-    for (int i = 0; i < 300; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-    // Verify max-heap property
-    Node* node = queue.m_heap;
-    while (node && node->m_left) {
-        if (priorityFn2(node->getOrder()) < priorityFn2(node->m_left->getOrder())) return false;
-        node = node->m_left;
-    }
-    return true;
-}
-
-bool Tester::testLargeScaleRemovalMinHeap() {
-    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 300; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-
-    int lastPriority = -1;
-    while (queue.numOrders() > 0) {
-        Order order = queue.getNextOrder();
-        int priority = priorityFn2(order);
-        if (lastPriority != -1 && priority < lastPriority) {
-            return false; // Priority should not decrease
-        }
-        lastPriority = priority;
-    }
-    return true;
-}
-
-bool Tester::testLargeScaleRemovalMaxHeap() {
-    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
-    for (int i = 0; i < 300; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-
-    int lastPriority = INT_MAX;
-    while (queue.numOrders() > 0) {
-        Order order = queue.getNextOrder();
-        int priority = priorityFn2(order);
-        if (priority > lastPriority) {
-            return false; // Priority should not increase
-        }
-        lastPriority = priority;
-    }
-    return true;
-}
-
-bool Tester::testLeftistNPLValues() {
-    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 10; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-    // Verify leftist property of NPL values
-    Node* node = queue.m_heap;
-    while (node) {
-        int leftNPL = node->m_left ? node->m_left->getNPL() : 0;
-        int rightNPL = node->m_right ? node->m_right->getNPL() : 0;
-        if (leftNPL < rightNPL) return false;
-        node = node->m_left;
-    }
-    return true;
-}
-
-bool Tester::testLeftistProperty() {
-    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 10; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-
-    // Traverse the heap to check the leftist property
-    Node* node = queue.m_heap;
-    while (node) {
-        int leftNPL = node->m_left ? node->m_left->getNPL() : 0;
-        int rightNPL = node->m_right ? node->m_right->getNPL() : 0;
-        if (leftNPL < rightNPL) {
-            return false; // Leftist property requires left NPL >= right NPL
-        }
-        node = node->m_left;
-    }
-    return true;
-}
-
-bool Tester::testCopyConstructor() {
-    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 5; ++i) {
-        queue1.insertOrder(generateRandomOrder(i));
-    }
-
-    MQueue queue2(queue1);  // Copy constructor
-
-    return queue1.numOrders() == queue2.numOrders();
-}
-
-bool Tester::testCopyConstructorEmpty() {
-    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
-    MQueue queue2(queue1);  // Copy constructor on empty queue
-
-    return queue2.numOrders() == 0;
-}
-
-bool Tester::testAssignmentOperator() {
-    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 5; ++i) {
-        queue1.insertOrder(generateRandomOrder(i));
-    }
-
-    MQueue queue2(priorityFn2, MINHEAP, LEFTIST);
-    queue2 = queue1;
-
-    return queue1.numOrders() == queue2.numOrders();
-}
-
-bool Tester::testAssignmentOperatorEmpty() {
-    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
-    MQueue queue2(priorityFn2, MINHEAP, LEFTIST);
-    queue2.insertOrder(Order("Test", 0, 0, 0, 0, 0, 0, 0, 0));  // Insert one order
-
-    queue2 = queue1;  // Assign empty queue
-
-    return queue2.numOrders() == 0;
-}
-
-bool Tester::testExceptionOnEmptyDequeue() {
-    MQueue queue(priorityFn1, MINHEAP, LEFTIST);
-    try {
-        queue.getNextOrder();
-    } catch (const out_of_range&) {
-        return true;  // Expected exception
-    }
-    return false;
-}
-
-bool Tester::testMergeEmptyQueue() {
-    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
-    for (int i = 0; i < 5; ++i) {
-        queue1.insertOrder(generateRandomOrder(i));
-    }
-
-    MQueue emptyQueue(priorityFn2, MINHEAP, LEFTIST);
-    queue1.mergeWithQueue(emptyQueue);
-
-    return queue1.numOrders() == 5 && emptyQueue.numOrders() == 0;
-}
-
-bool Tester::testMergeDifferentPriorityFunctions() {
-    MQueue queue1(priorityFn1, MINHEAP, LEFTIST);
-    MQueue queue2(priorityFn2, MINHEAP, LEFTIST);
-    try {
-        queue1.mergeWithQueue(queue2);
-    } catch (const domain_error&) {
-        return true; // Expected exception
-    }
-    return false;
-}
-
-bool Tester::testPriorityFunctionChange() {
-    MQueue queue(priorityFn1, MINHEAP, LEFTIST);
-    for (int i = 0; i < 5; ++i) {
-        queue.insertOrder(generateRandomOrder(i));
-    }
-
-    queue.setPriorityFn(priorityFn2, MINHEAP); // Change priority function
-    return true; // Placeholder for real verification
-}
\ No newline at end of file
+#include "mqueue.h"
+#include "basicmqueue.h"
+#include "multimqueue.h"
+#include "workstealing.h"
+#include "journal.h"
+#include "persistentmqueue.h"
+#include "blockingmqueue.h"
+#include "boundedmqueue.h"
+#include "reclaimer.h"
+#include <iostream>
+#include <stdexcept>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+
+// Sample priority functions for testing
+int priorityFn1(const Order& order) {
+    return order.getImportance() + order.getQuantity();
+}
+
+int priorityFn2(const Order& order) {
+    return order.getFIFO() + order.getProcessTime();
+}
+
+#ifdef BLOCKINGMQUEUE_COROUTINES
+// A coroutine that starts at once and runs on whichever thread resumes it
+struct Task {
+    struct promise_type {
+        Task get_return_object() {return Task();}
+        std::suspend_never initial_suspend() {return {};}
+        std::suspend_never final_suspend() noexcept {return {};}
+        void return_void() {}
+        void unhandled_exception() {std::terminate();}
+    };
+};
+
+// Collects priorities until the queue is closed
+Task consumeOrders(BlockingMQueue& queue, vector<int>& keys) {
+    try {
+        while (true) keys.push_back(priorityFn2(co_await queue.next()));
+    } catch (const out_of_range&) {
+    }
+}
+
+Task produceOrders(BlockingMQueue& queue, const vector<Order>& orders, int& inserted) {
+    for (const Order& order : orders) {
+        if (co_await queue.insert(order)) ++inserted;
+    }
+}
+#endif
+
+class Tester {
+public:
+    bool testBasicInsertionMinHeap();
+    bool testBasicInsertionMaxHeap();
+    bool testBasicRemovalMinHeap();
+    bool testBasicRemovalMaxHeap();
+    bool testLargeScaleInsertionMinHeap();
+    bool testLargeScaleInsertionMaxHeap();
+    bool testLargeScaleRemovalMinHeap();
+    bool testLargeScaleRemovalMaxHeap();
+    bool testLeftistNPLValues();
+    bool testLeftistProperty();
+    bool testCopyConstructor();
+    bool testCopyConstructorEmpty();
+    bool testAssignmentOperator();
+    bool testAssignmentOperatorEmpty();
+    bool testExceptionOnEmptyDequeue();
+    bool testMergeEmptyQueue();
+    bool testMergeDifferentPriorityFunctions();
+    bool testPriorityFunctionChange();
+    bool testCachedPriorityKeys();
+    bool testDegenerateSkewStress();
+    bool testPooledQueue();
+    bool testPooledMergeAndCopy();
+    bool testBulkConstruction();
+    bool testInPlaceRebuild();
+    bool testBasicMQueueMatchesMQueue();
+    bool testMoveSemantics();
+    bool testCompactOrder();
+    bool testDaryQueue();
+    bool testDaryStructureChange();
+    bool testPairingQueue();
+    bool testPairingMergeAndChange();
+    bool testOrderHandles();
+    bool testOrderHandlesAcrossMerge();
+    bool testMultiMQueueSingleShard();
+    bool testMultiMQueueConcurrent();
+    bool testSplitQueue();
+    bool testWorkStealing();
+    bool testBatchedPop();
+    bool testPeekTopK();
+    bool testPriorityIterator();
+    bool testPriorityRange();
+    bool testSnapshotRoundTrip();
+    bool testSnapshotPartialLoad();
+    bool testSnapshotErrors();
+    bool testJournalRecovery();
+    bool testJournalCheckpoint();
+    bool testJournalErrors();
+    bool testJournalMoves();
+    bool testPersistentCopies();
+    bool testPersistentMergeAndRebuild();
+    bool testBucketQueue();
+    bool testBucketMergeSplitAndSnapshot();
+    bool testBucketRecovery();
+    bool testStats();
+    bool testBlockingMQueue();
+    bool testBlockingMQueueCoroutines();
+    bool testBoundedMQueue();
+    bool testBoundedMQueueCapacity();
+    bool testParallelRebuild();
+    bool testParallelRebuildRecovery();
+    bool testReclaimer();
+
+    // Runs every test and returns how many failed
+    int runTests() {
+        m_failures = 0;
+        report("testBasicInsertionMinHeap", testBasicInsertionMinHeap());
+        report("testBasicInsertionMaxHeap", testBasicInsertionMaxHeap());
+        report("testBasicRemovalMinHeap", testBasicRemovalMinHeap());
+        report("testBasicRemovalMaxHeap", testBasicRemovalMaxHeap());
+        report("testLargeScaleInsertionMinHeap", testLargeScaleInsertionMinHeap());
+        report("testLargeScaleInsertionMaxHeap", testLargeScaleInsertionMaxHeap());
+        report("testLargeScaleRemovalMinHeap", testLargeScaleRemovalMinHeap());
+        report("testLargeScaleRemovalMaxHeap", testLargeScaleRemovalMaxHeap());
+        report("testLeftistNPLValues", testLeftistNPLValues());
+        report("testLeftistProperty", testLeftistProperty());
+        report("testCopyConstructor", testCopyConstructor());
+        report("testCopyConstructorEmpty", testCopyConstructorEmpty());
+        report("testAssignmentOperator", testAssignmentOperator());
+        report("testAssignmentOperatorEmpty", testAssignmentOperatorEmpty());
+        report("testExceptionOnEmptyDequeue", testExceptionOnEmptyDequeue());
+        report("testMergeEmptyQueue", testMergeEmptyQueue());
+        report("testMergeDifferentPriorityFunctions", testMergeDifferentPriorityFunctions());
+        report("testPriorityFunctionChange", testPriorityFunctionChange());
+        report("testCachedPriorityKeys", testCachedPriorityKeys());
+        report("testDegenerateSkewStress", testDegenerateSkewStress());
+        report("testPooledQueue", testPooledQueue());
+        report("testPooledMergeAndCopy", testPooledMergeAndCopy());
+        report("testBulkConstruction", testBulkConstruction());
+        report("testInPlaceRebuild", testInPlaceRebuild());
+        report("testBasicMQueueMatchesMQueue", testBasicMQueueMatchesMQueue());
+        report("testMoveSemantics", testMoveSemantics());
+        report("testCompactOrder", testCompactOrder());
+        report("testDaryQueue", testDaryQueue());
+        report("testDaryStructureChange", testDaryStructureChange());
+        report("testPairingQueue", testPairingQueue());
+        report("testPairingMergeAndChange", testPairingMergeAndChange());
+        report("testOrderHandles", testOrderHandles());
+        report("testOrderHandlesAcrossMerge", testOrderHandlesAcrossMerge());
+        report("testMultiMQueueSingleShard", testMultiMQueueSingleShard());
+        report("testMultiMQueueConcurrent", testMultiMQueueConcurrent());
+        report("testSplitQueue", testSplitQueue());
+        report("testWorkStealing", testWorkStealing());
+        report("testBatchedPop", testBatchedPop());
+        report("testPeekTopK", testPeekTopK());
+        report("testPriorityIterator", testPriorityIterator());
+        report("testPriorityRange", testPriorityRange());
+        report("testSnapshotRoundTrip", testSnapshotRoundTrip());
+        report("testSnapshotPartialLoad", testSnapshotPartialLoad());
+        report("testSnapshotErrors", testSnapshotErrors());
+        report("testJournalRecovery", testJournalRecovery());
+        report("testJournalCheckpoint", testJournalCheckpoint());
+        report("testJournalErrors", testJournalErrors());
+        report("testJournalMoves", testJournalMoves());
+        report("testPersistentCopies", testPersistentCopies());
+        report("testPersistentMergeAndRebuild", testPersistentMergeAndRebuild());
+        report("testBucketQueue", testBucketQueue());
+        report("testBucketMergeSplitAndSnapshot", testBucketMergeSplitAndSnapshot());
+        report("testBucketRecovery", testBucketRecovery());
+        report("testStats", testStats());
+        report("testBlockingMQueue", testBlockingMQueue());
+        report("testBlockingMQueueCoroutines", testBlockingMQueueCoroutines());
+        report("testBoundedMQueue", testBoundedMQueue());
+        report("testBoundedMQueueCapacity", testBoundedMQueueCapacity());
+        report("testParallelRebuild", testParallelRebuild());
+        report("testParallelRebuildRecovery", testParallelRebuildRecovery());
+        report("testReclaimer", testReclaimer());
+        return m_failures;
+    }
+private:
+    int m_failures = 0;
+    void report(const char* name, bool passed) {
+        cout << name << ": " << (passed ? "Pass" : "Fail") << endl;
+        if (!passed) ++m_failures;
+    }
+    Node* buildRightChain(int size);
+    bool checkHeap(const MQueue& queue);
+    bool checkIntervalHeap(const BoundedMQueue& queue);
+    bool sameShape(const Node* node1, const Node* node2);
+};
+
+// Run all tests
+int main() {
+    srand(static_cast<unsigned int>(time(nullptr))); // Seed for random number generation
+    Tester tester;
+    // The exit status is the number of failed tests, so ctest and scripts
+    // can tell a failing run apart
+    int failures = tester.runTests();
+    return failures < 255 ? failures : 255;
+}
+
+// Helper function for generating random Order objects
+Order generateRandomOrder(int id) {
+    return Order(
+        "Customer" + to_string(id),
+        rand() % MAX50 + 1, // FIFO: 1 to 50
+        rand() % MAX12 + 1, // Process time: 1 to 12
+        rand() % MAX12 + 1, // Due time: 1 to 12
+        rand() % MAX12 + 1, // Slack time: 1 to 12
+        rand() % MAX100 + 1, // Material: 1 to 100
+        rand() % MAX100 + 1, // Importance: 1 to 100
+        rand() % (MAX200 - 100 + 1) + 100, // WorkForce: 100 to 200
+        rand() % (MAX10000 - MIN1000 + 1) + MIN1000 // Quantity: 1000 to 10000
+    );
+}
+
+// Test functions for basic and large-scale testing
+
+bool Tester::testBasicInsertionMinHeap() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 10; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    // Verify min-heap property
+    Node* node = queue.m_heap;
+    while (node && node->m_left) {
+        if (priorityFn2(node->getOrder()) > priorityFn2(node->m_left->getOrder())) return false;
+        node = node->m_left;
+    }
+    return true;
+}
+
+bool Tester::testBasicInsertionMaxHeap() {
+    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
+    for (int i = 0; i < 10; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    // Verify max-heap property
+    Node* node = queue.m_heap;
+    while (node && node->m_left) {
+        if (priorityFn2(node->getOrder()) < priorityFn2(node->m_left->getOrder())) return false;
+        node = node->m_left;
+    }
+    return true;
+}
+
+bool Tester::testBasicRemovalMinHeap() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 10; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+
+    int lastPriority = -1;
+    while (queue.numOrders() > 0) {
+        Order order = queue.getNextOrder();
+        int priority = priorityFn2(order);
+        if (lastPriority != -1 && priority < lastPriority) {
+            return false; // Priority should not decrease
+        }
+        lastPriority = priority;
+    }
+    return true;
+}
+
+bool Tester::testBasicRemovalMaxHeap() {
+    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
+    for (int i = 0; i < 10; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+
+    int lastPriority = INT_MAX;
+    while (queue.numOrders() > 0) {
+        Order order = queue.getNextOrder();
+        int priority = priorityFn2(order);
+        if (priority > lastPriority) {
+            return false; // Priority should not increase
+        }
+        lastPriority = priority;
+    }
+    return true;
+}
+
+bool Tester::testLargeScaleInsertionMinHeap() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 300; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    // Verify min-heap property
+    Node* node = queue.m_heap;
+    while (node && node->m_left) {
+        if (priorityFn2(node->getOrder()) > priorityFn2(node->m_left->getOrder())) return false;
+        node = node->m_left;
+    }
+    return true;
+}
+
+bool Tester::testLargeScaleInsertionMaxHeap() {
+    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
+    for (int i = 0; i < 300; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    // Verify max-heap property
+    Node* node = queue.m_heap;
+    while (node && node->m_left) {
+        if (priorityFn2(node->getOrder()) < priorityFn2(node->m_left->getOrder())) return false;
+        node = node->m_left;
+    }
+    return true;
+}
+
+bool Tester::testLargeScaleRemovalMinHeap() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 300; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+
+    int lastPriority = -1;
+    while (queue.numOrders() > 0) {
+        Order order = queue.getNextOrder();
+        int priority = priorityFn2(order);
+        if (lastPriority != -1 && priority < lastPriority) {
+            return false; // Priority should not decrease
+        }
+        lastPriority = priority;
+    }
+    return true;
+}
+
+bool Tester::testLargeScaleRemovalMaxHeap() {
+    MQueue queue(priorityFn2, MAXHEAP, LEFTIST);
+    for (int i = 0; i < 300; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+
+    int lastPriority = INT_MAX;
+    while (queue.numOrders() > 0) {
+        Order order = queue.getNextOrder();
+        int priority = priorityFn2(order);
+        if (priority > lastPriority) {
+            return false; // Priority should not increase
+        }
+        lastPriority = priority;
+    }
+    return true;
+}
+
+bool Tester::testLeftistNPLValues() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 10; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    // Verify leftist property of NPL values
+    Node* node = queue.m_heap;
+    while (node) {
+        int leftNPL = node->m_left ? node->m_left->getNPL() : 0;
+        int rightNPL = node->m_right ? node->m_right->getNPL() : 0;
+        if (leftNPL < rightNPL) return false;
+        node = node->m_left;
+    }
+    return true;
+}
+
+bool Tester::testLeftistProperty() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 10; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+
+    // Traverse the heap to check the leftist property
+    Node* node = queue.m_heap;
+    while (node) {
+        int leftNPL = node->m_left ? node->m_left->getNPL() : 0;
+        int rightNPL = node->m_right ? node->m_right->getNPL() : 0;
+        if (leftNPL < rightNPL) {
+            return false; // Leftist property requires left NPL >= right NPL
+        }
+        node = node->m_left;
+    }
+    return true;
+}
+
+bool Tester::testCopyConstructor() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 5; ++i) {
+        queue1.insertOrder(generateRandomOrder(i));
+    }
+
+    MQueue queue2(queue1);  // Copy constructor
+
+    return queue1.numOrders() == queue2.numOrders();
+}
+
+bool Tester::testCopyConstructorEmpty() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
+    MQueue queue2(queue1);  // Copy constructor on empty queue
+
+    return queue2.numOrders() == 0;
+}
+
+bool Tester::testAssignmentOperator() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 5; ++i) {
+        queue1.insertOrder(generateRandomOrder(i));
+    }
+
+    MQueue queue2(priorityFn2, MINHEAP, LEFTIST);
+    queue2 = queue1;
+
+    return queue1.numOrders() == queue2.numOrders();
+}
+
+bool Tester::testAssignmentOperatorEmpty() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
+    MQueue queue2(priorityFn2, MINHEAP, LEFTIST);
+    queue2.insertOrder(Order("Test", 0, 0, 0, 0, 0, 0, 0, 0));  // Insert one order
+
+    queue2 = queue1;  // Assign empty queue
+
+    return queue2.numOrders() == 0;
+}
+
+bool Tester::testExceptionOnEmptyDequeue() {
+    MQueue queue(priorityFn1, MINHEAP, LEFTIST);
+    try {
+        queue.getNextOrder();
+    } catch (const out_of_range&) {
+        return true;  // Expected exception
+    }
+    return false;
+}
+
+bool Tester::testMergeEmptyQueue() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 5; ++i) {
+        queue1.insertOrder(generateRandomOrder(i));
+    }
+
+    MQueue emptyQueue(priorityFn2, MINHEAP, LEFTIST);
+    queue1.mergeWithQueue(emptyQueue);
+
+    return queue1.numOrders() == 5 && emptyQueue.numOrders() == 0;
+}
+
+bool Tester::testMergeDifferentPriorityFunctions() {
+    MQueue queue1(priorityFn1, MINHEAP, LEFTIST);
+    MQueue queue2(priorityFn2, MINHEAP, LEFTIST);
+    try {
+        queue1.mergeWithQueue(queue2);
+    } catch (const domain_error&) {
+        return true; // Expected exception
+    }
+    return false;
+}
+
+bool Tester::testPriorityFunctionChange() {
+    MQueue queue(priorityFn1, MINHEAP, LEFTIST);
+    for (int i = 0; i < 5; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+
+    queue.setPriorityFn(priorityFn2, MINHEAP); // Change priority function
+    return true; // Placeholder for real verification
+}
+
+bool Tester::testCachedPriorityKeys() {
+    MQueue queue(priorityFn1, MAXHEAP, SKEW);
+    for (int i = 0; i < 50; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    queue.setPriorityFn(priorityFn2, MINHEAP);
+
+    // Every cached key must match the new priority function
+    vector<Node*> stack;
+    if (queue.m_heap) stack.push_back(queue.m_heap);
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (node->getKey() != priorityFn2(node->getOrder())) return false;
+        if (node->m_left) stack.push_back(node->m_left);
+        if (node->m_right) stack.push_back(node->m_right);
+    }
+    return true;
+}
+
+// Builds a valid min skew heap that is a single right path of the given
+// size, the worst case for any recursive traversal or merge
+Node* Tester::buildRightChain(int size) {
+    Node* root = nullptr;
+    for (int i = size - 1; i >= 0; --i) {
+        Order order("Stress", 1 + (long long)i * (MAX50 - 1) / size, 1, 1, 1, 1, 1, 100, 1000);
+        Node* node = new Node(order, priorityFn2(order));
+        node->m_right = root;
+        node->m_count = size - i;
+        if (root) root->m_parent = node;
+        root = node;
+    }
+    return root;
+}
+
+bool Tester::testDegenerateSkewStress() {
+    const int size = 10000000;
+    MQueue queue1(priorityFn2, MINHEAP, SKEW);
+    queue1.m_heap = buildRightChain(size);
+    queue1.m_size = size;
+
+    // Copy, then verify the copy kept the whole right path
+    MQueue queue2(queue1);
+    int pathLength = 0;
+    for (Node* node = queue2.m_heap; node; node = node->m_right) ++pathLength;
+    if (pathLength != size) return false;
+
+    // Merge walks both right paths to the end
+    queue1.mergeWithQueue(queue2);
+    if (queue1.numOrders() != 2 * size || queue2.numOrders() != 0) return false;
+
+    int lastPriority = -1;
+    for (int i = 0; i < 1000; ++i) {
+        int priority = priorityFn2(queue1.getNextOrder());
+        if (priority < lastPriority) return false;
+        lastPriority = priority;
+    }
+    queue1.clear();
+    return queue1.numOrders() == 0 && queue1.m_heap == nullptr;
+}
+
+bool Tester::testPooledQueue() {
+    MQueue queue(priorityFn2, MINHEAP, SKEW, POOLALLOC);
+    if (queue.getAllocation() != POOLALLOC) return false;
+    // Two rounds so the second one reuses the slabs of the first
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 3000; ++i) {
+            queue.insertOrder(generateRandomOrder(i));
+        }
+        if (queue.m_pool->numSlabs() == 0) return false;
+        int lastPriority = -1;
+        for (int i = 0; i < 1500; ++i) {
+            int priority = priorityFn2(queue.getNextOrder());
+            if (priority < lastPriority) return false;
+            lastPriority = priority;
+        }
+        queue.clear();
+        if (queue.numOrders() != 0 || queue.m_pool->numSlabs() != 0) return false;
+    }
+    return true;
+}
+
+bool Tester::testPooledMergeAndCopy() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST, POOLALLOC);
+    MQueue queue2(priorityFn2, MINHEAP, LEFTIST, POOLALLOC);
+    for (int i = 0; i < 2000; ++i) {
+        queue1.insertOrder(generateRandomOrder(i));
+        queue2.insertOrder(generateRandomOrder(i));
+    }
+    MQueue copy(queue1);
+    if (copy.getAllocation() != POOLALLOC || copy.numOrders() != 2000) return false;
+
+    // Merging moves queue2's slabs into queue1's pool
+    queue1.mergeWithQueue(queue2);
+    if (queue1.numOrders() != 4000 || queue2.m_pool->numSlabs() != 0) return false;
+    int lastPriority = -1;
+    while (queue1.numOrders() > 0) {
+        int priority = priorityFn2(queue1.getNextOrder());
+        if (priority < lastPriority) return false;
+        lastPriority = priority;
+    }
+
+    // A pooled queue cannot absorb nodes from the global heap
+    MQueue global(priorityFn2, MINHEAP, LEFTIST);
+    global.insertOrder(generateRandomOrder(0));
+    try {
+        copy.mergeWithQueue(global);
+    } catch (const domain_error&) {
+        return true;
+    }
+    return false;
+}
+
+bool Tester::testBulkConstruction() {
+    vector<Order> orders;
+    for (int i = 0; i < 1000; ++i) {
+        orders.push_back(generateRandomOrder(i));
+    }
+    for (STRUCTURE structure : {SKEW, LEFTIST}) {
+        MQueue queue(orders.begin(), orders.end(), priorityFn2, MINHEAP, structure);
+        if (queue.numOrders() != 1000) return false;
+        // Bulk insert into a non-empty queue merges with the existing heap
+        if (queue.insertOrders(orders.begin(), orders.begin() + 500) != 500) return false;
+        if (queue.numOrders() != 1500) return false;
+        if (structure == LEFTIST) {
+            vector<Node*> stack(1, queue.m_heap);
+            while (!stack.empty()) {
+                Node* node = stack.back();
+                stack.pop_back();
+                int leftNPL = node->m_left ? node->m_left->getNPL() : -1;
+                int rightNPL = node->m_right ? node->m_right->getNPL() : -1;
+                if (leftNPL < rightNPL || node->getNPL() != rightNPL + 1) return false;
+                if (node->m_left) stack.push_back(node->m_left);
+                if (node->m_right) stack.push_back(node->m_right);
+            }
+        }
+        int lastPriority = -1;
+        while (queue.numOrders() > 0) {
+            int priority = priorityFn2(queue.getNextOrder());
+            if (priority < lastPriority) return false;
+            lastPriority = priority;
+        }
+    }
+    return true;
+}
+
+bool Tester::testInPlaceRebuild() {
+    MQueue queue(priorityFn2, MINHEAP, SKEW);
+    for (int i = 0; i < 500; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    // Collect the node addresses before and after the rebuilds
+    auto collect = [](Node* root) {
+        vector<Node*> nodes;
+        if (root) nodes.push_back(root);
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i]->m_left) nodes.push_back(nodes[i]->m_left);
+            if (nodes[i]->m_right) nodes.push_back(nodes[i]->m_right);
+        }
+        sort(nodes.begin(), nodes.end());
+        return nodes;
+    };
+    vector<Node*> before = collect(queue.m_heap);
+    queue.setPriorityFn(priorityFn1, MAXHEAP);
+    queue.setStructure(LEFTIST);
+    if (collect(queue.m_heap) != before || queue.numOrders() != 500) return false;
+
+    int lastPriority = INT_MAX;
+    while (queue.numOrders() > 0) {
+        int priority = priorityFn1(queue.getNextOrder());
+        if (priority > lastPriority) return false;
+        lastPriority = priority;
+    }
+    return true;
+}
+
+bool Tester::testBasicMQueueMatchesMQueue() {
+    vector<Order> orders;
+    for (int i = 0; i < 300; ++i) {
+        orders.push_back(generateRandomOrder(i));
+    }
+    // Same insert sequence, same merge algorithm: both must yield the same keys
+    MQueue queue1(priorityFn2, MINHEAP, SKEW);
+    BasicMQueue<FunctionKey, less<int>, SkewPolicy> basic1(priorityFn2);
+    MQueue queue2(priorityFn1, MAXHEAP, LEFTIST);
+    BasicMQueue<FunctionKey, greater<int>, LeftistPolicy> basic2(priorityFn1);
+    for (const Order& order : orders) {
+        queue1.insertOrder(order);
+        basic1.insertOrder(order);
+        queue2.insertOrder(order);
+        basic2.insertOrder(order);
+    }
+    BasicMQueue<FunctionKey, greater<int>, LeftistPolicy> copy(basic2);
+    if (copy.numOrders() != 300 || basic1.getStructure() != SKEW) return false;
+    while (queue1.numOrders() > 0) {
+        if (priorityFn2(queue1.getNextOrder()) != priorityFn2(basic1.getNextOrder())) return false;
+        if (priorityFn1(queue2.getNextOrder()) != priorityFn1(basic2.getNextOrder())) return false;
+    }
+    return basic1.numOrders() == 0 && basic2.numOrders() == 0;
+}
+
+bool Tester::testMoveSemantics() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST, POOLALLOC);
+    for (int i = 0; i < 100; ++i) {
+        Order order = generateRandomOrder(i);
+        queue1.insertOrder(std::move(order));
+    }
+    if (!queue1.emplaceOrder("Emplaced", 1, 1, 1, 1, 50, 50, 150, 5000)) return false;
+
+    // Move construction steals the root and the pool
+    Node* root = queue1.m_heap;
+    MQueue queue2(std::move(queue1));
+    if (queue2.m_heap != root || queue2.numOrders() != 101 || queue2.getAllocation() != POOLALLOC)
+        return false;
+    if (queue1.m_heap != nullptr || queue1.numOrders() != 0 || queue1.m_pool != nullptr)
+        return false;
+
+    // Move assignment releases the old contents of the target
+    MQueue queue3(priorityFn1, MAXHEAP, SKEW);
+    queue3.insertOrder(generateRandomOrder(0));
+    queue3 = std::move(queue2);
+    if (queue3.m_heap != root || queue3.getStructure() != LEFTIST || queue2.numOrders() != 0)
+        return false;
+
+    // The orders moved out by getNextOrder keep their payload
+    bool foundEmplaced = false;
+    while (queue3.numOrders() > 0) {
+        if (queue3.getNextOrder().getCustomer() == "Emplaced") foundEmplaced = true;
+    }
+    return foundEmplaced;
+}
+
+bool Tester::testCompactOrder() {
+    if (sizeof(Node) > 64) return false;
+    Order order1("Acme", 50, 12, 12, 12, 100, 100, 200, 10000);
+    Order order2("Acme", 1, 1, 1, 1, 0, 1, 100, 1000);
+    Order order3("Globex", 1, 1, 1, 1, 0, 1, 100, 1000);
+    // Equal names share one interned id
+    if (order1.getCustomerId() != order2.getCustomerId()) return false;
+    if (order1.getCustomerId() == order3.getCustomerId()) return false;
+    if (order1.getCustomer() != "Acme" || Order().getCustomer() != DEFAULTCUSTOMER) return false;
+    if (order1.getQuantity() != 10000 || order1.getWorkForce() != 200 || order2.getMaterial() != 0)
+        return false;
+    try {
+        Order tooLarge("Acme", 1, 1, 1, 1, 0, 1, 100, 100000);
+    } catch (const out_of_range&) {
+        return true; // Expected exception
+    }
+    return false;
+}
+
+bool Tester::testDaryQueue() {
+    for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+        MQueue queue(priorityFn2, heapType, DARY, POOLALLOC);
+        MQueue other(priorityFn2, heapType, DARY, POOLALLOC);
+        for (int i = 0; i < 300; ++i) {
+            queue.insertOrder(generateRandomOrder(i));
+            if (i % 3 == 0) other.insertOrder(generateRandomOrder(i));
+        }
+        if (queue.m_heap != nullptr || queue.m_dary.size() != 300) return false;
+        // Every slot must rank at least as high as its children
+        for (size_t pos = 1; pos < queue.m_dary.size(); ++pos) {
+            int parentKey = queue.m_dary[(pos - 1) / 4].key;
+            int key = queue.m_dary[pos].key;
+            if (heapType == MINHEAP ? key < parentKey : key > parentKey) return false;
+        }
+        queue.mergeWithQueue(other);
+        MQueue copy(queue);
+        if (copy.numOrders() != 400 || other.numOrders() != 0) return false;
+
+        int lastPriority = heapType == MINHEAP ? -1 : INT_MAX;
+        while (copy.numOrders() > 0) {
+            int priority = priorityFn2(copy.getNextOrder());
+            if (heapType == MINHEAP ? priority < lastPriority : priority > lastPriority) return false;
+            lastPriority = priority;
+        }
+        queue.clear();
+        if (queue.numOrders() != 0 || !queue.m_dary.empty()) return false;
+    }
+    return true;
+}
+
+bool Tester::testDaryStructureChange() {
+    MQueue queue(priorityFn2, MINHEAP, SKEW);
+    for (int i = 0; i < 500; ++i) {
+        queue.insertOrder(generateRandomOrder(i));
+    }
+    queue.setStructure(DARY);
+    if (queue.m_heap != nullptr || queue.m_dary.size() != 500) return false;
+    queue.setPriorityFn(priorityFn1, MAXHEAP);
+    for (size_t pos = 1; pos < queue.m_dary.size(); ++pos) {
+        if (queue.m_dary[pos].key > queue.m_dary[(pos - 1) / 4].key) return false;
+    }
+    queue.setStructure(LEFTIST);
+    if (!queue.m_dary.empty() || queue.numOrders() != 500) return false;
+
+    int lastPriority = INT_MAX;
+    while (queue.numOrders() > 0) {
+        int priority = priorityFn1(queue.getNextOrder());
+        if (priority > lastPriority) return false;
+        lastPriority = priority;
+    }
+    return true;
+}
+
+// Verifies the invariants of any structure: heap order on the cached keys,
+// keys matching the priority function, the NPL rules of a leftist heap,
+// a sibling-free pairing root, parent links and a node count equal to
+// numOrders()
+bool Tester::checkHeap(const MQueue& queue) {
+    auto above = [&](int parentKey, int key) {
+        return queue.m_heapType == MINHEAP ? parentKey <= key : parentKey >= key;
+    };
+    if (queue.m_structure == DARY) {
+        for (size_t pos = 1; pos < queue.m_dary.size(); ++pos) {
+            if (!above(queue.m_dary[(pos - 1) / 4].key, queue.m_dary[pos].key)) return false;
+        }
+        return queue.m_heap == nullptr && (int)queue.m_dary.size() == queue.m_size;
+    }
+    if (queue.m_heap && queue.m_structure == PAIRING && queue.m_heap->m_right) return false;
+    if (queue.m_heap && queue.m_heap->m_parent) return false;
+    int count = 0;
+    // BUCKET: every list node has its slot's key, the bitmap marks exactly
+    // the non-empty slots, and m_heap is a leftist heap of the other keys
+    for (size_t slot = 0; slot < queue.m_buckets.size(); ++slot) {
+        const Node* tail = queue.m_buckets[slot];
+        if (((queue.m_bucketBits[slot / 64] >> (slot % 64)) & 1) != (tail != nullptr)) return false;
+        if (!tail) continue;
+        if (slot / 64 < queue.m_bucketWord) return false;
+        const Node* node = tail;
+        do {
+            node = node->m_right;
+            ++count;
+            if (node->m_key != queue.bucketKey(slot) || node->m_left) return false;
+        } while (node != tail);
+    }
+    // (node, node it must not rank above)
+    vector<pair<const Node*, const Node*> > stack;
+    vector<const Node*> visited;
+    if (queue.m_heap) stack.push_back(make_pair(queue.m_heap, (const Node*)nullptr));
+    while (!stack.empty()) {
+        const Node* node = stack.back().first;
+        const Node* parent = stack.back().second;
+        stack.pop_back();
+        visited.push_back(node);
+        ++count;
+        if (parent && !above(parent->m_key, node->m_key)) return false;
+        if (node->m_key != queue.m_priorFunc(node->m_order)) return false;
+        if (queue.m_structure == BUCKET && queue.bucketSlot(node->m_key) != MQueue::NOBUCKET) return false;
+        if (queue.m_structure == LEFTIST || queue.m_structure == BUCKET) {
+            int leftNPL = node->m_left ? node->m_left->m_npl : -1;
+            int rightNPL = node->m_right ? node->m_right->m_npl : -1;
+            if (leftNPL < rightNPL || node->m_npl != rightNPL + 1) return false;
+        }
+        if (node->m_left && node->m_left->m_parent != node) return false;
+        if (node->m_right && node->m_right->m_parent != node) return false;
+        if (node->m_left) stack.push_back(make_pair(node->m_left, node));
+        // A pairing sibling hangs below the same parent as the node
+        if (node->m_right) {
+            stack.push_back(make_pair(node->m_right, queue.m_structure == PAIRING ? parent : node));
+        }
+    }
+    // Every node comes after its parent, so backwards the binary subtree
+    // sizes add up; a pairing node's m_count leaves out its siblings
+    if (!queue.m_countsStale) {
+        unordered_map<const Node*, int> span;
+        for (auto it = visited.rbegin(); it != visited.rend(); ++it) {
+            const Node* node = *it;
+            int left = node->m_left ? span[node->m_left] : 0;
+            int right = node->m_right ? span[node->m_right] : 0;
+            span[node] = 1 + left + right;
+            if (node->m_count != (queue.m_structure == PAIRING ? 1 + left : 1 + left + right)) return false;
+        }
+    }
+    return count == queue.m_size;
+}
+
+bool Tester::testPairingQueue() {
+    for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+        MQueue queue(priorityFn1, heapType, PAIRING);
+        for (int i = 0; i < 300; ++i) {
+            queue.insertOrder(generateRandomOrder(i));
+        }
+        if (!checkHeap(queue)) return false;
+        int lastPriority = heapType == MINHEAP ? -1 : INT_MAX;
+        while (queue.numOrders() > 0) {
+            int priority = priorityFn1(queue.getNextOrder());
+            if (heapType == MINHEAP ? priority < lastPriority : priority > lastPriority) return false;
+            lastPriority = priority;
+            if (queue.numOrders() % 50 == 0 && !checkHeap(queue)) return false;
+        }
+    }
+    return true;
+}
+
+bool Tester::testPairingMergeAndChange() {
+    MQueue plant(priorityFn2, MINHEAP, PAIRING, POOLALLOC);
+    for (int line = 0; line < 10; ++line) {
+        MQueue queue(priorityFn2, MINHEAP, PAIRING, POOLALLOC);
+        for (int i = 0; i < 50; ++i) {
+            queue.insertOrder(generateRandomOrder(i));
+        }
+        plant.mergeWithQueue(queue);
+    }
+    if (plant.numOrders() != 500 || !checkHeap(plant)) return false;
+    MQueue copy(plant);
+    if (!checkHeap(copy)) return false;
+    for (int i = 0; i < 100; ++i) plant.getNextOrder();
+    if (!checkHeap(plant)) return false;
+
+    // Round trip through every other structure
+    plant.setStructure(LEFTIST);
+    if (!checkHeap(plant)) return false;
+    plant.setStructure(DARY);
+    if (!checkHeap(plant)) return false;
+    plant.setStructure(PAIRING);
+    plant.setPriorityFn(priorityFn1, MAXHEAP);
+    return checkHeap(plant) && plant.numOrders() == 400;
+}
+
+bool Tester::testOrderHandles() {
+    for (STRUCTURE structure : {SKEW, LEFTIST, PAIRING}) {
+        for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+            MQueue queue(priorityFn2, heapType, structure);
+            vector<OrderHandle> handles(400);
+            for (int i = 0; i < 400; ++i) {
+                if (!queue.insertOrder(generateRandomOrder(i), handles[i])) return false;
+            }
+            // Change every other order, cancel every fifth one
+            for (int i = 0; i < 400; i += 2) {
+                Order newOrder = generateRandomOrder(i);
+                if (!queue.updateOrder(handles[i], newOrder)) return false;
+                if (priorityFn2(handles[i].getOrder()) != priorityFn2(newOrder)) return false;
+            }
+            if (!checkHeap(queue)) return false;
+            int cancelled = 0;
+            for (int i = 0; i < 400; i += 5) {
+                queue.cancelOrder(handles[i]);
+                if (handles[i].isValid()) return false;
+                ++cancelled;
+            }
+            if (queue.numOrders() != 400 - cancelled || !checkHeap(queue)) return false;
+            // Handles survive a structure change between tree structures
+            queue.setStructure(structure == SKEW ? LEFTIST : SKEW);
+            queue.updateOrder(handles[1], generateRandomOrder(1));
+            if (!checkHeap(queue)) return false;
+        }
+    }
+    MQueue dary(priorityFn2, MINHEAP, DARY);
+    OrderHandle handle;
+    dary.insertOrder(generateRandomOrder(0), handle);
+    try {
+        dary.cancelOrder(handle);
+    } catch (const domain_error&) {
+        return true; // Expected exception
+    }
+    return false;
+}
+
+bool Tester::testOrderHandlesAcrossMerge() {
+    MQueue queue1(priorityFn2, MINHEAP, LEFTIST);
+    MQueue queue2(priorityFn2, MINHEAP, LEFTIST);
+    vector<OrderHandle> handles(100);
+    for (int i = 0; i < 100; ++i) {
+        queue1.insertOrder(generateRandomOrder(i));
+        queue2.insertOrder(generateRandomOrder(i), handles[i]);
+    }
+    queue1.mergeWithQueue(queue2);
+    for (int i = 0; i < 100; ++i) {
+        queue1.cancelOrder(handles[i]);
+    }
+    if (queue1.numOrders() != 100 || !checkHeap(queue1)) return false;
+    // A copy is a new set of nodes and must not be reachable from old handles
+    MQueue copy(queue1);
+    return checkHeap(copy);
+}
+bool Tester::testMultiMQueueSingleShard() {
+    // With one shard there is nothing to relax: pops are in exact order
+    MultiMQueue multi(priorityFn2, MINHEAP, SKEW, 1, 1);
+    MQueue exact(priorityFn2, MINHEAP, SKEW);
+    for (int i = 0; i < 500; ++i) {
+        Order order = generateRandomOrder(i);
+        multi.insertOrder(order);
+        exact.insertOrder(order);
+    }
+    if (multi.numShards() != 1 || multi.numOrders() != 500) return false;
+    while (exact.numOrders() > 0) {
+        if (priorityFn2(multi.getNextOrder()) != priorityFn2(exact.getNextOrder())) return false;
+    }
+    Order order;
+    if (multi.tryGetNextOrder(order)) return false;
+    try {
+        multi.getNextOrder();
+        return false;
+    } catch (const out_of_range&) {
+        return true;
+    }
+}
+
+bool Tester::testMultiMQueueConcurrent() {
+    const int threads = 4, perThread = 5000;
+    MultiMQueue multi(priorityFn1, MAXHEAP, PAIRING, threads, 2, POOLALLOC);
+    // rand() is not thread-safe, so the orders are made up front
+    vector<vector<Order> > orders(threads);
+    for (int t = 0; t < threads; ++t) {
+        for (int i = 0; i < perThread; ++i) orders[t].push_back(generateRandomOrder(t * perThread + i));
+    }
+    vector<vector<int> > popped(threads);
+    vector<thread> workers;
+    // Producers and consumers run together; consumers stop once producers
+    // are done and the queue has drained
+    std::atomic<int> producing(threads);
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (const Order& order : orders[t]) multi.insertOrder(order);
+            producing--;
+        });
+        workers.emplace_back([&, t] {
+            Order order;
+            while (true) {
+                bool done = producing.load() == 0;
+                if (multi.tryGetNextOrder(order)) popped[t].push_back(priorityFn1(order));
+                else if (done) break;
+            }
+        });
+    }
+    for (thread& worker : workers) worker.join();
+    // Every order comes out exactly once
+    vector<int> in, out;
+    for (int t = 0; t < threads; ++t) {
+        for (const Order& order : orders[t]) in.push_back(priorityFn1(order));
+        out.insert(out.end(), popped[t].begin(), popped[t].end());
+    }
+    sort(in.begin(), in.end());
+    sort(out.begin(), out.end());
+    return in == out && multi.numOrders() == 0;
+}
+
+bool Tester::testSplitQueue() {
+    for (STRUCTURE structure : {SKEW, LEFTIST, PAIRING}) {
+        MQueue queue(priorityFn2, MINHEAP, structure);
+        for (int i = 0; i < 1000; ++i) queue.insertOrder(generateRandomOrder(i));
+        // Split repeatedly; every part and the remainder stay valid heaps
+        vector<MQueue> parts;
+        for (int i = 0; i < 5; ++i) {
+            parts.push_back(queue.splitQueue());
+            if (!checkHeap(parts.back()) || !checkHeap(queue)) return false;
+        }
+        int total = queue.numOrders();
+        for (MQueue& part : parts) total += part.numOrders();
+        if (total != 1000 || parts[0].numOrders() == 0) return false;
+        // The parts merge back into one queue that drains in order
+        for (MQueue& part : parts) queue.mergeWithQueue(part);
+        if (queue.numOrders() != 1000 || !checkHeap(queue)) return false;
+        int last = -1;
+        while (queue.numOrders() > 0) {
+            int priority = priorityFn2(queue.getNextOrder());
+            if (priority < last) return false;
+            last = priority;
+        }
+        // Nothing to detach from a single order
+        queue.insertOrder(generateRandomOrder(0));
+        if (queue.splitQueue().numOrders() != 0 || queue.numOrders() != 1) return false;
+    }
+    // Cancels below the root leave the subtree sizes stale; the split
+    // counts its part instead, and a rebuild makes the sizes exact again
+    MQueue handled(priorityFn2, MINHEAP, LEFTIST);
+    vector<OrderHandle> handles(1000);
+    for (int i = 0; i < 1000; ++i) handled.insertOrder(generateRandomOrder(i), handles[i]);
+    for (int i = 0; i < 1000; i += 10) handled.cancelOrder(handles[i]);
+    MQueue part = handled.splitQueue();
+    if (!part.m_countsStale || !checkHeap(part) || !checkHeap(handled)) return false;
+    if (part.numOrders() == 0 || part.numOrders() + handled.numOrders() != 900) return false;
+    handled.setStructure(SKEW);
+    if (handled.m_countsStale || !checkHeap(handled)) return false;
+    // Nothing can leave a node pool or a DARY array without copying
+    MQueue pooled(priorityFn2, MINHEAP, SKEW, POOLALLOC);
+    MQueue dary(priorityFn2, MINHEAP, DARY);
+    for (MQueue* queue : {&pooled, &dary}) {
+        queue->insertOrder(generateRandomOrder(0));
+        try {
+            queue->splitQueue();
+            return false;
+        } catch (const domain_error&) {
+        }
+    }
+    return true;
+}
+
+bool Tester::testWorkStealing() {
+    const int workers = 4, count = 20000;
+    WorkStealingMQueue queue(priorityFn1, MAXHEAP, LEFTIST, workers);
+    // All work lands on worker 0; the others only get orders by stealing
+    vector<int> in;
+    for (int i = 0; i < count; ++i) {
+        Order order = generateRandomOrder(i);
+        in.push_back(priorityFn1(order));
+        queue.insertOrder(0, order);
+    }
+    // An empty worker steals a large part at once, not a single order
+    Order order;
+    vector<vector<int> > popped(workers);
+    if (!queue.tryGetNextOrder(1, order) || queue.numSteals() != 1) return false;
+    popped[1].push_back(priorityFn1(order));
+    if (queue.numOrders(1) < 100) return false;
+    vector<thread> threads;
+    for (int w = 0; w < workers; ++w) {
+        threads.emplace_back([&, w] {
+            Order order;
+            while (queue.tryGetNextOrder(w, order)) popped[w].push_back(priorityFn1(order));
+        });
+    }
+    for (thread& t : threads) t.join();
+    vector<int> out;
+    for (int w = 0; w < workers; ++w) out.insert(out.end(), popped[w].begin(), popped[w].end());
+    sort(in.begin(), in.end());
+    sort(out.begin(), out.end());
+    if (in != out || queue.numOrders() != 0) return false;
+    // A lone worker has no one to steal from
+    WorkStealingMQueue single(priorityFn1, MAXHEAP, SKEW, 1);
+    if (single.tryGetNextOrder(0, order)) return false;
+    try {
+        WorkStealingMQueue dary(priorityFn1, MAXHEAP, DARY, 2);
+        return false;
+    } catch (const domain_error&) {
+        return true;
+    }
+}
+
+bool Tester::testBatchedPop() {
+    MQueue queue(priorityFn1, MAXHEAP, LEFTIST);
+    for (int i = 0; i < 100; ++i) queue.insertOrder(generateRandomOrder(i));
+    MQueue copy(queue);
+    vector<Order> batch;
+    if (queue.getNextOrders(30, back_inserter(batch)) != 30 || queue.numOrders() != 70) return false;
+    for (const Order& order : batch) {
+        if (priorityFn1(order) != priorityFn1(copy.getNextOrder())) return false;
+    }
+    // Asking for more than is queued takes what is there
+    Order rest[80];
+    if (queue.getNextOrders(80, rest) != 70 || queue.numOrders() != 0) return false;
+    return queue.getNextOrders(5, back_inserter(batch)) == 0 && checkHeap(queue);
+}
+
+bool Tester::testPeekTopK() {
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+        MQueue queue(priorityFn2, MINHEAP, structure);
+        for (int i = 0; i < 300; ++i) queue.insertOrder(generateRandomOrder(i));
+        // Pop a few so the pairing heap has a multi-level tree
+        queue.getNextOrder();
+        const MQueue& view = queue;
+        if (priorityFn2(view.peekNextOrder()) != view.getTopPriority()) return false;
+        vector<Order> top = view.peekTopK(50);
+        if (top.size() != 50 || queue.numOrders() != 299 || !checkHeap(queue)) return false;
+        for (const Order& order : top) {
+            if (priorityFn2(order) != priorityFn2(queue.getNextOrder())) return false;
+        }
+        if (view.peekTopK(1000).size() != 249 || !view.peekTopK(0).empty()) return false;
+    }
+    MQueue empty(priorityFn2, MINHEAP, SKEW);
+    if (!empty.peekTopK(3).empty()) return false;
+    try {
+        empty.peekNextOrder();
+        return false;
+    } catch (const out_of_range&) {
+        return true;
+    }
+}
+
+bool Tester::testPriorityIterator() {
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+        MQueue queue(priorityFn1, MAXHEAP, structure);
+        for (int i = 0; i < 400; ++i) queue.insertOrder(generateRandomOrder(i));
+        queue.getNextOrder();
+        // The walk sees every order once, in the order the pops produce
+        vector<int> walked;
+        for (const Order& order : queue) walked.push_back(priorityFn1(order));
+        if (walked.size() != 399 || queue.numOrders() != 399 || !checkHeap(queue)) return false;
+        MQueue::const_iterator it = queue.begin(), copy = it++;
+        if (copy == it || copy != queue.begin() || priorityFn1(*copy) != walked[0]) return false;
+        MQueue drained(queue);
+        for (int priority : walked) {
+            if (priority != priorityFn1(drained.getNextOrder())) return false;
+        }
+    }
+    MQueue empty(priorityFn1, MAXHEAP, SKEW);
+    return empty.begin() == empty.end();
+}
+
+bool Tester::testPriorityRange() {
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+        for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+            MQueue queue(priorityFn2, heapType, structure);
+            for (int i = 0; i < 500; ++i) queue.insertOrder(generateRandomOrder(i));
+            queue.getNextOrder();
+            vector<int> expected, found;
+            for (const Order& order : queue) {
+                int priority = priorityFn2(order);
+                if (priority >= 10 && priority <= 20) expected.push_back(priority);
+            }
+            queue.forEachInPriorityRange(10, 20, [&](const Order& order) {
+                found.push_back(priorityFn2(order));
+            });
+            sort(expected.begin(), expected.end());
+            sort(found.begin(), found.end());
+            if (found != expected || queue.numOrders() != 499) return false;
+        }
+    }
+    return true;
+}
+
+// True if two trees have the same shape, orders, keys and NPLs
+bool Tester::sameShape(const Node* node1, const Node* node2) {
+    vector<pair<const Node*, const Node*> > stack(1, make_pair(node1, node2));
+    while (!stack.empty()) {
+        const Node* a = stack.back().first;
+        const Node* b = stack.back().second;
+        stack.pop_back();
+        if (!a || !b) {
+            if (a != b) return false;
+            continue;
+        }
+        if (a->m_key != b->m_key || a->m_npl != b->m_npl ||
+            a->m_order.getCustomer() != b->m_order.getCustomer() ||
+            a->m_order.getQuantity() != b->m_order.getQuantity() ||
+            a->m_order.getFIFO() != b->m_order.getFIFO()) {
+            return false;
+        }
+        stack.push_back(make_pair(a->m_left, b->m_left));
+        stack.push_back(make_pair(a->m_right, b->m_right));
+    }
+    return true;
+}
+
+bool Tester::testSnapshotRoundTrip() {
+    const char* path = "mytest_snapshot.bin";
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+        for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+            prifn_t fn = heapType == MINHEAP ? priorityFn2 : priorityFn1;
+            MQueue queue(fn, heapType, structure);
+            for (int i = 0; i < 1000; ++i) queue.insertOrder(generateRandomOrder(i));
+            for (int i = 0; i < 10; ++i) queue.getNextOrder();
+            queue.saveSnapshot(path);
+            // The loader takes heap type and structure from the file
+            MQueue loaded(fn, MINHEAP, SKEW, POOLALLOC);
+            loaded.insertOrder(generateRandomOrder(0));
+            loaded.loadSnapshot(path);
+            if (loaded.getHeapType() != heapType || loaded.getStructure() != structure ||
+                loaded.numOrders() != 990 || !checkHeap(loaded)) {
+                return false;
+            }
+            if (structure == DARY) {
+                for (size_t i = 0; i < queue.m_dary.size(); ++i) {
+                    if (queue.m_dary[i].key != loaded.m_dary[i].key) return false;
+                }
+            } else if (!sameShape(queue.m_heap, loaded.m_heap)) {
+                return false;
+            }
+            while (queue.numOrders() > 0) {
+                Order expected = queue.getNextOrder(), actual = loaded.getNextOrder();
+                if (fn(expected) != fn(actual) || expected.getCustomer() != actual.getCustomer()) return false;
+            }
+        }
+    }
+    // An empty queue round-trips too
+    MQueue empty(priorityFn2, MINHEAP, LEFTIST), loaded(priorityFn2, MINHEAP, SKEW);
+    loaded.insertOrder(generateRandomOrder(0));
+    empty.saveSnapshot(path);
+    loaded.loadSnapshot(path);
+    remove(path);
+    return loaded.numOrders() == 0 && loaded.getStructure() == LEFTIST;
+}
+
+bool Tester::testSnapshotPartialLoad() {
+    const char* path = "mytest_snapshot.bin";
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING}) {
+        MQueue queue(priorityFn1, MAXHEAP, structure);
+        for (int i = 0; i < 1000; ++i) queue.insertOrder(generateRandomOrder(i));
+        queue.getNextOrder();
+        queue.saveSnapshot(path);
+        vector<Order> top = queue.peekTopK(50);
+        MQueue loaded(priorityFn1, MAXHEAP, SKEW);
+        loaded.loadSnapshot(path, 50);
+        if (loaded.numOrders() != 50 || loaded.getStructure() != structure || !checkHeap(loaded)) return false;
+        for (const Order& order : top) {
+            if (priorityFn1(order) != priorityFn1(loaded.getNextOrder())) return false;
+        }
+        // Asking for more than the file holds loads all of it
+        loaded.loadSnapshot(path, 5000);
+        if (loaded.numOrders() != 999) return false;
+    }
+    remove(path);
+    return true;
+}
+
+bool Tester::testSnapshotErrors() {
+    const char* path = "mytest_snapshot.bin";
+    MQueue queue(priorityFn2, MINHEAP, SKEW);
+    for (int i = 0; i < 100; ++i) queue.insertOrder(generateRandomOrder(i));
+    queue.saveSnapshot(path);
+    // A different priority function is caught by the cached keys
+    MQueue other(priorityFn1, MAXHEAP, SKEW);
+    try {
+        other.loadSnapshot(path);
+        return false;
+    } catch (const domain_error&) {
+        if (other.numOrders() != 0) return false;
+    }
+    // A child index past the end, a truncated file and a missing file are
+    // runtime errors
+    {
+        fstream file(path, ios::binary | ios::in | ios::out);
+        int32_t badIndex = 1 << 30;
+        file.seekp(48 + 24);    // header, journal seq and bucket range, then the root's left child index
+        file.write(reinterpret_cast<const char*>(&badIndex), sizeof(badIndex));
+    }
+    try {
+        queue.loadSnapshot(path);
+        return false;
+    } catch (const runtime_error&) {
+        if (queue.numOrders() != 0) return false;
+    }
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        out << "MQSNAP";
+    }
+    try {
+        other.loadSnapshot(path);
+        return false;
+    } catch (const runtime_error&) {
+    }
+    remove(path);
+    try {
+        other.loadSnapshot(path);
+        return false;
+    } catch (const runtime_error&) {
+        return true;
+    }
+}
+
+// Runs the same mix of operations on a journaled queue and a plain one;
+// start also seeds rand so both get the same orders
+void journaledWorkload(MQueue& queue, int start) {
+    srand(start + 1);
+    for (int i = 0; i < 200; ++i) queue.insertOrder(generateRandomOrder(start + i));
+    for (int i = 0; i < 50; ++i) queue.getNextOrder();
+    vector<Order> orders;
+    for (int i = 0; i < 100; ++i) orders.push_back(generateRandomOrder(start + 200 + i));
+    queue.insertOrders(orders.begin(), orders.end());
+    MQueue other(priorityFn2, MINHEAP, queue.getStructure());
+    for (int i = 0; i < 30; ++i) other.insertOrder(generateRandomOrder(start + 300 + i));
+    queue.mergeWithQueue(other);
+    vector<Order> popped;
+    queue.getNextOrders(20, back_inserter(popped));
+}
+
+bool sameOrders(MQueue a, MQueue b) {
+    if (a.numOrders() != b.numOrders()) return false;
+    while (a.numOrders() > 0) {
+        Order order1 = a.getNextOrder(), order2 = b.getNextOrder();
+        if (order1.getCustomer() != order2.getCustomer() || order1.getFIFO() != order2.getFIFO()) return false;
+    }
+    return true;
+}
+
+bool Tester::testJournalRecovery() {
+    const char* path = "mytest_journal.log";
+    OrderJournal::registerPriorityFn("priorityFn1", priorityFn1);
+    OrderJournal::registerPriorityFn("priorityFn2", priorityFn2);
+    for (STRUCTURE structure : {SKEW, LEFTIST, DARY, PAIRING, BUCKET}) {
+        remove(path);
+        MQueue expected(priorityFn2, MINHEAP, structure);
+        journaledWorkload(expected, 0);
+        expected.setPriorityFn(priorityFn1, MAXHEAP);
+        {
+            // Crash: the queue goes away without a checkpoint
+            OrderJournal journal(path, 0);
+            MQueue queue(priorityFn2, MINHEAP, structure);
+            queue.setJournal(&journal);
+            journaledWorkload(queue, 0);
+            queue.setPriorityFn(priorityFn1, MAXHEAP);
+            queue.setJournal(nullptr);
+        }
+        MQueue recovered(priorityFn1, MINHEAP, SKEW);
+        recovered.recover("", path);
+        if (recovered.getStructure() != structure || recovered.getHeapType() != MAXHEAP) return false;
+        if (recovered.getPriorityFn() != priorityFn1 || !checkHeap(recovered)) return false;
+        if (!sameOrders(recovered, expected)) return false;
+    }
+    remove(path);
+    return true;
+}
+
+bool Tester::testJournalCheckpoint() {
+    const char* path = "mytest_journal.log";
+    const char* snapshot = "mytest_snapshot.bin";
+    remove(path);
+    MQueue expected(priorityFn2, MINHEAP, LEFTIST);
+    journaledWorkload(expected, 0);
+    journaledWorkload(expected, 1000);
+    {
+        OrderJournal journal(path, 5);
+        MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+        queue.setJournal(&journal);
+        journaledWorkload(queue, 0);
+        queue.checkpoint(snapshot);
+        journaledWorkload(queue, 1000);
+        queue.setJournal(nullptr);
+    }
+    MQueue recovered(priorityFn2, MINHEAP, LEFTIST);
+    recovered.recover(snapshot, path);
+    if (!sameOrders(recovered, expected)) return false;
+
+    // A torn entry at the end is dropped, and the journal stays usable
+    Order late = generateRandomOrder(5000);
+    {
+        ofstream out(path, ios::binary | ios::app);
+        out << "torn";
+    }
+    {
+        OrderJournal journal(path, 0);
+        recovered.setJournal(&journal);
+        recovered.insertOrder(late);
+        recovered.setJournal(nullptr);
+    }
+    expected.insertOrder(late);
+    MQueue again(priorityFn2, MINHEAP, LEFTIST);
+    again.recover(snapshot, path);
+    bool result = sameOrders(again, expected);
+    remove(path);
+    remove(snapshot);
+    return result;
+}
+
+bool Tester::testJournalErrors() {
+    const char* path = "mytest_journal.log";
+    remove(path);
+    OrderJournal journal(path, 0);
+    // Functions are journaled by name
+    MQueue unnamed([](const Order& order) {return order.getQuantity();}, MINHEAP, SKEW);
+    try {
+        unnamed.setJournal(&journal);
+        return false;
+    } catch (const domain_error&) {
+        if (unnamed.getJournal() != nullptr) return false;
+    }
+    // Handles, splits and snapshot loads cannot be replayed
+    MQueue queue(priorityFn2, MINHEAP, SKEW);
+    queue.setJournal(&journal);
+    OrderHandle handle;
+    queue.insertOrder(generateRandomOrder(1), handle);
+    try {
+        queue.cancelOrder(handle);
+        return false;
+    } catch (const domain_error&) {
+    }
+    try {
+        queue.splitQueue();
+        return false;
+    } catch (const domain_error&) {
+    }
+    try {
+        queue.recover("", path);
+        return false;
+    } catch (const domain_error&) {
+    }
+    queue.setJournal(nullptr);
+    remove(path);
+    // Not a journal
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        out << "this is not a journal file at all";
+    }
+    try {
+        OrderJournal other(path);
+        return false;
+    } catch (const runtime_error&) {
+    }
+    remove(path);
+    return true;
+}
+
+bool Tester::testJournalMoves() {
+    const char* path = "mytest_journal.log";
+    OrderJournal::registerPriorityFn("priorityFn2", priorityFn2);
+    remove(path);
+    MQueue expected(priorityFn2, MINHEAP, SKEW);
+    {
+        OrderJournal journal(path, 0);
+        MQueue queue(priorityFn2, MINHEAP, SKEW);
+        queue.setJournal(&journal);
+        journaledWorkload(queue, 0);
+        // The moves write nothing; the next insert records the state first
+        MQueue taken(std::move(queue));
+        if (!queue.m_journalStale || taken.getJournal() != nullptr) return false;
+        Order order = generateRandomOrder(1000);
+        queue.insertOrder(order);
+        expected.insertOrder(order);
+        MQueue midway(priorityFn2, MINHEAP, SKEW);
+        midway.recover("", path);
+        if (!sameOrders(midway, expected)) return false;
+        MQueue other(priorityFn2, MINHEAP, SKEW);
+        journaledWorkload(other, 2000);
+        queue = std::move(other);
+        expected.clear();
+        journaledWorkload(expected, 2000);
+        queue.getNextOrder();
+        expected.getNextOrder();
+        queue.setJournal(nullptr);
+    }
+    MQueue recovered(priorityFn2, MINHEAP, SKEW);
+    recovered.recover("", path);
+    if (!sameOrders(recovered, expected)) return false;
+
+    // A journal entry that cannot be written leaves the queue as it was:
+    // here the state a move left behind has an unregistered function
+    remove(path);
+    OrderJournal journal(path, 0);
+    MQueue queue(priorityFn2, MINHEAP, SKEW);
+    queue.setJournal(&journal);
+    MQueue unnamed([](const Order& order) {return order.getQuantity();}, MINHEAP, SKEW);
+    for (int i = 0; i < 10; ++i) unnamed.insertOrder(generateRandomOrder(i));
+    queue = std::move(unnamed);
+    Order order = generateRandomOrder(10), copy = order;
+    try {
+        queue.insertOrder(std::move(order));
+        return false;
+    } catch (const domain_error&) {
+        // The caller gets the moved order back
+        if (queue.numOrders() != 10 || order.getCustomer() != copy.getCustomer()) return false;
+    }
+    try {
+        queue.getNextOrder();
+        return false;
+    } catch (const domain_error&) {
+        if (queue.numOrders() != 10) return false;
+    }
+    vector<Order> popped;
+    try {
+        queue.getNextOrders(3, back_inserter(popped));
+        return false;
+    } catch (const domain_error&) {
+        if (queue.numOrders() != 10 || !popped.empty()) return false;
+    }
+    queue.setJournal(nullptr);
+    if (!checkHeap(queue)) return false;
+
+    // A merge is journaled in both queues or in neither
+    const char* otherPath = "mytest_journal2.log";
+    remove(otherPath);
+    MQueue merged(priorityFn2, MINHEAP, SKEW), part(priorityFn2, MINHEAP, SKEW);
+    merged.setJournal(&journal);
+    OrderJournal broken(otherPath, 0);
+    part.setJournal(&broken);
+    for (int i = 0; i < 10; ++i) {
+        merged.insertOrder(generateRandomOrder(i));
+        part.insertOrder(generateRandomOrder(10 + i));
+    }
+    broken.m_failed = true;
+    uint64_t seq = journal.lastSeq();
+    try {
+        merged.mergeWithQueue(part);
+        return false;
+    } catch (const runtime_error&) {
+    }
+    if (journal.lastSeq() != seq || merged.numOrders() != 10 || part.numOrders() != 10) return false;
+    merged.setJournal(nullptr);
+    part.setJournal(nullptr);
+    remove(path);
+    remove(otherPath);
+    return true;
+}
+
+// Pops both queues to the end; orders must match one for one
+bool samePops(PersistentMQueue persistent, MQueue queue) {
+    if (persistent.numOrders() != queue.numOrders()) return false;
+    while (queue.numOrders() > 0) {
+        Order order1 = persistent.getNextOrder(), order2 = queue.getNextOrder();
+        if (priorityFn2(order1) != priorityFn2(order2)) return false;
+    }
+    return persistent.numOrders() == 0;
+}
+
+bool Tester::testPersistentCopies() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 500; ++i) queue.insertOrder(generateRandomOrder(i));
+    PersistentMQueue original(queue);
+    if (!samePops(original, queue)) return false;
+    // A copy shares the root until one side changes
+    PersistentMQueue copy(original);
+    if (copy.m_heap != original.m_heap || original.m_heap->m_refs != 2) return false;
+    MQueue changed(queue);
+    for (int i = 0; i < 100; ++i) {
+        Order order = generateRandomOrder(1000 + i);
+        copy.insertOrder(order);
+        changed.insertOrder(order);
+        if (i % 3 == 0) {
+            copy.getNextOrder();
+            changed.getNextOrder();
+        }
+    }
+    if (!samePops(copy, changed) || !samePops(original, queue)) return false;
+    // Copies of copies, each changed a little, then dropped in any order
+    vector<PersistentMQueue> copies(10, original);
+    for (int i = 0; i < 10; ++i) {
+        for (int j = 0; j <= i; ++j) copies[i].getNextOrder();
+        if (copies[i].numOrders() != 500 - i - 1) return false;
+    }
+    copies.erase(copies.begin() + 3, copies.begin() + 7);
+    original.clear();
+    for (int i = 0; i < 3; ++i) {
+        MQueue expected(queue);
+        for (int j = 0; j <= i; ++j) expected.getNextOrder();
+        if (!samePops(copies[i], expected)) return false;
+    }
+    try {
+        original.getNextOrder();
+        return false;
+    } catch (const out_of_range&) {
+        return true;
+    }
+}
+
+bool Tester::testPersistentMergeAndRebuild() {
+    vector<Order> orders1, orders2;
+    for (int i = 0; i < 300; ++i) orders1.push_back(generateRandomOrder(i));
+    for (int i = 0; i < 200; ++i) orders2.push_back(generateRandomOrder(300 + i));
+    PersistentMQueue queue1(orders1.begin(), orders1.end(), priorityFn2, MINHEAP);
+    PersistentMQueue queue2(orders2.begin(), orders2.end(), priorityFn2, MINHEAP);
+    MQueue expected(orders1.begin(), orders1.end(), priorityFn2, MINHEAP, LEFTIST);
+    MQueue part(orders2.begin(), orders2.end(), priorityFn2, MINHEAP, LEFTIST);
+    expected.mergeWithQueue(part);
+    // rhs keeps its orders
+    queue1.mergeWithQueue(queue2);
+    if (queue2.numOrders() != 200 || !samePops(queue1, expected)) return false;
+    // Merging with itself doubles every order
+    PersistentMQueue doubled(queue2);
+    doubled.mergeWithQueue(doubled);
+    MQueue twice(orders2.begin(), orders2.end(), priorityFn2, MINHEAP, LEFTIST);
+    MQueue again(orders2.begin(), orders2.end(), priorityFn2, MINHEAP, LEFTIST);
+    twice.mergeWithQueue(again);
+    if (!samePops(doubled, twice)) return false;
+    // A rebuild under another priority function leaves copies alone
+    PersistentMQueue rebuilt(queue1);
+    rebuilt.setPriorityFn(priorityFn1, MAXHEAP);
+    if (rebuilt.numOrders() != 500 || !samePops(queue1, expected)) return false;
+    int last = INT_MAX;
+    while (rebuilt.numOrders() > 0) {
+        int priority = priorityFn1(rebuilt.getNextOrder());
+        if (priority > last) return false;
+        last = priority;
+    }
+    try {
+        queue1.mergeWithQueue(rebuilt);
+        return false;
+    } catch (const domain_error&) {
+        return true;
+    }
+}
+
+// Pops the whole queue; keys must come out in heap order and, within one
+// bucketed key, in insertion order (customer "Customer<i>" was inserted
+// i-th). The overflow heap, like any tree, does not keep that order.
+bool popsInFifoOrder(MQueue& queue, bool fifo = true) {
+    pair<int, int> range = queue.getBucketRange();
+    int lastKey = -1, lastId = -1;
+    while (queue.numOrders() > 0) {
+        Order order = queue.getNextOrder();
+        int key = queue.getPriorityFn()(order);
+        int id = stoi(order.getCustomer().substr(8));
+        if (lastKey >= 0) {
+            bool before = queue.getHeapType() == MINHEAP ? key < lastKey : key > lastKey;
+            bool bucketed = key >= range.first && key <= range.second;
+            if (before || (fifo && bucketed && key == lastKey && id < lastId)) return false;
+        }
+        lastKey = key;
+        lastId = id;
+    }
+    return true;
+}
+
+bool Tester::testBucketQueue() {
+    for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+        // priorityFn2 gives 4 to 86; the range leaves both ends to the
+        // overflow heap
+        MQueue queue(priorityFn2, heapType, BUCKET);
+        queue.setBucketRange(20, 60);
+        MQueue tree(priorityFn2, heapType, LEFTIST);
+        for (int i = 0; i < 2000; ++i) {
+            Order order = generateRandomOrder(i);
+            queue.insertOrder(order);
+            tree.insertOrder(order);
+        }
+        if (!checkHeap(queue) || queue.m_heap == nullptr) return false;
+        // Peeks and the priority walks see the same orders as a tree
+        if (queue.getTopPriority() != tree.getTopPriority()) return false;
+        vector<Order> top = queue.peekTopK(300);
+        for (int i = 0; i < 300; ++i) {
+            if (priorityFn2(top[i]) != priorityFn2(tree.peekTopK(300)[i])) return false;
+        }
+        int inRange = 0, expected = 0;
+        queue.forEachInPriorityRange(10, 30, [&](const Order&) {++inRange;});
+        tree.forEachInPriorityRange(10, 30, [&](const Order&) {++expected;});
+        if (inRange != expected || distance(queue.begin(), queue.end()) != 2000) return false;
+        // Changing the range rebuilds; orders that were already bucketed
+        // keep their FIFO order
+        MQueue copy(queue);
+        copy.setBucketRange(0, 100);
+        if (!checkHeap(copy) || copy.m_heap != nullptr) return false;
+        copy.setBucketRange(20, 60);
+        if (!popsInFifoOrder(copy)) return false;
+        copy = queue;
+        copy.setStructure(SKEW);
+        copy.setStructure(BUCKET);
+        if (!checkHeap(copy) || !popsInFifoOrder(copy, false)) return false;
+        for (int i = 0; i < 1000; ++i) {
+            if (priorityFn2(queue.getNextOrder()) != priorityFn2(tree.getNextOrder())) return false;
+            if (i % 100 == 0 && !checkHeap(queue)) return false;
+        }
+        if (!popsInFifoOrder(queue) || queue.numOrders() != 0) return false;
+        // Handles need a tree
+        OrderHandle handle;
+        queue.insertOrder(generateRandomOrder(0), handle);
+        try {
+            queue.cancelOrder(handle);
+            return false;
+        } catch (const domain_error&) {
+        }
+    }
+    MQueue queue(priorityFn1, MAXHEAP, BUCKET);
+    try {
+        queue.setBucketRange(10, 9);
+        return false;
+    } catch (const out_of_range&) {
+    }
+    queue.setBucketRange(1101, 10400);
+    for (int i = 0; i < 500; ++i) queue.insertOrder(generateRandomOrder(i));
+    return checkHeap(queue) && popsInFifoOrder(queue);
+}
+
+// Most keys fall outside a narrow range, so the overflow heap's shape
+// decides which of the tied orders a replayed pop removes
+bool Tester::testBucketRecovery() {
+    const char* path = "mytest_journal.log";
+    const char* snapshot = "mytest_snapshot.bin";
+    OrderJournal::registerPriorityFn("priorityFn2", priorityFn2);
+    remove(path);
+    MQueue live(priorityFn2, MINHEAP, BUCKET);
+    live.setBucketRange(1, 10);
+    {
+        OrderJournal journal(path, 50);
+        live.setJournal(&journal);
+        for (int i = 0; i < 20000; ++i) live.insertOrder(generateRandomOrder(i));
+        live.checkpoint(snapshot);
+        for (int i = 0; i < 5000; ++i) live.getNextOrder();
+        MQueue part(priorityFn2, MINHEAP, BUCKET);
+        part.setBucketRange(1, 10);
+        for (int i = 0; i < 3000; ++i) part.insertOrder(generateRandomOrder(20000 + i));
+        live.mergeWithQueue(part);
+        for (int i = 0; i < 2000; ++i) live.getNextOrder();
+        live.setJournal(nullptr);
+    }
+    MQueue recovered(priorityFn2, MINHEAP, SKEW);
+    recovered.recover(snapshot, path);
+    if (recovered.getStructure() != BUCKET || !checkHeap(recovered)) return false;
+    if (!sameOrders(recovered, live)) return false;
+
+    // A partial load takes the best orders from the buckets and the heap
+    live.saveSnapshot(snapshot);
+    MQueue top(priorityFn2, MINHEAP, SKEW);
+    top.loadSnapshot(snapshot, 1000);
+    MQueue rest(live);
+    if (top.numOrders() != 1000 || !checkHeap(top)) return false;
+    while (top.numOrders() > 0) {
+        if (priorityFn2(top.getNextOrder()) != priorityFn2(rest.getNextOrder())) return false;
+    }
+    remove(path);
+    remove(snapshot);
+    return true;
+}
+
+bool Tester::testBucketMergeSplitAndSnapshot() {
+    const char* path = "mytest_snapshot.bin";
+    MQueue queue1(priorityFn2, MINHEAP, BUCKET), queue2(priorityFn2, MINHEAP, BUCKET);
+    queue1.setBucketRange(10, 50);
+    queue2.setBucketRange(10, 50);
+    for (int i = 0; i < 1000; ++i) (i < 600 ? queue1 : queue2).insertOrder(generateRandomOrder(i));
+    // Same slots: lists are spliced, and queue1's orders stay ahead of
+    // queue2's within a key
+    queue1.mergeWithQueue(queue2);
+    if (queue1.numOrders() != 1000 || queue2.numOrders() != 0 || !checkHeap(queue1) || !checkHeap(queue2)) {
+        return false;
+    }
+    // Different slots: nodes are pushed one by one
+    MQueue queue3(priorityFn2, MINHEAP, BUCKET);
+    for (int i = 0; i < 300; ++i) queue3.insertOrder(generateRandomOrder(1000 + i));
+    queue1.mergeWithQueue(queue3);
+    if (queue1.numOrders() != 1300 || !checkHeap(queue1)) return false;
+    MQueue copy(queue1);
+    if (!popsInFifoOrder(copy)) return false;
+
+    // A split takes the worse half of the bucketed orders
+    MQueue part = queue1.splitQueue();
+    if (part.numOrders() == 0 || part.numOrders() + queue1.numOrders() != 1300) return false;
+    if (!checkHeap(part) || !checkHeap(queue1)) return false;
+    if (part.getTopPriority() < queue1.getTopPriority()) return false;
+    queue1.mergeWithQueue(part);
+
+    // Snapshots keep the range and the FIFO order; a partial load takes
+    // the best orders
+    queue1.saveSnapshot(path);
+    MQueue loaded(priorityFn2, MAXHEAP, SKEW);
+    loaded.loadSnapshot(path);
+    if (loaded.getStructure() != BUCKET || loaded.getBucketRange() != make_pair(10, 50)) return false;
+    if (loaded.numOrders() != 1300 || !checkHeap(loaded)) return false;
+    MQueue top(priorityFn2, MINHEAP, SKEW);
+    top.loadSnapshot(path, 100);
+    remove(path);
+    if (top.numOrders() != 100 || !checkHeap(top)) return false;
+    // Equal keys in the overflow heap may come out in any order, so the
+    // comparisons are by priority
+    for (int i = 0; i < 100; ++i) {
+        if (priorityFn2(top.getNextOrder()) != priorityFn2(loaded.getNextOrder())) return false;
+    }
+    MQueue expected(queue1);
+    for (int i = 0; i < 100; ++i) expected.getNextOrder();
+    MQueue remaining(loaded);
+    while (expected.numOrders() > 0) {
+        if (priorityFn2(expected.getNextOrder()) != priorityFn2(remaining.getNextOrder())) return false;
+    }
+    return popsInFifoOrder(loaded);
+}
+
+// The counters follow the operations when MQUEUE_STATS is compiled in; the
+// shape of the tree is reported either way
+bool Tester::testStats() {
+    MQueue queue(priorityFn2, MINHEAP, LEFTIST);
+    for (int i = 0; i < 1000; ++i) queue.insertOrder(generateRandomOrder(i));
+    MQueueStats stats = queue.getStats();
+    // Every node is counted once by NPL, and the right spine of a leftist
+    // root is one longer than the root's NPL
+    uint64_t nodes = 0;
+    for (uint64_t count : stats.nplCounts) nodes += count;
+    if (nodes != 1000 || stats.rightSpine != queue.m_heap->getNPL() + 1) return false;
+    MQueue skew(queue);
+    skew.setStructure(SKEW);
+    nodes = 0;
+    for (uint64_t count : skew.getStats().nplCounts) nodes += count;
+    if (nodes != 1000) return false;
+
+    Histogram histogram;
+    for (uint64_t value : {0, 1, 2, 3, 1000}) histogram.record(value);
+    if (histogram.count() != 5 || histogram.sum() != 1006 || histogram.max() != 1000) return false;
+    if (histogram.percentile(0.5) != 3 || histogram.percentile(1.0) != 1000) return false;
+#ifdef MQUEUE_STATS
+    if (!stats.enabled || stats.priorityCalls != 1000 || stats.nodeAllocs != 1000 || stats.nodeFrees != 0)
+        return false;
+    // Every insert but the first merges into a non-empty heap
+    if (stats.insertNs.count() != 1000 || stats.mergeDepth.count() != 999) return false;
+    for (int i = 0; i < 100; ++i) queue.getNextOrder();
+    queue.setPriorityFn(priorityFn1, MAXHEAP);
+    MQueue other(priorityFn1, MAXHEAP, LEFTIST);
+    for (int i = 0; i < 10; ++i) other.insertOrder(generateRandomOrder(i));
+    queue.mergeWithQueue(other);
+    stats = queue.getStats();
+    if (stats.popNs.count() != 100 || stats.nodeFrees != 100) return false;
+    if (stats.rebuildNs.count() != 1 || stats.priorityCalls != 1900 || stats.mergeNs.count() != 1) return false;
+    // A copy counts only its own allocations
+    MQueue copy(queue);
+    if (copy.getStats().nodeAllocs != 910 || copy.getStats().priorityCalls != 0) return false;
+    string json = stats.toJson();
+    if (json.find("\"enabled\": true") == string::npos || json.find("\"popNs\": {\"count\": 100") == string::npos)
+        return false;
+    queue.resetStats();
+    return queue.getStats().priorityCalls == 0 && queue.getStats().popNs.count() == 0;
+#else
+    return !stats.enabled && stats.priorityCalls == 0 && stats.insertNs.count() == 0;
+#endif
+}
+
+bool Tester::testBlockingMQueue() {
+    BlockingMQueue queue(priorityFn2, MINHEAP, LEFTIST, 10);
+    Order order;
+    if (queue.tryGetNextOrder(order) || queue.waitNextOrder(order, chrono::milliseconds(5))) return false;
+    // A consumer thread sleeps until the producer's orders arrive, and the
+    // producer blocks whenever 10 orders are waiting
+    vector<Order> orders;
+    for (int i = 0; i < 2000; ++i) orders.push_back(generateRandomOrder(i));
+    vector<int> keys;
+    thread consumer([&] {
+        for (size_t i = 0; i < orders.size(); ++i) keys.push_back(priorityFn2(queue.waitNextOrder()));
+    });
+    for (const Order& next : orders) {
+        if (!queue.insertOrder(next) || queue.numOrders() > 10) return false;
+    }
+    consumer.join();
+    vector<int> expected;
+    for (const Order& next : orders) expected.push_back(priorityFn2(next));
+    sort(expected.begin(), expected.end());
+    sort(keys.begin(), keys.end());
+    if (keys != expected || queue.numOrders() != 0) return false;
+
+    // A full queue times out, and close() releases a blocked producer and a
+    // blocked consumer
+    for (int i = 0; i < 10; ++i) queue.insertOrder(orders[i]);
+    if (queue.insertOrder(orders[10], chrono::milliseconds(5))) return false;
+    bool inserted = true;
+    thread producer([&] {inserted = queue.insertOrder(orders[10]);});
+    this_thread::sleep_for(chrono::milliseconds(5));
+    queue.close();
+    producer.join();
+    if (inserted || queue.insertOrder(orders[11])) return false;
+    // The orders left are still handed out after close
+    for (int i = 0; i < 10; ++i) queue.waitNextOrder();
+    try {
+        queue.waitNextOrder();
+        return false;
+    } catch (const out_of_range&) {
+    }
+    BlockingMQueue idle(priorityFn2, MINHEAP, SKEW);
+    bool failed = false;
+    thread waiter([&] {
+        try {
+            idle.waitNextOrder();
+        } catch (const out_of_range&) {
+            failed = true;
+        }
+    });
+    this_thread::sleep_for(chrono::milliseconds(5));
+    idle.close();
+    waiter.join();
+    return failed && idle.isClosed();
+}
+
+bool Tester::testBlockingMQueueCoroutines() {
+#ifdef BLOCKINGMQUEUE_COROUTINES
+    BlockingMQueue queue(priorityFn2, MINHEAP, SKEW, 2);
+    vector<Order> orders;
+    for (int i = 0; i < 50; ++i) orders.push_back(generateRandomOrder(i));
+    // The producer suspends once two orders wait, and each pop of the
+    // consumer resumes it; the consumer then suspends on the empty queue
+    int inserted = 0;
+    vector<int> keys;
+    produceOrders(queue, orders, inserted);
+    if (inserted != 2 || queue.m_producers.size() != 1) return false;
+    consumeOrders(queue, keys);
+    if (inserted != 50 || keys.size() != 50 || queue.m_consumers.size() != 1) return false;
+    vector<int> expected;
+    for (const Order& order : orders) expected.push_back(priorityFn2(order));
+    sort(expected.begin(), expected.end());
+    sort(keys.begin(), keys.end());
+    if (keys != expected) return false;
+    // An order from another thread goes straight to the suspended consumer,
+    // which runs on that thread
+    thread producer([&] {queue.insertOrder(orders[0]);});
+    producer.join();
+    if (keys.size() != 51 || queue.numOrders() != 0) return false;
+    queue.close();
+    return queue.m_consumers.empty();
+#else
+    return true;    // built without C++20 coroutines
+#endif
+}
+
+// Every pair is ordered and lies within its parent pair, and the cached
+// keys match the priority function
+bool Tester::checkIntervalHeap(const BoundedMQueue& queue) {
+    const vector<BoundedMQueue::Entry>& slots = queue.m_slots;
+    for (size_t slot = 0; slot < slots.size(); ++slot) {
+        if (slots[slot].key != queue.m_priorFunc(slots[slot].order)) return false;
+        if (slot % 2 == 1 && slots[slot - 1].key > slots[slot].key) return false;
+        if (slot < 2) continue;
+        size_t parent = 2 * ((slot / 2 - 1) / 2);
+        if (slots[slot].key < slots[parent].key || slots[slot].key > slots[parent + 1].key) return false;
+    }
+    return (int)slots.size() <= queue.m_capacity;
+}
+
+// Random inserts, pops and evictions against a sorted list of keys
+bool Tester::testBoundedMQueue() {
+    for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+        prifn_t fn = heapType == MINHEAP ? priorityFn2 : priorityFn1;
+        BoundedMQueue queue(fn, heapType, 100000);
+        vector<int> keys;
+        for (int i = 0; i < 20000; ++i) {
+            int op = rand() % 4;
+            if (op < 2 || keys.empty()) {
+                Order order = generateRandomOrder(i);
+                if (queue.insertOrder(order) != INSERTED) return false;
+                keys.insert(upper_bound(keys.begin(), keys.end(), fn(order)), fn(order));
+            } else {
+                // keys is ascending: the best is at the front for MINHEAP
+                bool best = op == 2;
+                int expected = (best == (heapType == MINHEAP)) ? keys.front() : keys.back();
+                int peeked = fn(best ? queue.peekNextOrder() : queue.peekWorstOrder());
+                int key = fn(best ? queue.getNextOrder() : queue.evictWorstOrder());
+                if (key != expected || peeked != expected) return false;
+                if (expected == keys.front()) keys.erase(keys.begin());
+                else keys.pop_back();
+            }
+            if (i % 1000 == 0 && !checkIntervalHeap(queue)) return false;
+        }
+        if (queue.numOrders() != (int)keys.size() || !checkIntervalHeap(queue)) return false;
+        // Draining from the best end yields the keys in priority order
+        if (heapType == MAXHEAP) reverse(keys.begin(), keys.end());
+        for (int key : keys) {
+            if (fn(queue.getNextOrder()) != key) return false;
+        }
+        try {
+            queue.evictWorstOrder();
+            return false;
+        } catch (const out_of_range&) {
+        }
+    }
+    return true;
+}
+
+// EVICTWORST keeps the best capacity orders of everything offered, and
+// REJECTNEW the first capacity orders
+bool Tester::testBoundedMQueueCapacity() {
+    for (HEAPTYPE heapType : {MINHEAP, MAXHEAP}) {
+        prifn_t fn = heapType == MINHEAP ? priorityFn2 : priorityFn1;
+        BoundedMQueue evicting(fn, heapType);
+        BoundedMQueue rejecting(fn, heapType, DEFAULTCAPACITY, REJECTNEW);
+        vector<int> offered, evicted;
+        for (int i = 0; i < 1000; ++i) {
+            Order order = generateRandomOrder(i);
+            offered.push_back(fn(order));
+            Order worst;
+            INSERTRESULT result = evicting.insertOrder(order, &worst);
+            if (result == EVICTEDWORST) evicted.push_back(fn(worst));
+            // A full queue only gives way to a strictly better order
+            if (result == REJECTED && i < DEFAULTCAPACITY) return false;
+            if ((rejecting.insertOrder(order) == INSERTED) != (i < DEFAULTCAPACITY)) return false;
+        }
+        if (evicting.numOrders() != DEFAULTCAPACITY || !checkIntervalHeap(evicting)) return false;
+        if (rejecting.numOrders() != DEFAULTCAPACITY || !checkIntervalHeap(rejecting)) return false;
+        if (heapType == MINHEAP) sort(offered.begin(), offered.end());
+        else sort(offered.begin(), offered.end(), greater<int>());
+        for (int i = 0; i < DEFAULTCAPACITY; ++i) {
+            if (fn(evicting.getNextOrder()) != offered[i]) return false;
+        }
+        // Every evicted order ranks no better than the kept ones
+        for (int key : evicted) {
+            if (heapType == MINHEAP ? key < offered[DEFAULTCAPACITY - 1] : key > offered[DEFAULTCAPACITY - 1])
+                return false;
+        }
+    }
+    return true;
+}
+
+bool Tester::testParallelRebuild() {
+    vector<Order> orders;
+    for (int i = 0; i < PARALLELREBUILDMIN + 1000; ++i) {
+        orders.push_back(generateRandomOrder(i));
+    }
+    // Turns some orders away, so the rebuild has nodes to free
+    prifn_t picky = [](const Order& order) {
+        return order.getFIFO() % 7 == 0 ? -1 : priorityFn1(order);
+    };
+    STRUCTURE structures[] = {SKEW, LEFTIST, DARY, PAIRING, BUCKET};
+    for (int s = 0; s < 5; ++s) {
+        // The serial queue is the reference for the parallel one
+        MQueue serial(priorityFn2, MINHEAP, structures[s], POOLALLOC);
+        MQueue parallel(priorityFn2, MINHEAP, structures[s], POOLALLOC);
+        parallel.setRebuildThreads(3);
+        for (const Order& order : orders) {
+            serial.insertOrder(order);
+            parallel.insertOrder(order);
+        }
+        serial.setPriorityFn(picky, MAXHEAP);
+        parallel.setPriorityFn(picky, MAXHEAP);
+        if (parallel.numOrders() != serial.numOrders() || !checkHeap(parallel)) return false;
+        if (parallel.numOrders() == (int)orders.size()) return false;
+        serial.setStructure(structures[(s + 1) % 5]);
+        parallel.setStructure(structures[(s + 1) % 5]);
+        if (parallel.numOrders() != serial.numOrders() || !checkHeap(parallel)) return false;
+        while (serial.numOrders() > 0) {
+            if (picky(serial.getNextOrder()) != picky(parallel.getNextOrder())) return false;
+        }
+        if (parallel.numOrders() != 0) return false;
+    }
+    MQueue queue(priorityFn2, MINHEAP, SKEW);
+    try {
+        queue.setRebuildThreads(0);
+        return false;
+    } catch (const out_of_range&) {
+    }
+    return queue.getRebuildThreads() == 1;
+}
+
+bool Tester::testReclaimer() {
+    Reclaimer reclaimer;
+    for (ALLOCATION allocation : {GLOBALALLOC, POOLALLOC}) {
+        MQueue queue(priorityFn2, MINHEAP, SKEW, allocation);
+        queue.setReclaimer(&reclaimer);
+        for (int i = 0; i < 5000; ++i) {
+            queue.insertOrder(generateRandomOrder(i));
+        }
+        MQueue copy(queue);
+        if (copy.getReclaimer() != nullptr) return false;
+        // clear() leaves a working queue with a pool of its own
+        queue.clear();
+        if (queue.numOrders() != 0 || queue.m_heap != nullptr) return false;
+        if ((queue.getAllocation() == POOLALLOC) != (allocation == POOLALLOC)) return false;
+        for (int i = 0; i < 100; ++i) {
+            queue.insertOrder(generateRandomOrder(i));
+        }
+        if (!checkHeap(queue)) return false;
+        // Assignment retires the old contents too
+        queue = copy;
+        if (queue.numOrders() != 5000 || queue.getReclaimer() != &reclaimer) return false;
+        int lastPriority = INT_MIN;
+        while (queue.numOrders() > 0) {
+            int priority = priorityFn2(queue.getNextOrder());
+            if (priority < lastPriority) return false;
+            lastPriority = priority;
+        }
+        queue = copy;
+    }
+    reclaimer.flush();
+    if (reclaimer.pendingOrders() != 0 || reclaimer.peakPendingOrders() < 5000) return false;
+    reclaimer.resetPeak();
+    if (reclaimer.peakPendingOrders() != 0) return false;
+    // The destructor retires as well, and a closing reclaimer frees what
+    // is still pending
+    {
+        Reclaimer local;
+        MQueue queue(priorityFn1, MAXHEAP, BUCKET, POOLALLOC);
+        queue.setReclaimer(&local);
+        for (int i = 0; i < 5000; ++i) {
+            queue.insertOrder(generateRandomOrder(i));
+        }
+        MQueue moved(std::move(queue));
+        if (moved.getReclaimer() != nullptr || queue.numOrders() != 0) return false;
+        queue = std::move(moved);
+    }
+    return true;
+}
+
+bool Tester::testParallelRebuildRecovery() {
+    const char* path = "mytest_journal.log";
+    OrderJournal::registerPriorityFn("priorityFn1", priorityFn1);
+    OrderJournal::registerPriorityFn("priorityFn2", priorityFn2);
+    for (STRUCTURE structure : {SKEW, PAIRING}) {
+        remove(path);
+        MQueue live(priorityFn2, MINHEAP, structure);
+        live.setRebuildThreads(4);
+        {
+            OrderJournal journal(path, 50);
+            live.setJournal(&journal);
+            for (int i = 0; i < PARALLELREBUILDMIN + 1000; ++i) {
+                live.insertOrder(generateRandomOrder(i));
+            }
+            live.setPriorityFn(priorityFn1, MAXHEAP);
+            live.setStructure(LEFTIST);
+            for (int i = 0; i < 1000; ++i) live.getNextOrder();
+            live.setJournal(nullptr);
+        }
+        // Replayed on one thread, the rebuilds must give the same ties
+        MQueue recovered(priorityFn2, MINHEAP, SKEW);
+        recovered.recover("", path);
+        if (recovered.getRebuildThreads() != 1 || !sameOrders(recovered, live)) return false;
+    }
+    remove(path);
+    return true;
+}
@@ -0,0 +1,142 @@
+#ifndef NODEPOOL_H
+#define NODEPOOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+//
+// NodePool class
+//
+// A slab allocator with an intrusive free list for fixed-size objects.
+// Storage is carved from slabs of SLABSIZE slots; freed slots go on a
+// free list and are reused before the next slab is touched. release()
+// hands every slab back at once, so the owner can drop a whole tree
+// without freeing it node by node.
+//
+// Released slabs are kept in a small per-thread cache and reused by the
+// next pool created on that thread. A worker can therefore create and
+// destroy pool-backed queues without going back to the allocator. The
+// cache is only used when every Alloc instance is interchangeable.
+//
+template <class T, class Alloc = std::allocator<T> >
+class NodePool {
+public:
+    static const std::size_t SLABSIZE = 1024;    // slots per slab
+    static const std::size_t MAXCACHED = 64;     // slabs kept per thread
+
+    explicit NodePool(const Alloc& alloc = Alloc())
+        : m_alloc(alloc), m_slabs(nullptr), m_free(nullptr),
+          m_next(nullptr), m_end(nullptr), m_numSlabs(0) {}
+    ~NodePool() {release();}
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    // Returns uninitialized storage for one T
+    void* allocate() {
+        if (m_free) {
+            Slot* slot = m_free;
+            m_free = slot->next;
+            return slot;
+        }
+        if (m_next == m_end) addSlab();
+        return m_next++;
+    }
+    // Returns storage to the free list; the object must already be destroyed
+    void deallocate(void* ptr) {
+        Slot* slot = static_cast<Slot*>(ptr);
+        slot->next = m_free;
+        m_free = slot;
+    }
+    // Returns every slab; all objects in the pool must already be destroyed
+    void release() {
+        while (m_slabs) {
+            Slab* next = m_slabs->next;
+            freeSlab(m_slabs);
+            m_slabs = next;
+        }
+        m_free = m_next = m_end = nullptr;
+        m_numSlabs = 0;
+    }
+    // Takes over all slabs of rhs, which is left empty. Live objects of rhs
+    // become owned by this pool, so two queues can merge their trees.
+    void splice(NodePool& rhs) {
+        if (this == &rhs || !rhs.m_slabs) return;
+        // The unused tail of rhs's current slab goes on our free list
+        for (Slot* slot = rhs.m_next; slot != rhs.m_end; ++slot) deallocate(slot);
+        while (rhs.m_free) {
+            Slot* slot = rhs.m_free;
+            rhs.m_free = slot->next;
+            deallocate(slot);
+        }
+        Slab* last = rhs.m_slabs;
+        while (last->next) last = last->next;
+        last->next = m_slabs;
+        m_slabs = rhs.m_slabs;
+        m_numSlabs += rhs.m_numSlabs;
+        rhs.m_slabs = nullptr;
+        rhs.m_next = rhs.m_end = nullptr;
+        rhs.m_numSlabs = 0;
+    }
+    std::size_t numSlabs() const {return m_numSlabs;}
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    struct Slab {
+        Slab* next;
+        Slot slots[SLABSIZE];
+    };
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Slab> SlabAlloc;
+    typedef std::allocator_traits<SlabAlloc> SlabTraits;
+
+    // Per-thread list of released slabs, freed when the thread exits
+    struct SlabCache {
+        std::vector<Slab*> slabs;
+        ~SlabCache() {
+            SlabAlloc alloc;
+            for (Slab* slab : slabs) SlabTraits::deallocate(alloc, slab, 1);
+        }
+    };
+    static SlabCache& threadCache() {
+        static thread_local SlabCache cache;
+        return cache;
+    }
+    static const bool CACHEABLE = std::allocator_traits<Alloc>::is_always_equal::value;
+
+    void addSlab() {
+        Slab* slab = nullptr;
+        if (CACHEABLE && !threadCache().slabs.empty()) {
+            slab = threadCache().slabs.back();
+            threadCache().slabs.pop_back();
+        } else {
+            SlabAlloc alloc(m_alloc);
+            slab = SlabTraits::allocate(alloc, 1);
+        }
+        slab->next = m_slabs;
+        m_slabs = slab;
+        m_next = slab->slots;
+        m_end = slab->slots + SLABSIZE;
+        ++m_numSlabs;
+    }
+    void freeSlab(Slab* slab) {
+        if (CACHEABLE && threadCache().slabs.size() < MAXCACHED) {
+            threadCache().slabs.push_back(slab);
+        } else {
+            SlabAlloc alloc(m_alloc);
+            SlabTraits::deallocate(alloc, slab, 1);
+        }
+    }
+
+    Alloc m_alloc;
+    Slab* m_slabs;          // all slabs owned by the pool
+    Slot* m_free;           // freed slots, reused first
+    Slot* m_next;           // next never-used slot in the newest slab
+    Slot* m_end;            // end of the newest slab
+    std::size_t m_numSlabs; // number of slabs in m_slabs
+};
+
+#endif
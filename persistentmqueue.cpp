@@ -0,0 +1,205 @@
+#include "persistentmqueue.h"
+#include <stdexcept>
+#include <utility>
+
+PersistentMQueue::PersistentMQueue(const MQueue& queue)
+    : PersistentMQueue(queue.begin(), queue.end(), queue.getPriorityFn(), queue.getHeapType()) {}
+
+PersistentMQueue::~PersistentMQueue() {
+    release(m_heap);
+}
+
+PersistentMQueue::PersistentMQueue(const PersistentMQueue& rhs)
+    : m_heap(retain(rhs.m_heap)), m_size(rhs.m_size), m_priorFunc(rhs.m_priorFunc),
+      m_heapType(rhs.m_heapType) {}
+
+PersistentMQueue& PersistentMQueue::operator=(const PersistentMQueue& rhs) {
+    // Retaining first keeps self-assignment safe
+    Node* heap = retain(rhs.m_heap);
+    release(m_heap);
+    m_heap = heap;
+    m_size = rhs.m_size;
+    m_priorFunc = rhs.m_priorFunc;
+    m_heapType = rhs.m_heapType;
+    return *this;
+}
+
+PersistentMQueue::PersistentMQueue(PersistentMQueue&& rhs) noexcept
+    : m_heap(rhs.m_heap), m_size(rhs.m_size), m_priorFunc(rhs.m_priorFunc),
+      m_heapType(rhs.m_heapType) {
+    rhs.m_heap = nullptr;
+    rhs.m_size = 0;
+}
+
+PersistentMQueue& PersistentMQueue::operator=(PersistentMQueue&& rhs) noexcept {
+    if (this != &rhs) {
+        release(m_heap);
+        m_heap = rhs.m_heap;
+        m_size = rhs.m_size;
+        m_priorFunc = rhs.m_priorFunc;
+        m_heapType = rhs.m_heapType;
+        rhs.m_heap = nullptr;
+        rhs.m_size = 0;
+    }
+    return *this;
+}
+
+void PersistentMQueue::clear() {
+    release(m_heap);
+    m_heap = nullptr;
+    m_size = 0;
+}
+
+bool PersistentMQueue::insertOrder(const Order& order) {
+    int key = m_priorFunc(order);
+    if (key < 0) return false;
+    m_heap = merge(m_heap, new Node(order, key));
+    ++m_size;
+    return true;
+}
+
+// The root's children are merged into the new heap. A root shared with
+// another copy stays as it is, so its children gain a reference instead.
+Order PersistentMQueue::getNextOrder() {
+    if (m_size == 0) throw std::out_of_range("Queue is empty");
+    Node* root = m_heap;
+    Order order = root->m_order;
+    Node* left;
+    Node* right;
+    if (root->m_refs.load(std::memory_order_acquire) == 1) {
+        left = root->m_left;
+        right = root->m_right;
+        delete root;
+    } else {
+        left = retain(root->m_left);
+        right = retain(root->m_right);
+        release(root);
+    }
+    m_heap = merge(left, right);
+    --m_size;
+    return order;
+}
+
+const Order& PersistentMQueue::peekNextOrder() const {
+    if (m_size == 0) throw std::out_of_range("Queue is empty");
+    return m_heap->m_order;
+}
+
+void PersistentMQueue::mergeWithQueue(const PersistentMQueue& rhs) {
+    if (m_priorFunc != rhs.m_priorFunc || m_heapType != rhs.m_heapType)
+        throw std::domain_error("Queues must have the same priority function and heap type.");
+    // With rhs == *this every node ends up shared by both sides of the
+    // merge, which path copying handles like any other sharing
+    int size = rhs.m_size;
+    m_heap = merge(m_heap, retain(rhs.m_heap));
+    m_size += size;
+}
+
+// Copies every order into a fresh node, then releases the old heap. A
+// subtree the heap refers to twice, as after merging a queue with its own
+// copy, is walked once per reference: each reference holds orders of its
+// own, so both count.
+void PersistentMQueue::setPriorityFn(prifn_t priFn, HEAPTYPE heapType) {
+    std::vector<Node*> nodes;
+    std::vector<const Node*> pending;
+    if (m_heap) pending.push_back(m_heap);
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        int key = priFn(node->m_order);
+        if (key >= 0) nodes.push_back(new Node(node->m_order, key));
+        if (node->m_left) pending.push_back(node->m_left);
+        if (node->m_right) pending.push_back(node->m_right);
+    }
+    release(m_heap);
+    m_priorFunc = priFn;
+    m_heapType = heapType;
+    m_size = (int)nodes.size();
+    m_heap = heapify(nodes);
+}
+
+int PersistentMQueue::numOrders() const {
+    return m_size;
+}
+
+prifn_t PersistentMQueue::getPriorityFn() const {
+    return m_priorFunc;
+}
+
+HEAPTYPE PersistentMQueue::getHeapType() const {
+    return m_heapType;
+}
+
+bool PersistentMQueue::better(int key1, int key2) const {
+    return m_heapType == MINHEAP ? key1 < key2 : key1 > key2;
+}
+
+// Leftist merge down the right spines. Takes over the caller's reference
+// to both heaps and returns one to the result. Each node on the path is
+// made private to this queue first, by copying it if it is shared.
+PersistentMQueue::Node* PersistentMQueue::merge(Node* heap1, Node* heap2) const {
+    if (!heap1) return heap2;
+    if (!heap2) return heap1;
+    if (better(heap2->m_key, heap1->m_key)) std::swap(heap1, heap2);
+    Node* node = unshare(heap1);
+    node->m_right = merge(node->m_right, heap2);
+    if (npl(node->m_left) < npl(node->m_right)) std::swap(node->m_left, node->m_right);
+    node->m_npl = npl(node->m_right) + 1;
+    return node;
+}
+
+// Turns single-node heaps into one heap by merging them in pairs, round
+// after round, so the build is O(n)
+PersistentMQueue::Node* PersistentMQueue::heapify(std::vector<Node*>& nodes) const {
+    size_t count = nodes.size();
+    if (count == 0) return nullptr;
+    while (count > 1) {
+        size_t out = 0;
+        for (size_t i = 0; i + 1 < count; i += 2) {
+            nodes[out++] = merge(nodes[i], nodes[i + 1]);
+        }
+        if (count % 2 == 1) nodes[out++] = nodes[count - 1];
+        count = out;
+    }
+    return nodes[0];
+}
+
+PersistentMQueue::Node* PersistentMQueue::retain(Node* node) {
+    if (node) node->m_refs.fetch_add(1, std::memory_order_relaxed);
+    return node;
+}
+
+// Drops one reference, deleting the nodes that no queue or parent refers
+// to any more. Iterative, since a leftist heap's left paths can be as long
+// as the heap is large.
+void PersistentMQueue::release(Node* node) {
+    std::vector<Node*> pending;
+    while (true) {
+        if (node && node->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (node->m_right) pending.push_back(node->m_right);
+            Node* left = node->m_left;
+            delete node;
+            node = left;
+            continue;
+        }
+        if (pending.empty()) return;
+        node = pending.back();
+        pending.pop_back();
+    }
+}
+
+// Returns a node this queue owns alone: node itself if no one else refers
+// to it, otherwise a copy that shares node's children
+PersistentMQueue::Node* PersistentMQueue::unshare(Node* node) {
+    if (node->m_refs.load(std::memory_order_acquire) == 1) return node;
+    Node* copy = new Node(node->m_order, node->m_key);
+    copy->m_left = retain(node->m_left);
+    copy->m_right = retain(node->m_right);
+    copy->m_npl = node->m_npl;
+    release(node);
+    return copy;
+}
+
+int PersistentMQueue::npl(const Node* node) {
+    return node ? node->m_npl : -1;
+}
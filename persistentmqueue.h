@@ -0,0 +1,94 @@
+#ifndef PERSISTENTMQUEUE_H
+#define PERSISTENTMQUEUE_H
+
+#include <atomic>
+#include <vector>
+#include "mqueue.h"
+
+//
+// persistent queue class
+//
+// A leftist heap whose nodes are shared between copies. Each node counts
+// the queues and parent nodes that refer to it, so copying a queue is O(1):
+// the copy points at the same root. A change rebuilds only the nodes on
+// the right spines it walks, O(log n) of them, and only those that another
+// copy still shares; nodes a queue owns alone are changed in place. Every
+// copy keeps seeing the orders it had.
+//
+// Meant for what-if planning, where many short-lived copies of one large
+// queue each get a few changes. Copies may be used from different threads;
+// a single queue may not.
+//
+class PersistentMQueue {
+  public:
+    friend class Tester; // for testing purposes
+    PersistentMQueue() : m_heap(nullptr), m_size(0), m_priorFunc(nullptr), m_heapType(MINHEAP) {}
+    PersistentMQueue(prifn_t priFn, HEAPTYPE heapType)
+        : m_heap(nullptr), m_size(0), m_priorFunc(priFn), m_heapType(heapType) {}
+    // Builds the heap in O(n) by merging in pairs, like MQueue's bulk
+    // constructor
+    template <class InputIt>
+    PersistentMQueue(InputIt first, InputIt last, prifn_t priFn, HEAPTYPE heapType);
+    // Takes a copy of the orders of queue, with its priority function and
+    // heap type
+    explicit PersistentMQueue(const MQueue& queue);
+    ~PersistentMQueue();
+    PersistentMQueue(const PersistentMQueue& rhs);              // O(1)
+    PersistentMQueue& operator=(const PersistentMQueue& rhs);   // O(1) plus releasing the old heap
+    PersistentMQueue(PersistentMQueue&& rhs) noexcept;
+    PersistentMQueue& operator=(PersistentMQueue&& rhs) noexcept;
+    void clear();
+    // Returns false without inserting if the priority is negative
+    bool insertOrder(const Order& order);
+    // Throws out_of_range if the queue is empty
+    Order getNextOrder();
+    const Order& peekNextOrder() const;
+    // Adds the orders of rhs. Unlike MQueue::mergeWithQueue, rhs keeps its
+    // orders, since the two queues can simply share them. Throws
+    // domain_error if the priority functions or heap types differ.
+    void mergeWithQueue(const PersistentMQueue& rhs);
+    // Rebuilds the heap in O(n)
+    void setPriorityFn(prifn_t priFn, HEAPTYPE heapType);
+    int numOrders() const;
+    prifn_t getPriorityFn() const;
+    HEAPTYPE getHeapType() const;
+
+  private:
+    struct Node {
+        Node(const Order& order, int key) : m_order(order), m_left(nullptr), m_right(nullptr),
+                                            m_npl(0), m_key(key), m_refs(1) {}
+        Order m_order;
+        Node* m_left;
+        Node* m_right;
+        int m_npl;
+        int m_key;
+        std::atomic<int> m_refs;    // queues and parents pointing here
+    };
+
+    Node* m_heap;
+    int m_size;
+    prifn_t m_priorFunc;
+    HEAPTYPE m_heapType;
+
+    bool better(int key1, int key2) const;
+    Node* merge(Node* heap1, Node* heap2) const;
+    Node* heapify(std::vector<Node*>& nodes) const;
+    static Node* retain(Node* node);
+    static void release(Node* node);
+    static Node* unshare(Node* node);
+    static int npl(const Node* node);
+};
+
+template <class InputIt>
+PersistentMQueue::PersistentMQueue(InputIt first, InputIt last, prifn_t priFn, HEAPTYPE heapType)
+    : m_heap(nullptr), m_size(0), m_priorFunc(priFn), m_heapType(heapType) {
+    std::vector<Node*> nodes;
+    for (; first != last; ++first) {
+        int key = m_priorFunc(*first);
+        if (key >= 0) nodes.push_back(new Node(*first, key));
+    }
+    m_size = (int)nodes.size();
+    m_heap = heapify(nodes);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#include "reclaimer.h"
+
+Reclaimer::Reclaimer()
+    : m_pendingQueues(0), m_pendingOrders(0), m_peakOrders(0), m_stopping(false),
+      m_thread(&Reclaimer::run, this) {}
+
+Reclaimer::~Reclaimer() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_work.notify_one();
+    m_thread.join();
+}
+
+void Reclaimer::retire(MQueue* queue) {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_retired.push_back(queue);
+        ++m_pendingQueues;
+        m_pendingOrders += queue->numOrders();
+        if (m_pendingOrders > m_peakOrders) m_peakOrders = m_pendingOrders;
+    }
+    m_work.notify_one();
+}
+
+void Reclaimer::flush() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_done.wait(guard, [this] {return m_pendingQueues == 0;});
+}
+
+uint64_t Reclaimer::pendingOrders() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_pendingOrders;
+}
+
+uint64_t Reclaimer::peakPendingOrders() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_peakOrders;
+}
+
+void Reclaimer::resetPeak() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_peakOrders = m_pendingOrders;
+}
+
+// Frees the retired queues in order, outside the lock. Closing only ends
+// the thread once nothing is left.
+void Reclaimer::run() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (true) {
+        m_work.wait(guard, [this] {return m_stopping || !m_retired.empty();});
+        if (m_retired.empty()) return;
+        MQueue* queue = m_retired.front();
+        m_retired.pop_front();
+        guard.unlock();
+        uint64_t orders = queue->numOrders();
+        delete queue;
+        guard.lock();
+        m_pendingOrders -= orders;
+        if (--m_pendingQueues == 0) m_done.notify_all();
+    }
+}
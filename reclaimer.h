@@ -0,0 +1,60 @@
+#ifndef RECLAIMER_H
+#define RECLAIMER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "mqueue.h"
+
+//
+// reclaimer class
+//
+// Frees the nodes of dropped queues on a background thread. A queue with a
+// reclaimer attached (MQueue::setReclaimer) moves its nodes into a queue
+// of their own on clear(), destruction or assignment and retires that
+// queue here in O(1), so a large queue can be dropped without holding up
+// its owner. Until the thread gets to them, the retired orders still take
+// their memory: a queue that is dropped and refilled at once briefly holds
+// twice its usual footprint. peakPendingOrders() reports how far it got.
+//
+// One reclaimer may serve any number of queues on any threads. It must
+// outlive every queue attached to it, or be detached from them first with
+// setReclaimer(nullptr): a queue that outlives it would retire its nodes
+// into a destroyed object. Nothing checks this.
+//
+class Reclaimer {
+  public:
+    Reclaimer();
+    // Frees everything still pending first
+    ~Reclaimer();
+    Reclaimer(const Reclaimer&) = delete;
+    Reclaimer& operator=(const Reclaimer&) = delete;
+    // Takes ownership of queue, which must have no reclaimer attached.
+    // If it cannot be queued, throws bad_alloc (or system_error from the
+    // lock) and leaves queue with the caller.
+    void retire(MQueue* queue);
+    // Waits until every queue retired so far is freed
+    void flush();
+    // Orders retired and not yet freed
+    uint64_t pendingOrders() const;
+    // Most orders ever pending at once, since construction or resetPeak()
+    uint64_t peakPendingOrders() const;
+    void resetPeak();
+
+  private:
+    mutable std::mutex m_lock;      // guards everything below but m_thread
+    std::condition_variable m_work; // a queue was retired, or the reclaimer is closing
+    std::condition_variable m_done; // everything retired has been freed
+    std::deque<MQueue*> m_retired;
+    uint64_t m_pendingQueues;       // in m_retired or being freed
+    uint64_t m_pendingOrders;
+    uint64_t m_peakOrders;
+    bool m_stopping;
+    std::thread m_thread;           // started last, once the rest is set up
+
+    void run();
+};
+
+#endif
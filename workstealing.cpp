@@ -0,0 +1,93 @@
+#include "workstealing.h"
+#include <stdexcept>
+
+WorkStealingMQueue::WorkStealingMQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure,
+                                       int numWorkers)
+    : m_steals(0) {
+    if (numWorkers < 1) throw std::out_of_range("WorkStealingMQueue needs at least one worker.");
+    if (structure == DARY) throw std::domain_error("WorkStealingMQueue cannot split a DARY queue.");
+    for (int i = 0; i < numWorkers; i++) {
+        m_workers.emplace_back(new Worker(priFn, heapType, structure));
+    }
+}
+
+bool WorkStealingMQueue::insertOrder(int index, const Order& order) {
+    Worker& self = worker(index);
+    std::lock_guard<std::mutex> guard(self.lock);
+    if (!self.queue.insertOrder(order)) return false;
+    self.size.store(self.queue.numOrders(), std::memory_order_relaxed);
+    return true;
+}
+
+// Pops locally; an empty queue is refilled by a steal and tried again,
+// since another thief may empty it in between
+bool WorkStealingMQueue::tryGetNextOrder(int index, Order& order) {
+    Worker& self = worker(index);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(self.lock);
+            if (self.queue.numOrders() > 0) {
+                order = self.queue.getNextOrder();
+                self.size.store(self.queue.numOrders(), std::memory_order_relaxed);
+                return true;
+            }
+        }
+        if (!steal(index)) return false;
+    }
+}
+
+int WorkStealingMQueue::numOrders() const {
+    int total = 0;
+    for (const auto& worker : m_workers) total += worker->size.load(std::memory_order_relaxed);
+    return total;
+}
+
+int WorkStealingMQueue::numOrders(int index) const {
+    return worker(index).size.load(std::memory_order_relaxed);
+}
+
+int WorkStealingMQueue::numWorkers() const {
+    return (int)m_workers.size();
+}
+
+int WorkStealingMQueue::numSteals() const {
+    return m_steals.load(std::memory_order_relaxed);
+}
+
+// Splits the fullest other queue and merges the detached part into the
+// thief's queue. Returns false if every other queue looked empty.
+bool WorkStealingMQueue::steal(int thief) {
+    while (true) {
+        int victim = -1, most = 0;
+        for (int i = 0; i < (int)m_workers.size(); i++) {
+            int size = m_workers[i]->size.load(std::memory_order_relaxed);
+            if (i != thief && size > most) {
+                victim = i;
+                most = size;
+            }
+        }
+        if (victim < 0) return false;
+
+        MQueue part;
+        {
+            Worker& from = *m_workers[victim];
+            std::lock_guard<std::mutex> guard(from.lock);
+            if (from.queue.numOrders() == 0) continue;   // emptied since we looked
+            part = from.queue.splitQueue();
+            // A lone root has nothing to split off, so take the root itself
+            if (part.numOrders() == 0) part.insertOrder(from.queue.getNextOrder());
+            from.size.store(from.queue.numOrders(), std::memory_order_relaxed);
+        }
+        Worker& self = *m_workers[thief];
+        std::lock_guard<std::mutex> guard(self.lock);
+        self.queue.mergeWithQueue(part);
+        self.size.store(self.queue.numOrders(), std::memory_order_relaxed);
+        m_steals.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+}
+
+WorkStealingMQueue::Worker& WorkStealingMQueue::worker(int index) const {
+    if (index < 0 || index >= (int)m_workers.size()) throw std::out_of_range("No such worker.");
+    return *m_workers[index];
+}
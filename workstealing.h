@@ -0,0 +1,58 @@
+#ifndef WORKSTEALING_H
+#define WORKSTEALING_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "mqueue.h"
+
+//
+// work-stealing queue class
+//
+// One MQueue per worker. A worker inserts into and pops from its own
+// queue, so its lock is almost never contended. A worker whose queue runs
+// dry steals from the worker with the most orders: it splits that queue
+// with splitQueue and absorbs the detached part with mergeWithQueue, so a
+// single steal moves a large batch of work instead of one order. No
+// thread ever holds two queue locks at once. The structure must be one
+// splitQueue supports, so DARY is refused with domain_error.
+//
+// Pops are in exact priority order within one worker's queue only.
+//
+class WorkStealingMQueue {
+  public:
+    friend class Tester; // for testing purposes
+    WorkStealingMQueue(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure, int numWorkers);
+    WorkStealingMQueue(const WorkStealingMQueue&) = delete;
+    WorkStealingMQueue& operator=(const WorkStealingMQueue&) = delete;
+    // Inserts into the queue of worker; any thread may call it
+    bool insertOrder(int worker, const Order& order);
+    // Pops from the queue of worker, stealing when it is empty; returns
+    // false only if no other worker had orders to steal
+    bool tryGetNextOrder(int worker, Order& order);
+    // Exact once no other thread is inserting or popping
+    int numOrders() const;
+    int numOrders(int worker) const;
+    int numWorkers() const;
+    int numSteals() const;
+
+  private:
+    // A worker's queue on its own cache line; size mirrors queue.numOrders()
+    // so thieves can pick a victim without locking
+    struct alignas(64) Worker {
+        Worker(prifn_t priFn, HEAPTYPE heapType, STRUCTURE structure)
+            : queue(priFn, heapType, structure), size(0) {}
+        std::mutex lock;
+        MQueue queue;
+        std::atomic<int> size;
+    };
+
+    std::vector<std::unique_ptr<Worker> > m_workers;
+    std::atomic<int> m_steals;  // successful steals
+
+    bool steal(int thief);
+    Worker& worker(int index) const;
+};
+
+#endif